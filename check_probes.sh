@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Проверка статических точек трассировки (USDT) из main.cpp.
+#
+# Собирает main.cpp с <sys/sdt.h> (пакет systemtap-sdt-dev) и проверяет
+# через readelf -n, что в .note.stapsdt есть все пробы провайдера
+# memory_manager. Если доступен bpftrace и скрипт запущен от root, ещё
+# прогоняет маленькую трассу и требует, чтобы проба split сработала хотя
+# бы раз. Компилятор и флаги берутся из CXX и CXXFLAGS.
+#
+#   ./check_probes.sh
+#   CXX=clang++ CXXFLAGS=-O1 ./check_probes.sh
+
+set -eu
+
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:-}
+PROBES="allocate_entry allocate_exit free split merge heap_sift_up
+        heap_sift_down"
+
+source_directory=$(cd "$(dirname "$0")" && pwd)
+work_directory=$(mktemp -d)
+trap 'rm -rf "$work_directory"' EXIT INT TERM
+binary=$work_directory/main
+
+fail() {
+  echo "check_probes: $*" >&2
+  exit 1
+}
+
+# shellcheck disable=SC2086
+"$CXX" -std=c++17 -O2 $CXXFLAGS -o "$binary" "$source_directory/main.cpp"
+
+notes=$(readelf -n "$binary")
+echo "$notes" | grep -q "Provider: memory_manager" ||
+    fail "no memory_manager probes in .note.stapsdt (is <sys/sdt.h> installed?)"
+for probe in $PROBES; do
+  echo "$notes" | grep -Eq "Name: $probe\$" || fail "probe $probe is missing"
+done
+echo "stapsdt notes: ok"
+
+if ! command -v bpftrace >/dev/null 2>&1; then
+  echo "bpftrace not found, skipping the firing check"
+  exit 0
+fi
+if [ "$(id -u)" -ne 0 ]; then
+  echo "bpftrace needs root, skipping the firing check"
+  exit 0
+fi
+
+# Два выделения из 1000 байт — два разрезания сегмента.
+printf '1000\n2\n100 200\n' > "$work_directory/trace.txt"
+splits=$(bpftrace -q \
+    -e "usdt:$binary:memory_manager:split { @splits = count(); }" \
+    -c "$binary --input=$work_directory/trace.txt" |
+    sed -n 's/^@splits: *//p')
+[ -n "$splits" ] && [ "$splits" -gt 0 ] ||
+    fail "probe split did not fire"
+echo "split probe fired $splits times: ok"
@@ -1,23 +1,134 @@
 // INTERFACE /////////////////////////////////////
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <list>
+#include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 #include <utility>
 
+#if defined(__unix__)
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/uio.h>
+#endif
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+/*
+ * Сжатые трассы: gzip читается через zlib (-DMEMORY_MANAGER_WITH_ZLIB -lz),
+ * zstd — через libzstd (-DMEMORY_MANAGER_WITH_ZSTD -lzstd).
+ */
+#if defined(MEMORY_MANAGER_WITH_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(MEMORY_MANAGER_WITH_ZSTD)
+#include <zstd.h>
+#endif
+
+/*
+ * Статические точки трассировки (USDT) для bpftrace/perf/systemtap:
+ * провайдер memory_manager, пробы allocate_entry, allocate_exit, free,
+ * split, merge, heap_sift_up и heap_sift_down. Пока к пробе никто не
+ * подключён, на её месте стоит один nop, и работают они и во встроенных
+ * копиях шаблонов, в отличие от uprobe. Нужен <sys/sdt.h> (пакет
+ * systemtap-sdt-dev); без него, или с -DMEMORY_MANAGER_NO_PROBES, макросы
+ * ничего не делают. Что пробы есть в .note.stapsdt и срабатывают,
+ * проверяет check_probes.sh (readelf -n, а при наличии bpftrace — счётчик
+ * срабатываний split на маленькой трассе).
+ */
+#if defined(__has_include) && !defined(MEMORY_MANAGER_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MEMORY_MANAGER_PROBE1(name, a) \
+    DTRACE_PROBE1(memory_manager, name, a)
+#define MEMORY_MANAGER_PROBE2(name, a, b) \
+    DTRACE_PROBE2(memory_manager, name, a, b)
+#define MEMORY_MANAGER_PROBE3(name, a, b, c) \
+    DTRACE_PROBE3(memory_manager, name, a, b, c)
+#define MEMORY_MANAGER_PROBE4(name, a, b, c, d) \
+    DTRACE_PROBE4(memory_manager, name, a, b, c, d)
+#endif
+#endif
+
+#ifndef MEMORY_MANAGER_PROBE1
+#define MEMORY_MANAGER_PROBE1(name, a) \
+    do { (void)sizeof(a); } while (false)
+#define MEMORY_MANAGER_PROBE2(name, a, b) \
+    do { (void)sizeof(a); (void)sizeof(b); } while (false)
+#define MEMORY_MANAGER_PROBE3(name, a, b, c) \
+    do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (false)
+#define MEMORY_MANAGER_PROBE4(name, a, b, c, d) \
+    do { \
+      (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); (void)sizeof(d); \
+    } while (false)
+#endif
+
 using std::cin;
 using std::cerr;
 using std::cout;
 using std::endl;
 
+/*
+ * Счётчики работы кучи: число операций (push/erase/update) и суммарное
+ * число шагов просеивания, то есть обменов. Их разность до и после
+ * операции даёт глубину просеивания.
+ */
+struct HeapStatistics {
+  size_t operations = 0;
+  size_t sift_steps = 0;
+};
+
 /*
  * Мы реализуем стандартный класс для хранения кучи с возможностью доступа
  * к элементам по индексам. Для оповещения внешних объектов о текущих значениях
  * индексов мы используем функцию index_change_observer.
+ *
+ * Куча, созданная через WithStableHandles, работает как индексированная
+ * очередь с приоритетами: push возвращает ручку, которая не меняется при
+ * просеиваниях, а erase/update/get принимают ручку и находят позицию
+ * по внутренней таблице. Наблюдатель в этом режиме не нужен.
+ *
+ * Арность кучи (число сыновей у вершины) задаётся при создании и должна
+ * быть степенью двойки; по умолчанию куча двоичная.
+ *
+ * reserve заранее выделяет место под capacity элементов, чтобы push
+ * до этого размера не перевыделял массивы (и не копировал их целиком).
+ *
+ * second возвращает элемент, который окажется на вершине после pop(), —
+ * лучшего из сыновей корня, то есть за O(arity); в куче должно быть
+ * не меньше двух элементов.
  */
 
 template <class T, class Compare = std::less<T> >
@@ -30,23 +141,40 @@ class Heap {
 
   explicit Heap(
       Compare compare = Compare(),
-      IndexChangeObserver index_change_observer = IndexChangeObserver());
+      IndexChangeObserver index_change_observer = IndexChangeObserver(),
+      size_t arity = 2);
+  static Heap WithStableHandles(Compare compare = Compare(),
+                                size_t arity = 2);
 
   size_t push(const T& value);
   void erase(size_t index);
+  void update(size_t index);
+  const T& get(size_t index) const;
   const T& top() const;
+  const T& second() const;
   void pop();
+  void reserve(size_t capacity);
   size_t size() const;
   bool empty() const;
+  const HeapStatistics& Statistics() const;
 
  private:
   IndexChangeObserver index_change_observer_;
   Compare compare_;
   std::vector<T> elements_;
+  HeapStatistics statistics_;
+  size_t arity_;
+  int arity_shift_;
+  bool stable_handles_;
+  std::vector<size_t> element_handles_;
+  std::vector<size_t> handle_positions_;
+  std::vector<size_t> free_handles_;
+
+  size_t Position(size_t index) const;
+  void ErasePosition(size_t position);
 
   size_t Parent(size_t index) const;
-  size_t LeftSon(size_t index) const;
-  size_t RightSon(size_t index) const;
+  size_t FirstSon(size_t index) const;
 
   bool CompareElements(size_t first_index, size_t second_index) const;
   void NotifyIndexChange(const T& element, size_t new_element_index);
@@ -84,6 +212,257 @@ struct MemorySegmentsHeapObserver {
   void operator() (MemorySegmentIterator segment, size_t new_index) const;
 };
 
+/*
+ * Индекс свободных сегментов, которым пользуется MemoryManager: вставка
+ * и удаление по итератору на список и доступ через top() к самому левому
+ * из наидлиннейших свободных сегментов, а через second() — к сегменту,
+ * который окажется на вершине без него (индекс должен содержать не меньше
+ * двух сегментов). Сегмент свободен тогда и только тогда, когда его
+ * heap_index отличен от kNullIndex, и поддерживать эту метку —
+ * обязанность индекса. Удалять сегмент из индекса нужно до того, как
+ * у него поменяются границы.
+ *
+ * MemorySegmentHeapIndex — обычная куча итераторов, heap_index хранит
+ * позицию сегмента в ней.
+ */
+
+class MemorySegmentHeapIndex {
+ public:
+  explicit MemorySegmentHeapIndex(size_t heap_arity = 2);
+
+  void push(MemorySegmentIterator segment);
+  void erase(MemorySegmentIterator segment);
+  MemorySegmentIterator top() const;
+  MemorySegmentIterator second() const;
+  void reserve(size_t capacity);
+  size_t size() const;
+  bool empty() const;
+  HeapStatistics Statistics() const;
+
+ private:
+  MemorySegmentHeap heap_;
+};
+
+
+/*
+ * MemorySegmentHandleIndex — та же куча, но в режиме стабильных ручек:
+ * heap_index хранит ручку, которая не меняется при просеиваниях, так что
+ * наблюдатель и обратные записи в сегменты при каждом обмене не нужны.
+ */
+
+class MemorySegmentHandleIndex {
+ public:
+  explicit MemorySegmentHandleIndex(size_t heap_arity = 2);
+
+  void push(MemorySegmentIterator segment);
+  void erase(MemorySegmentIterator segment);
+  MemorySegmentIterator top() const;
+  MemorySegmentIterator second() const;
+  void reserve(size_t capacity);
+  size_t size() const;
+  bool empty() const;
+  HeapStatistics Statistics() const;
+
+ private:
+  MemorySegmentHeap heap_;
+};
+
+
+struct MemorySegmentLeftCompare {
+  bool operator() (MemorySegmentIterator first,
+                   MemorySegmentIterator second) const;
+};
+
+
+using MemorySegmentLeftHeap =
+    Heap<MemorySegmentIterator, MemorySegmentLeftCompare>;
+
+/*
+ * BucketedMemorySegmentHeap держит в куче по одной записи на каждый
+ * различный размер свободных сегментов. Запись (корзина) владеет кучей
+ * сегментов этого размера, упорядоченной по left, и heap_index сегмента
+ * указывает его позицию именно там. Вставка в уже существующую корзину
+ * и удаление из корзины, в которой что-то остаётся, внешнюю кучу не
+ * трогают; когда одинаковых сегментов много, внешняя куча остаётся
+ * мелкой. Самый левый из наидлиннейших — вершина корзины на вершине кучи.
+ *
+ * Внутри корзины сегменты лежат в куче по left, а не в полностью
+ * упорядоченном контейнере: спрашиваются только два самых левых (top
+ * и second), а heap_index даёт удаление без поиска и без выделения узла
+ * на каждую вставку, как было бы у std::set.
+ */
+
+class BucketedMemorySegmentHeap {
+ public:
+  explicit BucketedMemorySegmentHeap(size_t heap_arity = 2);
+
+  void push(MemorySegmentIterator segment);
+  void erase(MemorySegmentIterator segment);
+  MemorySegmentIterator top() const;
+  MemorySegmentIterator second() const;
+  void reserve(size_t capacity);
+  size_t size() const;
+  bool empty() const;
+  HeapStatistics Statistics() const;
+
+ private:
+  struct Bucket {
+    size_t size;
+    size_t heap_index;
+    MemorySegmentLeftHeap segments;
+
+    explicit Bucket(size_t size);
+  };
+
+  struct BucketSizeCompare {
+    bool operator() (const Bucket* first, const Bucket* second) const;
+  };
+
+  struct BucketHeapObserver {
+    void operator() (Bucket* bucket, size_t new_index) const;
+  };
+
+  Heap<Bucket*, BucketSizeCompare> buckets_heap_;
+  std::unordered_map<size_t, Bucket> buckets_;
+  size_t segments_count_;
+  HeapStatistics buckets_statistics_;
+
+  void AccountBucketWork(const HeapStatistics& before, const Bucket& bucket);
+};
+
+/*
+ * Дополнительные параметры размещения блока. page_size != 0 включает
+ * постраничное размещение: блок не больше страницы, который пересёк бы
+ * границу страницы, сдвигается внутри выбранного свободного сегмента
+ * к ближайшей границе (если там хватает места), а левый остаток
+ * возвращается в кучу свободных сегментов.
+ *
+ * alignment != 0 требует, чтобы смещение блока было кратно alignment:
+ * блок ставится на первую подходящую границу внутри самого левого из
+ * наидлиннейших свободных сегментов, а если с выравниванием он туда
+ * не помещается, выделение не удаётся.
+ *
+ * priority — класс приоритета выделения: чем больше номер, тем класс
+ * важнее. Менеджер с PriorityWatermarks (см. ниже) отказывает классу,
+ * если выделение съело бы запас, отведённый для более важных классов.
+ */
+struct AllocationOptions {
+  size_t page_size = 0;
+  size_t alignment = 0;
+  size_t priority = 0;
+};
+
+/*
+ * Водяные знаки классов приоритета: watermarks[c] — сколько свободной
+ * памяти (free_size) и какой наибольший свободный сегмент
+ * (largest_free_size) должны остаться после выделения класса c. Запас
+ * класса c — то, во что могут залезть только классы важнее него, поэтому
+ * водяные знаки обычно не возрастают с номером класса; у классов дальше
+ * конца вектора запаса нет. Пустой вектор — приоритеты не учитываются.
+ *
+ * Проверка идёт за O(1) (O(arity) для второго по величине сегмента) по
+ * поддерживаемым менеджером счётчикам: свободная память после выделения
+ * известна сразу, а наибольший свободный сегмент после него — это
+ * наибольший из остатков разрезаемого сегмента и сегмента, который
+ * окажется на вершине кучи без него (Heap::second). Выделения по
+ * смещению (AllocateAt) и уменьшение блоков водяные знаки не проверяют.
+ */
+struct PriorityWatermark {
+  size_t free_size = 0;
+  size_t largest_free_size = 0;
+};
+
+using PriorityWatermarks = std::vector<PriorityWatermark>;
+
+/*
+ * Пройдёт ли выделение класса priority, после которого останется
+ * free_size свободной памяти с наибольшим сегментом largest_free_size.
+ */
+bool WithinPriorityWatermarks(const PriorityWatermarks& watermarks,
+                              size_t priority, size_t free_size,
+                              size_t largest_free_size);
+
+/*
+ * Смещение блока размера size внутри свободного сегмента [left, right)
+ * с учётом AllocationOptions или -1, если блок с таким выравниванием
+ * в сегмент не помещается.
+ */
+int PlacementOffset(int left, int right, size_t size,
+                    const AllocationOptions& options);
+
+struct MemoryManagerPlacementStatistics {
+  size_t shifted_allocations = 0;
+  size_t padding_size = 0;
+  size_t watermark_rejections = 0;
+};
+
+/*
+ * Накопленная работа менеджера: операции и шаги просеивания в индексе
+ * свободных сегментов, разрезания сегментов и слияния соседей.
+ */
+struct MemoryManagerCounters {
+  size_t heap_operations = 0;
+  size_t sift_steps = 0;
+  size_t splits = 0;
+  size_t merges = 0;
+};
+
+/*
+ * Дайджест раскладки менеджера — дерево хешей над сегментами в порядке
+ * адресов. Адресное пространство [0, memory_size) делится на leaves_count
+ * равных участков (листьев полного двоичного дерева); лист хранит сумму
+ * по модулю 2^64 хешей сегментов (left, right, свободен ли), которые
+ * начинаются на его участке, а вершина — сумму сыновей. Добавление или
+ * удаление сегмента обновляет путь от листа к корню, то есть
+ * O(log leaves_count), а две раскладки сравниваются по корню за O(1).
+ * Сравнение вероятностное: разные раскладки совпадают по корню
+ * с вероятностью порядка 2^-64.
+ *
+ * FindLayoutDivergence спускается из корня в первое по адресам
+ * поддерево, где дайджесты различаются, и возвращает участок
+ * [*left, *right) соответствующего листа — там начинается хотя бы один
+ * сегмент, которого нет у другой стороны. Дайджесты должны быть
+ * построены для одного memory_size и одного leaves_count.
+ */
+class MemoryLayoutDigest {
+ public:
+  explicit MemoryLayoutDigest(size_t memory_size,
+                              size_t leaves_count = 1 << 16);
+
+  void Add(int left, int right, bool free);
+  void Remove(int left, int right, bool free);
+  uint64_t Root() const;
+
+  friend bool FindLayoutDivergence(const MemoryLayoutDigest& first,
+                                   const MemoryLayoutDigest& second,
+                                   size_t* left, size_t* right);
+
+ private:
+  size_t memory_size_;
+  size_t leaves_count_;
+  size_t leaf_size_;
+  std::vector<uint64_t> nodes_;
+
+  static uint64_t SegmentHash(int left, int right, bool free);
+  void Update(int left, uint64_t delta);
+};
+
+bool FindLayoutDivergence(const MemoryLayoutDigest& first,
+                          const MemoryLayoutDigest& second,
+                          size_t* left, size_t* right);
+
+/*
+ * Снимок раскладки менеджера: все сегменты по возрастанию адресов
+ * и признак, свободен ли сегмент.
+ */
+struct MemoryManagerSnapshotSegment {
+  int left;
+  int right;
+  bool free;
+};
+
+using MemoryManagerSnapshot = std::vector<MemoryManagerSnapshotSegment>;
+
 /*
  * Мы храним сегменты в виде двухсвязного списка (std::list).
  * Быстрый доступ к самому левому из наидлиннейших свободных отрезков
@@ -94,24 +473,681 @@ struct MemorySegmentsHeapObserver {
  * поддерживаем с помощью index_change_observer. Мы не храним отдельной метки
  * для маркировки занятых сегментов: вместо этого мы кладём в heap_index
  * специальный kNullIndex.
+ *
+ * Сама куча — параметр шаблона FreeSegmentIndex (см. выше), MemoryManager —
+ * вариант с обычной кучей, BucketedMemoryManager — с корзинами равных
+ * размеров. Ответы у них совпадают.
+ *
+ * AllocateAt выделяет блок ровно по заданному смещению, если он целиком
+ * лежит в одном свободном сегменте; сегмент ищется проходом по списку,
+ * то есть за линейное время. Reallocate меняет размер блока на месте,
+ * когда это возможно (уменьшение или рост за счёт свободного правого
+ * соседа), а иначе выделяет новый блок и освобождает старый. При неудаче
+ * возвращается end(), а старый блок остаётся занятым.
+ *
+ * SlideLeft переносит занятый блок в начало свободного сегмента слева
+ * от него, а освободившееся место сливает со свободным соседом справа;
+ * итератор блока остаётся действительным. Перенести сами данные —
+ * забота вызывающего. begin() и end() дают обход всех сегментов
+ * по адресам.
+ *
+ * Reserve заранее выделяет место в индексе свободных сегментов под
+ * segments_count сегментов (см. Heap::reserve).
+ *
+ * EnableLayoutDigest строит MemoryLayoutDigest по текущим сегментам
+ * (за линейное время), и дальше каждое разрезание и слияние обновляют
+ * его; LayoutDigest возвращает nullptr, пока дайджест не включён.
+ *
+ * SetPriorityWatermarks задаёт водяные знаки классов приоритета (см.
+ * PriorityWatermark). Их проверяют Allocate и рост блока в Reallocate,
+ * в том числе на месте; отказ считается в watermark_rejections.
+ *
+ * Snapshot снимает раскладку за линейное время, а Restore заменяет ею
+ * текущую (старые итераторы становятся недействительными) и возвращает
+ * итераторы новых сегментов в том же порядке. Раскладка должна покрывать
+ * [0, memory_size) без пропусков, иначе бросается std::invalid_argument.
+ *
+ * AllocateGang выделяет группу блоков размеров sizes подряд из одного
+ * свободного сегмента — того же, что взял бы Allocate, — с начала
+ * сегмента; каждый блок размещается по AllocationOptions (выравнивание
+ * и страницы) сразу за предыдущим. Сегмент один раз уходит из индекса
+ * свободных и один раз возвращается остатком, промежутки выравнивания
+ * между блоками становятся свободными сегментами. Блоки — обычные,
+ * освобождать их можно по одному. Водяные знаки проверяются для суммы
+ * размеров. Если группа целиком не помещается, ничего не выделяется
+ * и возвращается пустой вектор.
  */
 
-class MemoryManager {
+template <class FreeSegmentIndex>
+class BasicMemoryManager {
  public:
   using Iterator = MemorySegmentIterator;
   using ConstIterator = MemorySegmentConstIterator;
 
-  explicit MemoryManager(size_t memory_size);
+  explicit BasicMemoryManager(size_t memory_size, size_t heap_arity = 2);
   Iterator Allocate(size_t size);
+  Iterator Allocate(size_t size, const AllocationOptions& options);
+  Iterator AllocateAt(size_t offset, size_t size);
+  Iterator Reallocate(Iterator position, size_t size,
+                      const AllocationOptions& options);
   void Free(Iterator position);
+  Iterator SlideLeft(Iterator position);
+  Iterator begin();
   Iterator end();
   ConstIterator end() const;
 
+  size_t FreeMemorySize() const;
+  size_t FreeSegmentsCount() const;
+  size_t LargestFreeSegmentSize() const;
+  const MemoryManagerPlacementStatistics& PlacementStatistics() const;
+  MemoryManagerCounters Counters() const;
+  int Offset(ConstIterator position) const;
+  size_t AllocatedBlocksCount() const;
+  size_t MetadataSize() const;
+  void Reserve(size_t segments_count);
+  void SetPriorityWatermarks(const PriorityWatermarks& watermarks);
+  MemoryManagerSnapshot Snapshot() const;
+  std::vector<Iterator> Restore(const MemoryManagerSnapshot& snapshot);
+  std::vector<Iterator> AllocateGang(const std::vector<size_t>& sizes);
+  std::vector<Iterator> AllocateGang(const std::vector<size_t>& sizes,
+                                     const AllocationOptions& options);
+
+  void EnableLayoutDigest(size_t leaves_count = 1 << 16);
+  const MemoryLayoutDigest* LayoutDigest() const;
+
  private:
-  MemorySegmentHeap free_memory_segments_;
+  FreeSegmentIndex free_memory_segments_;
   std::list<MemorySegment> memory_segments_;
-
+  size_t memory_size_;
+  size_t free_memory_size_;
+  MemoryManagerPlacementStatistics placement_statistics_;
+  size_t splits_count_;
+  size_t merges_count_;
+  std::unique_ptr<MemoryLayoutDigest> layout_digest_;
+  PriorityWatermarks priority_watermarks_;
+
+  Iterator Carve(Iterator free_segment, int offset, size_t size);
+  // Пройдёт ли выделение size байт класса priority из свободного сегмента
+  // segment, после которого от него останутся куски left_rest и right_rest.
+  bool AdmitsPriority(size_t priority, size_t size, Iterator segment,
+                      size_t left_rest, size_t right_rest);
+  // Сегмент remaining на время вызова не должен быть в дайджесте.
   void AppendIfFree(Iterator remaining, Iterator appending);
+  void DigestAdd(const MemorySegment& segment, bool free);
+  void DigestRemove(const MemorySegment& segment, bool free);
+};
+
+using MemoryManager = BasicMemoryManager<MemorySegmentHeapIndex>;
+using BucketedMemoryManager = BasicMemoryManager<BucketedMemorySegmentHeap>;
+using HandleMemoryManager = BasicMemoryManager<MemorySegmentHandleIndex>;
+
+/*
+ * CompactMemoryManager хранит в упорядоченной по адресам структуре
+ * (std::map по left) только свободные сегменты. Занятые блоки лежат
+ * в компактной таблице ручек — смещение и размер, 8 байт на блок, — и
+ * Allocate возвращает номер записи в ней; освободившиеся записи
+ * переиспользуются. Соседей освобождаемого блока мы находим поиском
+ * по адресу в std::map: правый сосед начинается ровно там, где кончается
+ * блок, левый — предыдущий элемент, если кончается там, где блок
+ * начинается. Самый левый из наидлиннейших свободных сегментов, как
+ * и в MemoryManager, берётся из кучи итераторов с heap_index внутри
+ * значения std::map.
+ *
+ * В MemoryManager на каждый занятый блок приходится узел списка
+ * (около 40 байт плюс накладные расходы malloc) и при каждом разрезании
+ * выделяется новый узел; здесь — 8 байт в таблице, а узлы std::map
+ * переиспользуются через extract. Ответы совпадают с MemoryManager
+ * с одной оговоркой: блоки нулевого размера не занимают сегмента и
+ * поэтому не разделяют соседние свободные сегменты. Из-за неё в реестре
+ * движков compact помечен как эквивалентный только на трассах без
+ * выделений нулевого размера.
+ *
+ * AllocateAt и Reallocate ведут себя так же, как у MemoryManager, но
+ * сегмент по смещению ищется в std::map за логарифмическое время.
+ * Reserve заранее выделяет место в таблице ручек и куче, водяные знаки
+ * приоритетов проверяются так же, как у MemoryManager. AllocateGang —
+ * как у MemoryManager; блоки группы нулевого размера, как и в Allocate,
+ * получают смещение без выравнивания.
+ */
+struct FreeMemorySegment {
+  int right;
+  size_t heap_index;
+};
+
+using FreeMemorySegmentMap = std::map<int, FreeMemorySegment>;
+using FreeMemorySegmentMapIterator = FreeMemorySegmentMap::iterator;
+
+
+struct FreeMemorySegmentSizeCompare {
+  bool operator() (FreeMemorySegmentMapIterator first,
+                   FreeMemorySegmentMapIterator second) const;
+};
+
+
+struct FreeMemorySegmentsHeapObserver {
+  void operator() (FreeMemorySegmentMapIterator segment,
+                   size_t new_index) const;
+};
+
+
+using FreeMemorySegmentHeap =
+    Heap<FreeMemorySegmentMapIterator, FreeMemorySegmentSizeCompare>;
+
+
+class CompactMemoryManager {
+ public:
+  using Iterator = uint32_t;
+  using ConstIterator = uint32_t;
+
+  static constexpr Iterator kNullHandle = static_cast<Iterator>(-1);
+
+  explicit CompactMemoryManager(size_t memory_size, size_t heap_arity = 2);
+  Iterator Allocate(size_t size);
+  Iterator Allocate(size_t size, const AllocationOptions& options);
+  Iterator AllocateAt(size_t offset, size_t size);
+  Iterator Reallocate(Iterator position, size_t size,
+                      const AllocationOptions& options);
+  void Free(Iterator position);
+  Iterator end() const;
+
+  size_t FreeMemorySize() const;
+  size_t FreeSegmentsCount() const;
+  size_t LargestFreeSegmentSize() const;
+  const MemoryManagerPlacementStatistics& PlacementStatistics() const;
+  MemoryManagerCounters Counters() const;
+  int Offset(ConstIterator position) const;
+  size_t AllocatedBlocksCount() const;
+  size_t MetadataSize() const;
+  void Reserve(size_t segments_count);
+  void SetPriorityWatermarks(const PriorityWatermarks& watermarks);
+  std::vector<Iterator> AllocateGang(const std::vector<size_t>& sizes);
+  std::vector<Iterator> AllocateGang(const std::vector<size_t>& sizes,
+                                     const AllocationOptions& options);
+
+ private:
+  struct AllocatedBlock {
+    int32_t offset;
+    int32_t size;
+  };
+
+  FreeMemorySegmentMap free_segments_;
+  FreeMemorySegmentHeap free_segments_heap_;
+  std::vector<AllocatedBlock> blocks_;
+  Iterator free_handles_head_;
+  size_t allocated_blocks_count_;
+  size_t free_memory_size_;
+  MemoryManagerPlacementStatistics placement_statistics_;
+  size_t splits_count_;
+  size_t merges_count_;
+  PriorityWatermarks priority_watermarks_;
+
+  Iterator MakeHandle(int offset, size_t size);
+  bool AdmitsPriority(size_t priority, size_t size,
+                      FreeMemorySegmentMapIterator free_segment,
+                      size_t left_rest, size_t right_rest);
+  void InsertFreeSegment(int left, int right);
+  void Carve(FreeMemorySegmentMapIterator free_segment, int offset,
+             size_t size);
+  void ReleaseSegment(int left, int right);
+};
+
+/*
+ * Обёртка над менеджером, которая заранее нарезает блоки ходовых размеров.
+ * Размеры последних window_size выделений запоминаются; размер, на который
+ * приходится не меньше hot_share из них, считается горячим (берутся не
+ * больше max_hot_sizes самых частых). Idle — шаг фоновой работы, который
+ * вызывают в паузах между запросами: он выделяет в нижележащем менеджере
+ * блоки горячих размеров про запас (до reserve_share от их числа в окне,
+ * но не больше max_blocks_per_size на размер и не больше
+ * max_reserved_share свободной памяти вне запаса), а запас размеров, которые
+ * перестали быть горячими, возвращает обратно. Allocate без особых
+ * AllocationOptions отдаёт готовый блок из запаса, если он есть, и
+ * обходится без разрезания и работы с кучей; если нижележащему менеджеру
+ * не хватает памяти, весь запас возвращается и выделение повторяется.
+ *
+ * Блоки из запаса считаются свободными в FreeMemorySize и не считаются
+ * в AllocatedBlocksCount; остальная статистика — нижележащего менеджера.
+ * Водяные знаки приоритетов для блока из запаса проверяются здесь же
+ * (свободная память — с учётом запаса, наибольший сегмент — нижележащего
+ * менеджера); если класс не проходит, выделение идёт мимо запаса
+ * в нижележащий менеджер, который отказывает и считает отказ.
+ * Ответы, в отличие от остальных вариантов, могут отличаться от ответов
+ * MemoryManager: блок из запаса лежит там, где его нарезали.
+ */
+struct PrecarvingOptions {
+  size_t window_size = 1024;
+  double hot_share = 0.05;
+  size_t max_hot_sizes = 8;
+  double reserve_share = 0.25;
+  size_t max_blocks_per_size = 64;
+  double max_reserved_share = 0.25;
+};
+
+struct PrecarvingStatistics {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t carved_blocks = 0;
+  size_t returned_blocks = 0;
+};
+
+template <class Manager>
+class PrecarvingMemoryManager {
+ public:
+  using Iterator = typename Manager::Iterator;
+  using ConstIterator = typename Manager::ConstIterator;
+
+  explicit PrecarvingMemoryManager(
+      size_t memory_size, size_t heap_arity = 2,
+      const PrecarvingOptions& options = PrecarvingOptions());
+  Iterator Allocate(size_t size);
+  Iterator Allocate(size_t size, const AllocationOptions& options);
+  Iterator AllocateAt(size_t offset, size_t size);
+  Iterator Reallocate(Iterator position, size_t size,
+                      const AllocationOptions& options);
+  void Free(Iterator position);
+  Iterator end();
+  ConstIterator end() const;
+
+  // Делает не больше max_steps шагов нарезки или возврата запаса и
+  // возвращает число сделанных; 0 — делать нечего.
+  size_t Idle(size_t max_steps);
+
+  size_t FreeMemorySize() const;
+  size_t FreeSegmentsCount() const;
+  size_t LargestFreeSegmentSize() const;
+  const MemoryManagerPlacementStatistics& PlacementStatistics() const;
+  MemoryManagerCounters Counters() const;
+  int Offset(ConstIterator position) const;
+  size_t AllocatedBlocksCount() const;
+  size_t MetadataSize() const;
+  void SetPriorityWatermarks(const PriorityWatermarks& watermarks);
+  const PrecarvingStatistics& Precarving() const;
+
+ private:
+  struct HotSize {
+    size_t size;
+    size_t target_blocks_count;
+  };
+
+  Manager memory_manager_;
+  PrecarvingOptions options_;
+  std::vector<size_t> recent_sizes_;
+  size_t recent_sizes_position_;
+  std::unordered_map<size_t, size_t> recent_counts_;
+  std::vector<HotSize> hot_sizes_;
+  bool hot_sizes_stale_;
+  std::unordered_map<size_t, std::vector<Iterator>> reserves_;
+  size_t reserved_size_;
+  size_t reserved_blocks_count_;
+  PrecarvingStatistics statistics_;
+  PriorityWatermarks priority_watermarks_;
+
+  void Learn(size_t size);
+  void UpdateHotSizes();
+  bool IsHot(size_t size) const;
+  bool ReturnReserve(size_t size);
+  void ReturnAllReserves();
+};
+
+/*
+ * Шаг фоновой работы менеджера в паузе между запросами; true, если
+ * что-то было сделано. У менеджеров без фоновой работы ничего не делает.
+ */
+template <class Manager>
+bool MemoryManagerIdleStep(Manager* memory_manager);
+
+template <class Manager>
+bool MemoryManagerIdleStep(PrecarvingMemoryManager<Manager>* memory_manager);
+
+template <class Manager>
+void OutputPrecarvingStatistics(const Manager& memory_manager,
+                                std::ostream& ostream = std::cerr);
+
+template <class Manager>
+void OutputPrecarvingStatistics(
+    const PrecarvingMemoryManager<Manager>& memory_manager,
+    std::ostream& ostream = std::cerr);
+
+/*
+ * Режим ограниченной задержки: обёртка, которая не даёт крупной работе
+ * по обслуживанию попасть в одну операцию. Освобождения, которые
+ * приходят, пока есть отставание, и целые пачки блоков из FreeBatch
+ * (пачка передаётся за O(1)) не выполняются сразу, а встают в очередь;
+ * каждый вызов Allocate, AllocateAt, Reallocate и Free сначала
+ * разбирает не больше work_budget блоков из очереди, а Idle разбирает
+ * очередь в паузах между запросами. Пока очереди нет, Free освобождает
+ * сразу; блоки в очереди до разбора считаются занятыми. reserved_segments
+ * заранее выделяет место в индексе свободных сегментов (Manager::Reserve),
+ * чтобы его массивы не перевыделялись посреди работы.
+ *
+ * Режим неэквивалентный, как и precarve: ответы совпадают с ответами
+ * нижележащего менеджера, только пока ни одно освобождение не отложено.
+ * Выделение, которое удаётся и без разбора очереди, выбирает наибольший
+ * сегмент среди уже освобождённых, и блок может лечь не туда, куда его
+ * положил бы нижележащий менеджер. Дифференциальная проверка прогоняет
+ * этот режим и печатает первое расхождение, не считая его ошибкой.
+ *
+ * Бюджет не превышается: max_work_per_call — наибольшая работа одной
+ * операции — не больше work_budget (работа Idle в паузах туда не входит).
+ * Выделение пробуется после своей доли разбора; если места нет, а блоки
+ * ещё в очереди, оно неудачно, хотя после полного разбора могло бы
+ * пройти. Такие отказы считаются в backlog_failures. Отказ по водяным
+ * знакам приоритетов (их проверяет нижележащий менеджер) — тоже неудача.
+ */
+struct BoundedLatencyOptions {
+  size_t work_budget = 16;
+  size_t reserved_segments = 0;
+};
+
+struct BoundedLatencyStatistics {
+  size_t deferred_frees = 0;
+  size_t max_backlog = 0;
+  size_t max_work_per_call = 0;
+  size_t backlog_failures = 0;
+};
+
+template <class Manager>
+class BoundedLatencyMemoryManager {
+ public:
+  using Iterator = typename Manager::Iterator;
+  using ConstIterator = typename Manager::ConstIterator;
+
+  explicit BoundedLatencyMemoryManager(
+      size_t memory_size, size_t heap_arity = 2,
+      const BoundedLatencyOptions& options = BoundedLatencyOptions());
+  Iterator Allocate(size_t size);
+  Iterator Allocate(size_t size, const AllocationOptions& options);
+  Iterator AllocateAt(size_t offset, size_t size);
+  Iterator Reallocate(Iterator position, size_t size,
+                      const AllocationOptions& options);
+  void Free(Iterator position);
+  void FreeBatch(std::vector<Iterator> positions);
+  Iterator end();
+  ConstIterator end() const;
+
+  // Разбирает не больше max_steps блоков очереди и возвращает их число.
+  size_t Idle(size_t max_steps);
+
+  size_t FreeMemorySize() const;
+  size_t FreeSegmentsCount() const;
+  size_t LargestFreeSegmentSize() const;
+  const MemoryManagerPlacementStatistics& PlacementStatistics() const;
+  MemoryManagerCounters Counters() const;
+  int Offset(ConstIterator position) const;
+  size_t AllocatedBlocksCount() const;
+  size_t MetadataSize() const;
+  void SetPriorityWatermarks(const PriorityWatermarks& watermarks);
+  size_t Backlog() const;
+  const BoundedLatencyStatistics& BoundedLatency() const;
+
+ private:
+  Manager memory_manager_;
+  BoundedLatencyOptions options_;
+  std::deque<std::vector<Iterator>> pending_batches_;
+  size_t pending_position_;
+  size_t backlog_;
+  BoundedLatencyStatistics statistics_;
+
+  size_t Maintain(size_t max_steps);
+  void RecordWork(size_t work_count);
+  // Считает отказ, если блоки, которые могли бы его избежать, в очереди.
+  Iterator CountBacklogFailure(Iterator block);
+};
+
+template <class Manager>
+bool MemoryManagerIdleStep(
+    BoundedLatencyMemoryManager<Manager>* memory_manager);
+
+/*
+ * Освобождение пачки блоков одним вызовом: у BoundedLatencyMemoryManager
+ * это FreeBatch, у остальных — Free по очереди.
+ */
+template <class Manager>
+void FreeMemoryManagerBlocks(
+    Manager* memory_manager,
+    std::vector<typename Manager::Iterator> positions);
+
+template <class Manager>
+void FreeMemoryManagerBlocks(
+    BoundedLatencyMemoryManager<Manager>* memory_manager,
+    std::vector<typename Manager::Iterator> positions);
+
+/*
+ * Выделение группы блоков: у MemoryManager и CompactMemoryManager это
+ * AllocateGang, у остальных — Allocate по очереди, без гарантии, что
+ * блоки лягут подряд; если какой-то блок не выделился, уже выделенные
+ * освобождаются. При неудаче возвращается пустой вектор.
+ */
+template <class Manager>
+std::vector<typename Manager::Iterator> AllocateMemoryManagerGang(
+    Manager* memory_manager, const std::vector<size_t>& sizes,
+    const AllocationOptions& options);
+
+template <class FreeSegmentIndex>
+std::vector<MemorySegmentIterator> AllocateMemoryManagerGang(
+    BasicMemoryManager<FreeSegmentIndex>* memory_manager,
+    const std::vector<size_t>& sizes, const AllocationOptions& options);
+
+std::vector<CompactMemoryManager::Iterator> AllocateMemoryManagerGang(
+    CompactMemoryManager* memory_manager, const std::vector<size_t>& sizes,
+    const AllocationOptions& options);
+
+template <class Manager>
+void OutputBoundedLatencyStatistics(const Manager& memory_manager,
+                                    std::ostream& ostream = std::cerr);
+
+template <class Manager>
+void OutputBoundedLatencyStatistics(
+    const BoundedLatencyMemoryManager<Manager>& memory_manager,
+    std::ostream& ostream = std::cerr);
+
+/*
+ * Интерфейс движка — всё, чем пользуются драйвер, замеры
+ * и дифференциальная проверка: типы Iterator и ConstIterator, Allocate,
+ * AllocateAt, Reallocate, Free, end(), Offset и статистика. С поддержкой
+ * концептов это концепт MemoryManagerEngine, и MEMORY_MANAGER_ENGINE
+ * ограничивает им параметры шаблонов; без неё MEMORY_MANAGER_ENGINE —
+ * просто class, а проверку делает признак IsMemoryManagerEngine
+ * на SFINAE через static_assert. Виртуальных вызовов нет: у каждого
+ * движка своя копия цикла прогона.
+ */
+#if defined(__cpp_concepts) && __cpp_concepts >= 201907L
+template <class Manager>
+concept MemoryManagerEngine = requires(
+    Manager manager, const Manager constant_manager,
+    typename Manager::Iterator position, size_t size,
+    const AllocationOptions& options) {
+  typename Manager::ConstIterator;
+  requires std::is_same_v<decltype(manager.Allocate(size, options)),
+                          typename Manager::Iterator>;
+  requires std::is_same_v<decltype(manager.AllocateAt(size, size)),
+                          typename Manager::Iterator>;
+  requires std::is_same_v<
+      decltype(manager.Reallocate(position, size, options)),
+      typename Manager::Iterator>;
+  manager.Free(position);
+  requires std::is_same_v<decltype(manager.end()),
+                          typename Manager::Iterator>;
+  requires std::is_convertible_v<decltype(constant_manager.Offset(position)),
+                                  int>;
+  requires std::is_convertible_v<
+      decltype(constant_manager.Counters()), MemoryManagerCounters>;
+  constant_manager.FreeMemorySize();
+  constant_manager.FreeSegmentsCount();
+  constant_manager.LargestFreeSegmentSize();
+  constant_manager.AllocatedBlocksCount();
+  constant_manager.MetadataSize();
+};
+
+#define MEMORY_MANAGER_ENGINE MemoryManagerEngine
+
+template <class Manager>
+struct IsMemoryManagerEngine
+    : std::bool_constant<MemoryManagerEngine<Manager>> {
+};
+#else
+#define MEMORY_MANAGER_ENGINE class
+
+template <class Manager, class = void>
+struct IsMemoryManagerEngine : std::false_type {
+};
+
+template <class Manager>
+struct IsMemoryManagerEngine<Manager, std::void_t<
+    typename Manager::Iterator,
+    typename Manager::ConstIterator,
+    decltype(std::declval<Manager&>().Free(
+        std::declval<typename Manager::Iterator>())),
+    decltype(std::declval<const Manager&>().Offset(
+        std::declval<typename Manager::Iterator>())),
+    decltype(std::declval<const Manager&>().FreeMemorySize()),
+    decltype(std::declval<const Manager&>().FreeSegmentsCount()),
+    decltype(std::declval<const Manager&>().LargestFreeSegmentSize()),
+    decltype(std::declval<const Manager&>().AllocatedBlocksCount()),
+    decltype(std::declval<const Manager&>().MetadataSize()),
+    decltype(std::declval<const Manager&>().Counters())>>
+    : std::bool_constant<
+          std::is_same<decltype(std::declval<Manager&>().Allocate(
+                           size_t(), std::declval<const AllocationOptions&>())),
+                       typename Manager::Iterator>::value &&
+          std::is_same<decltype(std::declval<Manager&>().AllocateAt(
+                           size_t(), size_t())),
+                       typename Manager::Iterator>::value &&
+          std::is_same<decltype(std::declval<Manager&>().Reallocate(
+                           std::declval<typename Manager::Iterator>(),
+                           size_t(), std::declval<const AllocationOptions&>())),
+                       typename Manager::Iterator>::value &&
+          std::is_same<decltype(std::declval<Manager&>().end()),
+                       typename Manager::Iterator>::value> {
+};
+#endif
+
+/*
+ * Реестр движков на этапе компиляции. Описание движка — тип Manager,
+ * имя kName для отчётов и значения engine и free_index
+ * в EngineConfiguration, которые его выбирают (kFreeIndex == nullptr —
+ * при любом индексе). kEquivalent говорит, что ответы движка на любой
+ * трассе совпадают с эталонными; движки без него автонастройка
+ * не предлагает — выбрать их можно только явно.
+ * kEquivalentWithoutZeroSizes — то же для трасс без выделений нулевого
+ * размера (CompactMemoryManager расходится с эталоном только на них);
+ * на таких трассах дифференциальная проверка сравнивает и его.
+ * MemoryManagerEngineList<...>::ForEach вызывает function(Engine())
+ * для каждого описания по порядку; через него движок выбирают
+ * WithConfiguredMemoryManager и автонастройка, а замер индексов
+ * и дифференциальная проверка перебирают все движки. Новый движок
+ * достаточно добавить в MemoryManagerEngines, первый в списке —
+ * эталонный.
+ */
+struct ListHeapEngine {
+  using Manager = MemoryManager;
+  static constexpr const char* kName = "list-heap";
+  static constexpr bool kEquivalent = true;
+  static constexpr bool kEquivalentWithoutZeroSizes = true;
+  static constexpr const char* kEngine = "list";
+  static constexpr const char* kFreeIndex = "heap";
+};
+
+struct ListHandlesEngine {
+  using Manager = HandleMemoryManager;
+  static constexpr const char* kName = "list-handles";
+  static constexpr bool kEquivalent = true;
+  static constexpr bool kEquivalentWithoutZeroSizes = true;
+  static constexpr const char* kEngine = "list";
+  static constexpr const char* kFreeIndex = "handles";
+};
+
+struct ListBucketedEngine {
+  using Manager = BucketedMemoryManager;
+  static constexpr const char* kName = "list-bucketed";
+  static constexpr bool kEquivalent = true;
+  static constexpr bool kEquivalentWithoutZeroSizes = true;
+  static constexpr const char* kEngine = "list";
+  static constexpr const char* kFreeIndex = "bucketed";
+};
+
+struct CompactEngine {
+  using Manager = CompactMemoryManager;
+  static constexpr const char* kName = "compact";
+  static constexpr bool kEquivalent = false;
+  static constexpr bool kEquivalentWithoutZeroSizes = true;
+  static constexpr const char* kEngine = "compact";
+  static constexpr const char* kFreeIndex = nullptr;
+};
+
+template <class... Engines>
+struct MemoryManagerEngineList {
+  static_assert(
+      (IsMemoryManagerEngine<typename Engines::Manager>::value && ...),
+      "Every registered engine must satisfy MemoryManagerEngine");
+
+  template <class Function>
+  static void ForEach(Function function);
+};
+
+using MemoryManagerEngines = MemoryManagerEngineList<
+    ListHeapEngine, ListHandlesEngine, ListBucketedEngine, CompactEngine>;
+
+/*
+ * Банк из множества маленьких независимых менеджеров (арендаторов),
+ * у каждого из которых лишь несколько сегментов. Вместо списка и кучи
+ * на арендатора сегменты хранятся в виде структуры массивов с чередованием
+ * по арендаторам: поле сегмента номер slot арендатора tenant лежит
+ * в элементе slot * tenants_count + tenant, а сегменты арендатора идут
+ * по возрастанию адресов. Операции выполняются пачками — не больше одной
+ * на арендатора, — и поиск нужного сегмента идёт одним проходом по слотам
+ * сразу для всех арендаторов; внутренний цикл без ветвлений и по подряд
+ * лежащим данным, так что компилятор его векторизует. Затем разрезания и
+ * слияния применяются к каждому арендатору по отдельности.
+ *
+ * Ответы совпадают с ответами отдельного MemoryManager на арендатора:
+ * выделяется самый левый из наидлиннейших свободных сегментов, соседние
+ * свободные сегменты при освобождении сливаются. Блок при освобождении
+ * задаётся смещением и размером. Если арендатору не хватает max_segments
+ * слотов, бросается std::length_error.
+ */
+struct MemoryManagerBankOperation {
+  enum class Kind { kNone, kAllocate, kFree };
+
+  Kind kind;
+  size_t size;
+  size_t offset;
+};
+
+class MemoryManagerBank {
+ public:
+  static constexpr int64_t kFailedAllocation = -1;
+
+  MemoryManagerBank(size_t tenants_count, size_t memory_size,
+                    size_t max_segments);
+
+  /*
+   * operations[tenant] — операция арендатора tenant. В results[tenant]
+   * попадает смещение выделенного блока или kFailedAllocation.
+   */
+  void Execute(const std::vector<MemoryManagerBankOperation>& operations,
+               std::vector<int64_t>* results);
+  size_t TenantsCount() const;
+
+ private:
+  size_t tenants_count_;
+  size_t max_segments_;
+  std::vector<int32_t> lefts_;
+  std::vector<int32_t> rights_;
+  std::vector<int32_t> free_masks_;
+  std::vector<int32_t> segments_counts_;
+  std::vector<int32_t> found_slots_;
+  std::vector<int32_t> found_sizes_;
+  std::vector<int32_t> block_lefts_;
+  std::vector<int32_t> block_rights_;
+
+  size_t Lane(size_t slot, size_t tenant) const;
+  void FindLargestFreeSegments();
+  void FindBlocks(const std::vector<MemoryManagerBankOperation>& operations);
+  int64_t AllocateInTenant(size_t tenant, size_t size);
+  void FreeInTenant(size_t tenant);
+  void InsertSlot(size_t tenant, size_t slot);
+  void EraseSlot(size_t tenant, size_t slot);
 };
 
 
@@ -125,6 +1161,56 @@ struct FreeQuery {
   int allocation_query_index;
 };
 
+/*
+ * Запросы расширенного формата трассы (см. ReadMemoryManagerTraceVersion).
+ * Номера запросов внутри них, как и в FreeQuery, считаются с нуля.
+ * BatchAllocationQuery и GangAllocationQuery занимают столько номеров
+ * запросов, сколько в них выделений; номера со второго по последний
+ * в трассе заняты пустыми BatchContinuationQuery.
+ */
+struct ReallocationQuery {
+  int allocation_query_index;
+  size_t allocation_size;
+};
+
+struct AlignedAllocationQuery {
+  size_t allocation_size;
+  size_t alignment;
+};
+
+struct PlacedAllocationQuery {
+  size_t offset;
+  size_t allocation_size;
+};
+
+struct PrioritizedAllocationQuery {
+  size_t priority;
+  size_t allocation_size;
+};
+
+struct BatchAllocationQuery {
+  std::vector<size_t> allocation_sizes;
+};
+
+struct GangAllocationQuery {
+  std::vector<size_t> allocation_sizes;
+  size_t alignment;
+};
+
+struct BatchContinuationQuery {
+};
+
+struct BatchFreeQuery {
+  int allocation_query_index;
+  size_t count;
+};
+
+struct StatisticsQuery {
+};
+
+struct ResetQuery {
+};
+
 /*
  * Для хранения запросов используется специальный класс-обёртка
  * MemoryManagerQuery. Фишка данной реализации в том, что мы можем удобно
@@ -134,278 +1220,7395 @@ struct FreeQuery {
  * при неудачном приведении указателей.
  */
 
-class MemoryManagerQuery {
- public:
-  explicit MemoryManagerQuery(AllocationQuery allocation_query);
-  explicit MemoryManagerQuery(FreeQuery free_query);
+class MemoryManagerQuery {
+ public:
+  explicit MemoryManagerQuery(AllocationQuery allocation_query);
+  explicit MemoryManagerQuery(FreeQuery free_query);
+  // Запросы расширенного формата.
+  template <typename T>
+  explicit MemoryManagerQuery(T body);
+
+  const AllocationQuery* AsAllocationQuery() const;
+  const FreeQuery* AsFreeQuery() const;
+  template <typename T>
+  const T* As() const;
+
+ private:
+  class AbstractQuery {
+   public:
+    virtual ~AbstractQuery() {
+    }
+
+   protected:
+    AbstractQuery() {
+    }
+  };
+
+  template <typename T>
+  struct ConcreteQuery : public AbstractQuery {
+    T body;
+
+    explicit ConcreteQuery(T _body)
+        : body(std::move(_body)) {
+    }
+  };
+
+  std::unique_ptr<AbstractQuery> query_;
+};
+
+/*
+ * Версия формата трассы. Трасса версии 1 (исходный формат) начинается
+ * сразу с размера памяти. Трасса версии 2 начинается с заголовка
+ * "MMTRACE 2", за которым идут размер памяти, число запросов и запросы
+ * по одному на строку — код операции и аргументы:
+ *   a SIZE         выделение;
+ *   f K            освобождение блока, выделенного запросом K;
+ *   r K SIZE       изменение размера блока запроса K; блок переходит
+ *                  к этому запросу, а при неудаче остаётся у K;
+ *   m SIZE ALIGN   выделение со смещением, кратным ALIGN;
+ *   p OFFSET SIZE  выделение по заданному смещению;
+ *   c CLASS SIZE   выделение класса приоритета CLASS (см. PriorityWatermark);
+ *   b N SIZE...    N выделений, занимают N номеров запросов подряд;
+ *   g N ALIGN SIZE...
+ *                  группа из N блоков подряд из одного сегмента (см.
+ *                  AllocateGang), каждый со смещением, кратным ALIGN
+ *                  (0 — без выравнивания); номера — как у b, при неудаче
+ *                  не выделяется ни один блок;
+ *   F K N          освобождение блоков запросов K, ..., K + N - 1;
+ *   s              печать состояния менеджера в stderr;
+ *   x              освобождение всех занятых блоков.
+ * Номера запросов K, как и в версии 1, считаются с единицы; число запросов
+ * учитывает каждое выделение пачки и группы. Ответ выводится на каждое
+ * выделение (a, r, m, p, c и каждый элемент b и g). Новые операции
+ * добавляются новыми кодами, неизвестный код — ошибка разбора.
+ */
+int ReadMemoryManagerTraceVersion(std::istream& stream = std::cin);
+
+std::vector<MemoryManagerQuery> ReadMemoryManagerQueries(
+    std::istream& stream = std::cin, int trace_version = 1,
+    size_t memory_size = static_cast<size_t>(-1));
+
+MemoryManagerQuery ReadMemoryManagerQuery(std::istream& stream = std::cin);
+
+/*
+ * Освобождение в трассе версии 1 должно ссылаться на запрос до
+ * query_index; иначе бросается std::runtime_error.
+ */
+void CheckEarlierQueryReference(const MemoryManagerQuery& query,
+                                size_t query_index);
+
+/*
+ * Пределы, которые трасса задаёт своим заголовком: выравнивание в m и g
+ * не может быть больше памяти менеджера, а пачка b или g — длиннее
+ * оставшихся из queries_number запросов.
+ */
+struct MemoryManagerTraceLimits {
+  size_t memory_size;
+  size_t queries_number;
+};
+
+/*
+ * Читает одну запись трассы версии 2 и дописывает в queries
+ * соответствующие ей запросы (для пачки — несколько). query_index — номер
+ * первого запроса записи во всей трассе: f, r и F могут ссылаться только
+ * на запросы до него. Запись, которая ссылается не туда или выходит
+ * за limits, — ошибка разбора: бросается std::runtime_error.
+ */
+void ReadMemoryManagerTraceRecord(std::istream& stream, size_t query_index,
+                                  const MemoryManagerTraceLimits& limits,
+                                  std::vector<MemoryManagerQuery>* queries);
+
+struct MemoryManagerAllocationResponse {
+  bool success;
+  size_t position;
+};
+
+/*
+Мы предоставляем два builder'а - MakeSuccessfulAllocation и
+MakeFailedAllocation. Они позволяют создавать корректные объекты
+MemoryManagerAllocationResponse и в коде надо пользоваться ими. Но если
+захочется как-то по-особенному инициализировать поля структуры (например, для
+тестирования), то можно создать структуру с конкретными значениями полей.
+*/
+MemoryManagerAllocationResponse MakeSuccessfulAllocation(size_t position);
+
+MemoryManagerAllocationResponse MakeFailedAllocation();
+
+std::vector<MemoryManagerAllocationResponse> RunMemoryManager(
+    size_t memory_size,
+    const std::vector<MemoryManagerQuery>& queries);
+
+template <MEMORY_MANAGER_ENGINE Manager>
+std::vector<MemoryManagerAllocationResponse> RunMemoryManager(
+    Manager* memory_manager,
+    const std::vector<MemoryManagerQuery>& queries,
+    const AllocationOptions& allocation_options,
+    std::ostream* report = nullptr);
+
+/*
+ * Таблица живых выделений: номер запроса выделения -> результат. Открытая
+ * адресация с линейным пробированием; удаление сдвигает следующие записи
+ * назад, без надгробий. Таблица растёт до пика числа одновременно живых
+ * блоков и не зависит от длины трассы.
+ */
+template <class Value>
+class LiveAllocationTable {
+ public:
+  LiveAllocationTable();
+
+  void Insert(size_t key, Value value);
+  // Удаляет запись с ключом key, записывая её значение в *value.
+  // Возвращает false, если такой записи нет.
+  bool Extract(size_t key, Value* value);
+
+  // Удаляет все записи, вызывая function(value) для каждой.
+  template <class Function>
+  void ExtractAll(Function function);
+  // Вызывает function(key, value) для каждой записи, ничего не удаляя.
+  template <class Function>
+  void ForEach(Function function) const;
+
+  size_t size() const;
+  size_t PeakSize() const;
+  size_t MemorySize() const;
+
+ private:
+  static const size_t kEmptyKey = static_cast<size_t>(-1);
+
+  struct Entry {
+    size_t key;
+    Value value;
+  };
+
+  size_t HomeSlot(size_t key) const;
+  void Grow();
+
+  std::vector<Entry> entries_;
+  int capacity_bits_;
+  size_t size_;
+  size_t peak_size_;
+};
+
+/*
+ * Хранилища результатов выделений: std::vector с записью на каждый запрос
+ * (end() — блока нет) или LiveAllocationTable только с живыми блоками.
+ * StoreAllocationResult запоминает удачный результат запроса index,
+ * ExtractAllocationResult забирает его (false, если блока нет),
+ * ExtractAllocationResults забирает все живые блоки, вызывая для каждого
+ * function.
+ */
+template <class Iterator>
+void StoreAllocationResult(size_t index, Iterator result,
+                           std::vector<Iterator>* results);
+
+template <class Iterator>
+bool ExtractAllocationResult(size_t index, Iterator end,
+                             std::vector<Iterator>* results,
+                             Iterator* result);
+
+template <class Iterator, class Function>
+void ExtractAllocationResults(Iterator end, std::vector<Iterator>* results,
+                              Function function);
+
+template <class Iterator>
+void StoreAllocationResult(size_t index, Iterator result,
+                           LiveAllocationTable<Iterator>* results);
+
+template <class Iterator>
+bool ExtractAllocationResult(size_t index, Iterator end,
+                             LiveAllocationTable<Iterator>* results,
+                             Iterator* result);
+
+template <class Iterator, class Function>
+void ExtractAllocationResults(Iterator end,
+                              LiveAllocationTable<Iterator>* results,
+                              Function function);
+
+/*
+ * Выполнение одного запроса: общий шаг для RunMemoryManager и остальных
+ * прогонщиков трассы. Результаты выделений хранятся в results (см. выше),
+ * ответы дописываются в responses. Строка статистики по StatisticsQuery
+ * пишется в report; без него (замеры, сравнение движков) запрос ничего
+ * не делает.
+ */
+template <class Manager, class Results>
+void ExecuteMemoryManagerQuery(
+    const MemoryManagerQuery& query,
+    size_t query_index,
+    const AllocationOptions& allocation_options,
+    Manager* memory_manager,
+    Results* results,
+    std::vector<MemoryManagerAllocationResponse>* responses,
+    std::ostream* report = nullptr);
+
+template <class Manager>
+std::vector<MemoryManagerAllocationResponse> RunMemoryManagerLive(
+    Manager* memory_manager,
+    const std::vector<MemoryManagerQuery>& queries,
+    const AllocationOptions& allocation_options,
+    LiveAllocationTable<typename Manager::Iterator>* live_allocations,
+    std::ostream* report = nullptr);
+
+template <class Value>
+void OutputLiveAllocationTableFootprint(
+    const LiveAllocationTable<Value>& live_allocations,
+    std::ostream& ostream = std::cerr);
+
+/*
+ * Потоковый режим: запросы читаются из stream по одному и сразу
+ * выполняются, ответы выводятся пачками. Ни трасса, ни ответы целиком
+ * в памяти не хранятся.
+ */
+template <class Manager>
+void StreamMemoryManagerQueries(
+    Manager* memory_manager,
+    std::istream& stream,
+    int trace_version,
+    size_t memory_size,
+    const AllocationOptions& allocation_options,
+    bool binary_output,
+    LiveAllocationTable<typename Manager::Iterator>* live_allocations,
+    std::ostream& ostream = std::cout,
+    std::ostream* report = nullptr);
+
+void OutputMemoryManagerResponses(
+    const std::vector<MemoryManagerAllocationResponse>& responses,
+    std::ostream& ostream = std::cout);
+
+/*
+ * Дайджест раскладки (см. MemoryLayoutDigest) для --digest: включить
+ * до прогона и напечатать корень после. Есть только у списочного
+ * менеджера; у остальных Enable бросает std::invalid_argument.
+ */
+template <class Manager>
+void EnableMemoryManagerLayoutDigest(Manager* memory_manager);
+
+template <class FreeSegmentIndex>
+void EnableMemoryManagerLayoutDigest(
+    BasicMemoryManager<FreeSegmentIndex>* memory_manager);
+
+template <class FreeSegmentIndex>
+void OutputMemoryManagerLayoutDigest(
+    const BasicMemoryManager<FreeSegmentIndex>& memory_manager,
+    std::ostream& ostream = std::cerr);
+
+template <class Manager>
+void OutputMemoryManagerLayoutDigest(const Manager& memory_manager,
+                                     std::ostream& ostream = std::cerr);
+
+/*
+ * Память под метаданные менеджера в расчёте на живой блок.
+ */
+template <class Manager>
+void OutputMemoryManagerFootprint(const Manager& memory_manager,
+                                  std::ostream& ostream = std::cerr);
+
+/*
+ * Двоичный формат ответов: по одному int64 в little-endian на ответ,
+ * значение то же, что и в текстовом выводе (позиция + 1 или -1).
+ * Запись идёт крупными буферами, чтение — через mmap, если вход
+ * отображается в память, и обычным чтением иначе (например, из pipe).
+ */
+int64_t MemoryManagerResponseValue(
+    const MemoryManagerAllocationResponse& response);
+
+MemoryManagerAllocationResponse MakeMemoryManagerResponse(int64_t value);
+
+void OutputMemoryManagerResponsesBinary(
+    const std::vector<MemoryManagerAllocationResponse>& responses,
+    std::ostream& ostream = std::cout);
+
+std::vector<MemoryManagerAllocationResponse> ReadMemoryManagerResponsesBinary(
+    const std::string& path);
+
+std::vector<MemoryManagerAllocationResponse> ReadMemoryManagerResponses(
+    std::istream& stream = std::cin);
+
+/*
+ * Текстовый вывод напрямую в файловый дескриптор, байт в байт совпадающий
+ * с OutputMemoryManagerResponses. Если дескриптор — pipe, ответы
+ * форматируются в выровненные по страницам буферы размером с pipe,
+ * которые отдаются ядру через vmsplice без копирования. Размер pipe
+ * не меняется: pipe принадлежит получателю. Отданный буфер никогда
+ * не переписывается — получатель может передать его страницы дальше
+ * (splice), — а отпускается munmap и заменяется новым. В остальных
+ * случаях (файл, терминал, ошибка vmsplice) используется обычный write
+ * из одного переиспользуемого буфера.
+ */
+char* FormatMemoryManagerResponse(
+    const MemoryManagerAllocationResponse& response, char* output);
+
+void OutputMemoryManagerResponsesToDescriptor(
+    const std::vector<MemoryManagerAllocationResponse>& responses,
+    int descriptor);
+
+/*
+ * Файл, отображённый в память только для чтения. Если mmap недоступен
+ * (pipe, не-POSIX система), содержимое просто вычитывается в буфер.
+ */
+class MappedInputFile {
+ public:
+  explicit MappedInputFile(const std::string& path);
+  ~MappedInputFile();
+  MappedInputFile(const MappedInputFile&) = delete;
+  MappedInputFile& operator=(const MappedInputFile&) = delete;
+
+  const char* data() const;
+  size_t size() const;
+
+ private:
+  const char* data_;
+  size_t size_;
+  bool mapped_;
+  std::vector<char> buffer_;
+};
+
+/*
+ * Распаковка сжатой трассы прямо в разбор. Вход делится на независимые
+ * куски около kBlockSize байт по границам кадров zstd или членов gzip
+ * в формате BGZF (bgzip), у которых длина записана в заголовке. До
+ * threads_count кусков распаковываются одновременно, каждый в своём
+ * потоке, а underflow отдаёт их разбору по порядку. Поток распаковки
+ * держит не больше kQueuedChunksCount готовых кусков по kChunkSize байт,
+ * так что память ограничена, даже если распаковка обгоняет разбор.
+ * Обычный gzip (в том числе от pigz) разрезать нельзя: он распаковывается
+ * одним потоком, но всё равно параллельно с разбором. Ошибки распаковки
+ * бросаются из underflow.
+ */
+class DecompressingInputBuffer : public std::streambuf {
+ public:
+  enum class Format { kGzip, kZstd };
+
+  // data должен жить дольше буфера.
+  DecompressingInputBuffer(const char* data, size_t size, Format format,
+                           size_t threads_count);
+  ~DecompressingInputBuffer() override;
+  DecompressingInputBuffer(const DecompressingInputBuffer&) = delete;
+  DecompressingInputBuffer& operator=(
+      const DecompressingInputBuffer&) = delete;
+
+  // Формат по сигнатуре в начале data; false, если вход не сжат.
+  static bool DetectFormat(const char* data, size_t size, Format* format);
+
+ protected:
+  int_type underflow() override;
+
+ private:
+  static const size_t kBlockSize = 4 << 20;
+  static const size_t kChunkSize = 1 << 20;
+  static const size_t kQueuedChunksCount = 4;
+
+  struct Block {
+    const char* data;
+    size_t size;
+  };
+
+  class ChunkQueue {
+   public:
+    ChunkQueue();
+    // false, если читатель уже не ждёт данных.
+    bool Push(std::string chunk);
+    // false, если данных больше не будет.
+    bool Pop(std::string* chunk);
+    void Close(std::exception_ptr error);
+    void Cancel();
+    std::exception_ptr Error();
+
+   private:
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<std::string> chunks_;
+    bool closed_;
+    bool cancelled_;
+    std::exception_ptr error_;
+  };
+
+  struct Decoder {
+    ChunkQueue queue;
+    std::thread thread;
+  };
+
+  Format format_;
+  size_t threads_count_;
+  std::vector<Block> blocks_;
+  size_t next_block_;
+  std::deque<std::unique_ptr<Decoder>> decoders_;
+  std::string chunk_;
+
+  void SplitBlocks(const char* data, size_t size);
+  void StartDecoders();
+  static void Decode(Format format, Block block, ChunkQueue* queue);
+};
+
+/*
+ * Вход трассы: std::cin, если path — "/dev/stdin", иначе файл path.
+ * Сжатый вход распознаётся по сигнатуре и читается через
+ * DecompressingInputBuffer, несжатый — как раньше.
+ */
+class TraceInput {
+ public:
+  TraceInput(const std::string& path, size_t threads_count);
+  std::istream& stream();
+
+ private:
+  std::unique_ptr<MappedInputFile> mapped_file_;
+  std::string compressed_data_;
+  std::unique_ptr<DecompressingInputBuffer> buffer_;
+  std::unique_ptr<std::istream> stream_;
+};
+
+/*
+ * Отчёт о фрагментации: сколько блоков было сдвинуто постраничным
+ * размещением, сколько памяти ушло в левые остатки, и насколько
+ * наибольший свободный сегмент меньше всей свободной памяти.
+ */
+template <class Manager>
+void OutputMemoryManagerFragmentation(const Manager& memory_manager,
+                                      std::ostream& ostream = std::cerr);
+
+/*
+ * Гистограмма задержек в духе HDR Histogram: значения меньше 2^significant_bits
+ * хранятся точно, а дальше каждая степень двойки делится на
+ * 2^(significant_bits - 1) корзин, так что относительная погрешность
+ * не превосходит 2^(1 - significant_bits) на всём диапазоне uint64_t.
+ */
+
+class LatencyHistogram {
+ public:
+  explicit LatencyHistogram(int significant_bits = 7);
+
+  void Record(uint64_t value);
+  uint64_t ValueAtPercentile(double percentile) const;
+  uint64_t Max() const;
+  size_t Count() const;
+
+ private:
+  int significant_bits_;
+  std::vector<uint64_t> counts_;
+  uint64_t max_;
+  size_t count_;
+
+  size_t BucketIndex(uint64_t value) const;
+  uint64_t BucketValue(size_t bucket_index) const;
+};
+
+void OutputLatencyHistogram(const LatencyHistogram& histogram,
+                            std::ostream& ostream = std::cerr);
+
+/*
+ * Трасса с временами поступления запросов. Формат совпадает с обычным,
+ * но перед любым запросом может стоять метка "@<наносекунды>" — время
+ * поступления от начала трассы. Запрос без метки поступает одновременно
+ * с предыдущим, так что старые трассы читаются как пачка в момент 0.
+ */
+struct TimedMemoryManagerQueries {
+  std::vector<MemoryManagerQuery> queries;
+  std::vector<uint64_t> arrival_times;
+};
+
+TimedMemoryManagerQueries ReadTimedMemoryManagerQueries(
+    std::istream& stream = std::cin);
+
+/*
+ * Открытый (open-loop) прогон: запрос начинает выполняться не раньше
+ * своего времени поступления, делённого на rate_multiplier. Задержка
+ * отсчитывается от запланированного момента, а не от фактического начала,
+ * поэтому ожидание за медленными запросами попадает в гистограмму
+ * (без coordinated omission). Паузы между запросами отдаются
+ * MemoryManagerIdleStep. Выделения выполняются с allocation_options,
+ * как и в замкнутом прогоне. rate_multiplier должен быть конечным
+ * и положительным, иначе бросается std::invalid_argument.
+ */
+std::vector<MemoryManagerAllocationResponse> ReplayMemoryManagerOpenLoop(
+    size_t memory_size,
+    const TimedMemoryManagerQueries& timed_queries,
+    const AllocationOptions& allocation_options,
+    double rate_multiplier,
+    LatencyHistogram* latencies);
+
+template <class Manager>
+std::vector<MemoryManagerAllocationResponse> ReplayMemoryManagerOpenLoop(
+    Manager* memory_manager,
+    const TimedMemoryManagerQueries& timed_queries,
+    const AllocationOptions& allocation_options,
+    double rate_multiplier,
+    LatencyHistogram* latencies);
+
+/*
+ * Стоимость одного запроса для поиска горячих мест в трассе: разности
+ * счётчиков менеджера до и после запроса, время в наносекундах и
+ * состояние менеджера (число свободных сегментов и свободная память)
+ * сразу после запроса.
+ */
+struct MemoryManagerQueryCost {
+  uint64_t nanoseconds;
+  size_t heap_operations;
+  size_t sift_steps;
+  size_t splits;
+  size_t merges;
+  size_t free_segments_count;
+  size_t free_memory_size;
+};
+
+template <class Manager>
+std::vector<MemoryManagerAllocationResponse> RunMemoryManagerAnnotated(
+    Manager* memory_manager,
+    const std::vector<MemoryManagerQuery>& queries,
+    const AllocationOptions& allocation_options,
+    std::vector<MemoryManagerQueryCost>* costs,
+    std::ostream* report = nullptr);
+
+/*
+ * Побочный файл аннотаций: CSV с заголовком или, если путь оканчивается
+ * на ".bin", записи из восьми little-endian uint64 (номер запроса и поля
+ * MemoryManagerQueryCost по порядку).
+ */
+void OutputMemoryManagerQueryCosts(
+    const std::vector<MemoryManagerQueryCost>& costs,
+    const std::string& path);
+
+void OutputMemoryManagerQueryCostSummary(
+    const std::vector<MemoryManagerQueryCost>& costs,
+    const std::vector<MemoryManagerQuery>& queries,
+    size_t top_count,
+    std::ostream& ostream = std::cerr);
+
+/*
+ * Замер индексов свободных сегментов на одной и той же трассе: куча
+ * с наблюдателем (MemoryManager), куча со стабильными ручками
+ * (HandleMemoryManager) и корзины равных размеров (BucketedMemoryManager).
+ * Разбор трассы в замер не входит, каждый вариант прогоняется
+ * несколько раз и берётся лучшее время.
+ */
+void BenchmarkFreeSegmentIndexes(
+    size_t memory_size,
+    const std::vector<MemoryManagerQuery>& queries,
+    std::ostream& ostream = std::cerr);
+
+/*
+ * std::pmr::memory_resource поверх MemoryManager: арена из memory_size
+ * байт, смещения блоков в ней выдаёт менеджер, а по адресу блок находится
+ * в LiveAllocationTable. Выравнивание передаётся менеджеру через
+ * AllocationOptions::alignment; если места нет, бросается std::bad_alloc.
+ * Пустые блоки выделяются как однобайтовые, чтобы адреса не совпадали.
+ */
+class MemoryManagerResource : public std::pmr::memory_resource {
+ public:
+  explicit MemoryManagerResource(size_t memory_size);
+
+  const MemoryManager& Manager() const;
+
+ private:
+  static const size_t kArenaAlignment = 4096;
+
+  std::unique_ptr<char[]> arena_storage_;
+  char* arena_;
+  MemoryManager memory_manager_;
+  LiveAllocationTable<MemoryManager::Iterator> blocks_;
+
+  void* do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void* pointer, size_t bytes, size_t alignment) override;
+  bool do_is_equal(
+      const std::pmr::memory_resource& other) const noexcept override;
+};
+
+/*
+ * Менеджер с перемещаемыми блоками и пошаговым уплотнением. Allocate
+ * возвращает ручку — номер записи в таблице косвенности, где лежит
+ * текущее смещение блока в арене из memory_size байт. CompactStep
+ * сдвигает к началу арены (через MemoryManager::SlideLeft и memmove)
+ * очередные блоки, перед которыми есть свободное место, пока не перенесёт
+ * max_bytes байт — начатый блок переносится целиком, — и следующий вызов
+ * продолжает с того же места; 0 значит, что за целый проход ничего
+ * не перенесено (на месте могли остаться только закреплённые блоки).
+ * Так Allocate и Free чередуются с короткими шагами уплотнения вместо
+ * одной долгой остановки на весь проход.
+ *
+ * Allocate, Free и CompactStep вызываются из одного потока-владельца,
+ * а Pin, Unpin и Offset — из любого. Pin запрещает переносить блок
+ * до парного Unpin и возвращает его адрес; если блок как раз
+ * переносится, Pin ждёт конца переноса (барьер чтения). Счётчик
+ * закреплений и флаг переноса лежат в одном атомарном слове записи
+ * и меняются через CAS, смещение записывается до снятия флага.
+ * Закреплённые блоки уплотнитель пропускает, а освобождать их нельзя —
+ * бросается std::logic_error. Таблица ручек не перевыделяется
+ * (max_blocks_count записей), чтобы читатели не видели её переездов;
+ * когда она заполнена или нет места, Allocate возвращает kNullHandle.
+ * Пустые блоки выделяются как однобайтовые.
+ */
+class RelocatableMemoryManager {
+ public:
+  using Handle = uint32_t;
+
+  static constexpr Handle kNullHandle = static_cast<Handle>(-1);
+
+  explicit RelocatableMemoryManager(size_t memory_size,
+                                    size_t max_blocks_count = 1 << 20);
+  Handle Allocate(size_t size);
+  void Free(Handle handle);
+  size_t CompactStep(size_t max_bytes);
+
+  char* Pin(Handle handle);
+  void Unpin(Handle handle);
+  int Offset(Handle handle) const;
+  size_t Size(Handle handle) const;
+
+  size_t FreeMemorySize() const;
+  size_t FreeSegmentsCount() const;
+  size_t LargestFreeSegmentSize() const;
+  size_t MovedSize() const;
+
+ private:
+  static constexpr uint32_t kMovingFlag = uint32_t(1) << 31;
+
+  struct Block {
+    std::atomic<int32_t> offset;
+    std::atomic<uint32_t> pin_state;
+    int32_t size;
+  };
+
+  std::unique_ptr<char[]> arena_;
+  std::unique_ptr<Block[]> blocks_;
+  size_t max_blocks_count_;
+  std::vector<MemoryManager::Iterator> segments_;
+  std::vector<Handle> free_handles_;
+  MemoryManager memory_manager_;
+  LiveAllocationTable<Handle> handles_by_offset_;
+  Handle cursor_;
+  size_t moved_size_;
+
+  bool Relocate(MemoryManager::Iterator segment);
+};
+
+/*
+ * Замер уплотнения RelocatableMemoryManager: арена в 64 МиБ заполняется
+ * блоками случайных размеров, каждый второй освобождается, а затем
+ * арена уплотняется один раз целиком и, на той же раскладке, шагами
+ * по step_size байт, между которыми владелец продолжает выделять
+ * и освобождать блоки, а второй поток закрепляет случайные живые блоки
+ * и сверяет их содержимое. Печатаются паузы (весь проход против
+ * перцентилей шага), крупнейший свободный сегмент до и после и число
+ * расхождений содержимого — оно должно быть нулевым.
+ */
+void BenchmarkCompaction(size_t step_size, std::ostream& ostream = std::cerr);
+
+/*
+ * Замер задержек отдельных вызовов на нагрузке с массовыми
+ * освобождениями: раунды по 200 тысяч выделений от 16 байт до 4 КиБ
+ * вперемешку с одиночными освобождениями, после каждого раунда половина
+ * живых блоков освобождается одним вызовом FreeMemoryManagerBlocks,
+ * а после каждого четвёртого — все. Сравниваются MemoryManager и
+ * BoundedLatencyMemoryManager с бюджетом work_budget без запаса в индексе
+ * и с ним; для каждого печатаются перцентили задержки вызова.
+ */
+void BenchmarkBoundedLatency(size_t work_budget,
+                             std::ostream& ostream = std::cerr);
+
+/*
+ * Самопроверка кучи: случайные push, pop и (в режиме стабильных ручек)
+ * erase по ручке для арностей 2, 4 и 8 в обоих режимах. Вершина должна
+ * всегда быть наименьшим из живых элементов, get по ручке — возвращать
+ * положенный элемент, а pop — выдавать элементы по неубыванию. Итог для
+ * каждого варианта печатается в report; true, если расхождений нет.
+ */
+bool CheckHeapPopOrder(std::ostream& report = std::cerr);
+
+/*
+ * Самопроверка автонастройки: префикс, который обрезает пачку, должен
+ * продлеваться до её конца, а прогон такого префикса — не выходить
+ * за таблицу результатов. Итог печатается в report.
+ */
+bool CheckAutotunePrefix(std::ostream& report = std::cerr);
+
+/*
+ * MemoryManager, метаданные которого живут в отображённом файле
+ * (MAP_SHARED) и переживают падение процесса без повторного прогона
+ * трассы. Файл — заголовок, журнал, таблица записей сегментов и куча
+ * свободных сегментов, всё из 32-битных слов; ссылки между ними — номера
+ * записей, а не указатели, так что файл можно отобразить по любому
+ * адресу. Запись сегмента хранит left, right, соседей по списку prev
+ * и next и heap_index, как MemorySegment; неиспользуемые записи связаны
+ * в список через next. Ручка блока — номер его записи, она не меняется
+ * между открытиями файла. Ответы совпадают с MemoryManager.
+ *
+ * Операция не пишет в файл по месту: её записи копятся в памяти (чтения
+ * видят их поверх файла), а в конце фиксируются журналом повтора:
+ *   1) пары (слово, значение) пишутся в журнал, msync журнала;
+ *   2) в заголовок пишутся число пар и контрольная сумма, msync — это
+ *      точка фиксации;
+ *   3) значения переносятся на место, msync затронутых страниц;
+ *   4) число пар обнуляется, msync заголовка.
+ * При открытии журнал с верной контрольной суммой переносится заново
+ * (повтор идемпотентен), поэтому после падения на любом шаге файл
+ * описывает состояние до операции или после неё. Проверка при открытии —
+ * заголовок, размеры и журнал, то есть O(размер журнала); Verify —
+ * полная проверка списка и кучи за линейное время.
+ *
+ * synchronous = false пропускает msync. Между шагами Commit стоят
+ * std::atomic_signal_fence, чтобы компилятор не переставил обычные
+ * записи через границу шага; сам процессор выполняет их в порядке
+ * программы для своего потока, и к моменту падения процесса они уже
+ * в страничном кэше. Этого хватает при падении процесса, но не ОС.
+ * Записей сегментов не больше max_segments; если их не хватает,
+ * Allocate бросает std::length_error, ничего не изменив. У существующего
+ * файла memory_size и max_segments должны совпадать с переданными.
+ */
+class PersistentMemoryManager {
+ public:
+  using Iterator = uint32_t;
+
+  static constexpr Iterator kNullHandle = static_cast<Iterator>(-1);
+
+  PersistentMemoryManager(const std::string& path, size_t memory_size,
+                          size_t max_segments = 1 << 20,
+                          bool synchronous = true);
+  ~PersistentMemoryManager();
+  PersistentMemoryManager(const PersistentMemoryManager&) = delete;
+  PersistentMemoryManager& operator=(const PersistentMemoryManager&) = delete;
+
+  Iterator Allocate(size_t size);
+  void Free(Iterator position);
+  Iterator end() const;
+
+  size_t FreeMemorySize() const;
+  size_t FreeSegmentsCount() const;
+  size_t LargestFreeSegmentSize() const;
+  int Offset(Iterator position) const;
+  size_t AllocatedBlocksCount() const;
+  // true, если при открытии был перенесён зафиксированный журнал.
+  bool Recovered() const;
+  bool Verify() const;
+
+ private:
+  enum Field : uint32_t { kLeft, kRight, kPrev, kNext, kHeapIndex };
+
+  static constexpr uint32_t kRecordWords = 5;
+  static constexpr uint32_t kMagic = 0x4d4d5031;
+  static constexpr uint32_t kVersion = 1;
+
+  // Слова заголовка.
+  static constexpr uint32_t kMagicWord = 0;
+  static constexpr uint32_t kVersionWord = 1;
+  static constexpr uint32_t kMemorySizeWord = 2;
+  static constexpr uint32_t kMaxSegmentsWord = 3;
+  static constexpr uint32_t kSegmentsHeadWord = 4;
+  static constexpr uint32_t kFreeRecordsWord = 5;
+  static constexpr uint32_t kUnusedRecordsWord = 6;
+  static constexpr uint32_t kHeapSizeWord = 7;
+  static constexpr uint32_t kFreeMemoryWord = 8;
+  static constexpr uint32_t kAllocatedBlocksWord = 9;
+  static constexpr uint32_t kJournalCountWord = 10;
+  static constexpr uint32_t kJournalChecksumWord = 11;  // и следующее
+  static constexpr uint32_t kHeaderWords = 16;
+
+  static constexpr uint32_t kJournalWord = kHeaderWords;
+  static constexpr uint32_t kJournalCapacity = 4096;
+  static constexpr size_t kPendingSlotsCount = 4 * kJournalCapacity;
+
+  struct PendingSlot {
+    uint32_t word;
+    uint32_t value;
+    uint32_t generation;
+  };
+
+  int descriptor_;
+  uint32_t* words_;
+  size_t words_count_;
+  uint32_t records_word_;
+  uint32_t heap_word_;
+  bool synchronous_;
+  bool recovered_;
+  std::vector<PendingSlot> pending_slots_;
+  std::vector<uint32_t> pending_;
+  uint32_t generation_;
+
+  void Format(size_t memory_size, size_t max_segments);
+  void Recover();
+  void Close();
+  void Sync(size_t first_word, size_t words_count) const;
+  static uint64_t JournalChecksum(const uint32_t* journal, uint32_t count);
+
+  uint32_t Load(uint32_t word) const;
+  void Store(uint32_t word, uint32_t value);
+  void Commit();
+
+  uint32_t Get(uint32_t record, Field field) const;
+  void Set(uint32_t record, Field field, uint32_t value);
+  uint32_t NewRecord();
+  void DeleteRecord(uint32_t record);
+  void Unlink(uint32_t record);
+
+  uint32_t HeapAt(uint32_t position) const;
+  bool HeapAbove(uint32_t first_record, uint32_t second_record) const;
+  void HeapSwap(uint32_t first_position, uint32_t second_position);
+  uint32_t HeapSiftUp(uint32_t position);
+  void HeapSiftDown(uint32_t position);
+  void HeapPush(uint32_t record);
+  void HeapErase(uint32_t position);
+};
+
+/*
+ * Замер PersistentMemoryManager (файл path) против MemoryManager
+ * на случайной нагрузке: выделения от 16 байт до 64 КиБ вперемешку
+ * с освобождениями случайных живых блоков. Печатается пропускная
+ * способность MemoryManager и PersistentMemoryManager без msync и с ним
+ * (с msync — на меньшем числе операций), совпадение ответов и проверка
+ * файла после переоткрытия. Затем процесс, который работает с файлом,
+ * несколько раз убивается SIGKILL в случайный момент, и после каждого
+ * убийства файл открывается и проверяется Verify.
+ */
+void BenchmarkPersistentMemoryManager(const std::string& path,
+                                      std::ostream& ostream = std::cerr);
+
+/*
+ * Сравнение MemoryManagerResource с malloc, unsynchronized_pool_resource
+ * и monotonic_buffer_resource на одинаковых нагрузках: синтетической
+ * (случайные размеры от 8 байт до 8 КиБ, около 20 тысяч живых блоков)
+ * и на выделениях и освобождениях трассы queries (арена — memory_size
+ * байт; трассы больше 256 МиБ пропорционально уменьшаются). Для каждого
+ * печатаются пропускная способность и перцентили задержки удачных
+ * операций (по сумме времён самих операций), число неудачных выделений
+ * и среднее время тех из них, в которых отказал сам распределитель, пик
+ * живых байт, пик прироста RSS и их отношение — насколько память
+ * процесса больше живых данных. Каждый блок после выделения
+ * записывается по байту на страницу, чтобы RSS отражал живые данные.
+ * Бюджет у всех одинаковый: выделение сверх memory_size живых байт
+ * считается неудачным, не доходя до распределителя, а
+ * monotonic_buffer_resource, который ничего не освобождает, может
+ * выделить всего не больше четырёх memory_size.
+ */
+void BenchmarkAllocators(
+    size_t memory_size,
+    const std::vector<MemoryManagerQuery>& queries,
+    std::ostream& ostream = std::cerr);
+
+/*
+ * Сравнение банка с отдельными MemoryManager на случайной нагрузке:
+ * проверяет, что ответы совпадают, и печатает время обоих вариантов.
+ */
+void BenchmarkMemoryManagerBank(
+    size_t tenants_count,
+    size_t steps_count,
+    std::ostream& ostream = std::cerr);
+
+/*
+ * Настройки движка: какой менеджер (engine: list или compact), какой
+ * индекс свободных сегментов у списочного менеджера (free_index: heap,
+ * handles или bucketed), арность кучи и параметры размещения. Их можно
+ * задать в командной строке или загрузить из файла конфигурации — строк
+ * вида "ключ=значение" с теми же ключами; строки на '#' — комментарии.
+ * precarving оборачивает менеджер в PrecarvingMemoryManager, а ненулевой
+ * work_budget — в BoundedLatencyMemoryManager с этим бюджетом
+ * и reserved_segments (ключ reserve_segments); вместе их включать нельзя.
+ * watermarks — водяные знаки классов приоритета по порядку классов,
+ * через запятую пары "свободная_память:наибольший_сегмент".
+ */
+struct EngineConfiguration {
+  std::string engine = "list";
+  std::string free_index = "heap";
+  size_t heap_arity = 2;
+  bool precarving = false;
+  BoundedLatencyOptions bounded_latency = {0, 0};
+  AllocationOptions allocation_options;
+  PriorityWatermarks priority_watermarks;
+};
+
+void SetEngineConfigurationValue(const std::string& key,
+                                 const std::string& value,
+                                 EngineConfiguration* configuration);
+
+void LoadEngineConfiguration(const std::string& path,
+                             EngineConfiguration* configuration);
+
+void SaveEngineConfiguration(const EngineConfiguration& configuration,
+                             const std::string& path);
+
+/*
+ * Создаёт менеджер, описанный configuration, и вызывает для него
+ * function(&memory_manager).
+ */
+template <class Function>
+void WithConfiguredMemoryManager(const EngineConfiguration& configuration,
+                                 size_t memory_size,
+                                 Function function);
+
+/*
+ * Дифференциальная проверка: прогоняет queries через все движки реестра
+ * с арностью кучи и параметрами размещения из configuration и сравнивает
+ * их ответы с ответами эталонного. Для каждого движка печатает "ok" или
+ * номер первого расходящегося ответа; true, если расхождений нет. Движки
+ * без kEquivalent сравниваются, только если в queries нет выделений
+ * нулевого размера и у движка есть kEquivalentWithoutZeroSizes, иначе
+ * о них печатается "skipped". Если
+ * configuration включает неэквивалентный режим (precarve или
+ * work_budget), настроенный менеджер тоже прогоняется и сравнивается
+ * с эталоном, но его расхождение на результат не влияет.
+ */
+bool RunMemoryManagerDifferential(
+    size_t memory_size,
+    const std::vector<MemoryManagerQuery>& queries,
+    const EngineConfiguration& configuration,
+    std::ostream& ostream = std::cerr);
+
+/*
+ * Длина префикса автонастройки: prefix_size, но не больше длины трассы
+ * и продлённый до конца пачки b или g, которую он разрезал бы.
+ */
+size_t AutotunePrefixSize(const std::vector<MemoryManagerQuery>& queries,
+                          size_t prefix_size);
+
+/*
+ * Автонастройка: прогоняет первые prefix_size запросов трассы через все
+ * сочетания движка с kEquivalent, индекса и арности кучи (параметры
+ * размещения берутся из base_configuration как есть), чтобы выбор не
+ * менял ответов, и выбирает вариант с наименьшей долей
+ * неудачных выделений, а среди них — самый быстрый. Таблица замеров
+ * печатается в report.
+ */
+EngineConfiguration AutotuneEngineConfiguration(
+    size_t memory_size,
+    const std::vector<MemoryManagerQuery>& queries,
+    size_t prefix_size,
+    const EngineConfiguration& base_configuration,
+    std::ostream& report = std::cerr);
+
+/*
+ * Кэш повторов для трасс с общим длинным префиксом. Каждые
+ * checkpoint_interval запросов прогон сохраняет в directory контрольную
+ * точку — раскладку менеджера (Snapshot), живые блоки, ответы и текст
+ * отчёта (строки запросов s) с предыдущей точки — в файл, имя которого
+ * задаёт скользящий (полиномиальный) хеш префикса трассы, начатый с seed.
+ * Новый прогон
+ * считает хеши своих префиксов на границах точек, находит самую длинную
+ * цепочку точек от начала трассы, которые есть в кэше, восстанавливает
+ * менеджер и живые блоки из последней, берёт ответы префикса из файлов
+ * и выполняет только остаток трассы, сохраняя недостающие точки. Ответы
+ * и отчёт совпадают с RunMemoryManager: отчёт восстановленного префикса
+ * печатается из файлов.
+ *
+ * seed должен различать всё, от чего зависят ответы, кроме самих
+ * запросов, — его даёт MemoryManagerReplaySeed. Снимки умеют только
+ * списочные менеджеры (BasicMemoryManager), для остальных бросается
+ * std::invalid_argument. Сколько запросов восстановлено и сколько точек
+ * сохранено, печатается в report.
+ */
+struct MemoryManagerReplayCacheOptions {
+  std::string directory;
+  size_t checkpoint_interval = 1 << 16;
+  uint64_t seed = 0;
+};
+
+uint64_t MemoryManagerReplaySeed(size_t memory_size,
+                                 const EngineConfiguration& configuration);
+
+// Хеш одного запроса — слагаемое скользящего хеша префикса.
+uint64_t MemoryManagerQueryHash(const MemoryManagerQuery& query);
+
+template <class Manager>
+std::vector<MemoryManagerAllocationResponse> RunMemoryManagerWithReplayCache(
+    Manager* memory_manager,
+    const std::vector<MemoryManagerQuery>& queries,
+    const AllocationOptions& allocation_options,
+    const MemoryManagerReplayCacheOptions& options,
+    std::ostream& report = std::cerr);
+
+/*
+ * Параметры командной строки. Без аргументов программа ведёт себя
+ * как раньше: читает трассу из stdin и печатает ответы в stdout.
+ */
+struct DriverOptions {
+  bool open_loop = false;
+  std::vector<double> rate_multipliers = {1.0};
+  EngineConfiguration configuration;
+  bool binary_output = false;
+  bool splice_output = false;
+  bool footprint = false;
+  bool layout_digest = false;
+  bool differential = false;
+  bool self_check = false;
+  bool live_results = false;
+  bool streaming = false;
+  std::string autotune_path;
+  size_t autotune_prefix_size = 1000000;
+  std::string benchmark;
+  size_t bank_tenants_count = 100000;
+  size_t bank_steps_count = 100;
+  size_t compaction_step_size = 64 << 10;
+  std::string persistent_path = "memory_manager.persistent";
+  std::string replay_cache_directory;
+  size_t replay_checkpoint_interval = 1 << 16;
+  std::string annotate_path;
+  size_t annotate_top_count = 10;
+  std::string convert;
+  std::string input_path = "/dev/stdin";
+  size_t decompression_threads_count = 0;
+};
+
+DriverOptions ParseDriverOptions(int argc, char* argv[]);
+
+int main(int argc, char* argv[]) {
+  std::ios_base::sync_with_stdio(false);
+  std::cin.tie(nullptr);
+
+  std::ostream& output_stream = std::cout;
+
+  try {
+    const DriverOptions options = ParseDriverOptions(argc, argv);
+    if (options.convert == "binary-to-text") {
+      OutputMemoryManagerResponses(
+          ReadMemoryManagerResponsesBinary(options.input_path), output_stream);
+      return 0;
+    } else if (options.convert == "text-to-binary") {
+      TraceInput responses_input(options.input_path,
+                                 options.decompression_threads_count);
+      OutputMemoryManagerResponsesBinary(
+          ReadMemoryManagerResponses(responses_input.stream()), output_stream);
+      return 0;
+    }
+
+    if (options.benchmark == "bank") {
+      BenchmarkMemoryManagerBank(options.bank_tenants_count,
+                                 options.bank_steps_count, cerr);
+      return 0;
+    } else if (options.benchmark == "compaction") {
+      BenchmarkCompaction(options.compaction_step_size, cerr);
+      return 0;
+    } else if (options.benchmark == "latency") {
+      const size_t work_budget =
+          options.configuration.bounded_latency.work_budget;
+      BenchmarkBoundedLatency(work_budget != 0 ? work_budget : 16, cerr);
+      return 0;
+    } else if (options.benchmark == "persistent") {
+      BenchmarkPersistentMemoryManager(options.persistent_path, cerr);
+      return 0;
+    }
+    if (options.self_check) {
+      const bool heap_consistent = CheckHeapPopOrder(cerr);
+      const bool autotune_consistent = CheckAutotunePrefix(cerr);
+      return heap_consistent && autotune_consistent ? 0 : 1;
+    }
+
+    TraceInput trace_input(options.input_path,
+                           options.decompression_threads_count);
+    std::istream& trace_stream = trace_input.stream();
+    const int trace_version = ReadMemoryManagerTraceVersion(trace_stream);
+    const size_t memory_size = ReadMemorySize(trace_stream);
+
+    if (options.open_loop) {
+      if (trace_version != 1) {
+        throw std::invalid_argument("--open-loop expects a version 1 trace");
+      }
+      if (options.splice_output) {
+        throw std::invalid_argument(
+            "--open-loop cannot be combined with splice output");
+      }
+      const TimedMemoryManagerQueries timed_queries =
+          ReadTimedMemoryManagerQueries(trace_stream);
+      std::vector<MemoryManagerAllocationResponse> responses;
+      for (double rate_multiplier : options.rate_multipliers) {
+        LatencyHistogram latencies;
+        WithConfiguredMemoryManager(
+            options.configuration, memory_size, [&](auto* memory_manager) {
+          responses = ReplayMemoryManagerOpenLoop(
+              memory_manager, timed_queries,
+              options.configuration.allocation_options, rate_multiplier,
+              &latencies);
+          cerr << "rate x" << rate_multiplier << ":" << endl;
+          OutputLatencyHistogram(latencies, cerr);
+          OutputPrecarvingStatistics(*memory_manager, cerr);
+          OutputBoundedLatencyStatistics(*memory_manager, cerr);
+        });
+      }
+      if (options.binary_output) {
+        OutputMemoryManagerResponsesBinary(responses, output_stream);
+      } else {
+        OutputMemoryManagerResponses(responses, output_stream);
+      }
+      return 0;
+    }
+
+    if (options.streaming) {
+      if (!options.annotate_path.empty() || options.splice_output) {
+        throw std::invalid_argument(
+            "--streaming cannot be combined with --annotate or splice output");
+      }
+      WithConfiguredMemoryManager(
+          options.configuration, memory_size, [&](auto* memory_manager) {
+        using Manager = std::remove_pointer_t<decltype(memory_manager)>;
+        LiveAllocationTable<typename Manager::Iterator> live_allocations;
+        if (options.layout_digest) {
+          EnableMemoryManagerLayoutDigest(memory_manager);
+        }
+        StreamMemoryManagerQueries(
+            memory_manager, trace_stream, trace_version, memory_size,
+            options.configuration.allocation_options, options.binary_output,
+            &live_allocations, output_stream, &cerr);
+        if (options.footprint) {
+          OutputMemoryManagerFootprint(*memory_manager, cerr);
+          OutputLiveAllocationTableFootprint(live_allocations, cerr);
+        }
+        if (options.layout_digest) {
+          OutputMemoryManagerLayoutDigest(*memory_manager, cerr);
+        }
+      });
+      return 0;
+    }
+
+    const std::vector<MemoryManagerQuery> queries =
+        ReadMemoryManagerQueries(trace_stream, trace_version, memory_size);
+
+    if (options.differential) {
+      return RunMemoryManagerDifferential(memory_size, queries,
+                                          options.configuration, cerr) ?
+          0 : 1;
+    }
+    if (options.benchmark == "free-index") {
+      BenchmarkFreeSegmentIndexes(memory_size, queries, cerr);
+      return 0;
+    } else if (options.benchmark == "allocators") {
+      BenchmarkAllocators(memory_size, queries, cerr);
+      return 0;
+    }
+    if (!options.autotune_path.empty()) {
+      SaveEngineConfiguration(
+          AutotuneEngineConfiguration(memory_size, queries,
+                                      options.autotune_prefix_size,
+                                      options.configuration, cerr),
+          options.autotune_path);
+      return 0;
+    }
+
+    const AllocationOptions& allocation_options =
+        options.configuration.allocation_options;
+    MemoryManagerReplayCacheOptions replay_cache_options;
+    replay_cache_options.directory = options.replay_cache_directory;
+    replay_cache_options.checkpoint_interval =
+        options.replay_checkpoint_interval;
+    replay_cache_options.seed =
+        MemoryManagerReplaySeed(memory_size, options.configuration);
+
+    auto run = [&](auto* memory_manager) {
+      using Manager = std::remove_pointer_t<decltype(memory_manager)>;
+      LiveAllocationTable<typename Manager::Iterator> live_allocations;
+      std::vector<MemoryManagerAllocationResponse> responses;
+      if (options.layout_digest) {
+        EnableMemoryManagerLayoutDigest(memory_manager);
+      }
+      if (!replay_cache_options.directory.empty()) {
+        responses = RunMemoryManagerWithReplayCache(
+            memory_manager, queries, allocation_options, replay_cache_options,
+            cerr);
+      } else if (options.live_results && options.annotate_path.empty()) {
+        responses = RunMemoryManagerLive(memory_manager, queries,
+                                         allocation_options,
+                                         &live_allocations, &cerr);
+      } else if (options.annotate_path.empty()) {
+        responses = RunMemoryManager(memory_manager, queries,
+                                     allocation_options, &cerr);
+      } else {
+        std::vector<MemoryManagerQueryCost> costs;
+        responses = RunMemoryManagerAnnotated(
+            memory_manager, queries, allocation_options, &costs, &cerr);
+        OutputMemoryManagerQueryCosts(costs, options.annotate_path);
+        OutputMemoryManagerQueryCostSummary(
+            costs, queries, options.annotate_top_count, cerr);
+      }
+
+      if (options.binary_output) {
+        OutputMemoryManagerResponsesBinary(responses, output_stream);
+      } else if (options.splice_output) {
+        output_stream.flush();
+        OutputMemoryManagerResponsesToDescriptor(responses, 1);
+      } else {
+        OutputMemoryManagerResponses(responses, output_stream);
+      }
+      if (allocation_options.page_size) {
+        OutputMemoryManagerFragmentation(*memory_manager, cerr);
+      }
+      if (!options.configuration.priority_watermarks.empty()) {
+        cerr << "watermark rejections "
+             << memory_manager->PlacementStatistics().watermark_rejections
+             << endl;
+      }
+      if (options.footprint) {
+        OutputMemoryManagerFootprint(*memory_manager, cerr);
+        if (options.live_results) {
+          OutputLiveAllocationTableFootprint(live_allocations, cerr);
+        }
+      }
+      if (options.layout_digest) {
+        OutputMemoryManagerLayoutDigest(*memory_manager, cerr);
+      }
+      OutputBoundedLatencyStatistics(*memory_manager, cerr);
+    };
+    WithConfiguredMemoryManager(options.configuration, memory_size, run);
+  } catch (const std::exception& exception) {
+    cerr << exception.what() << endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+
+
+
+
+
+
+
+
+
+// REALIZATION /////////////////////////////////////////////////////////
+
+size_t ReadMemorySize(std::istream& stream) {
+  size_t memory_size;
+  stream >> memory_size;
+  return memory_size;
+}
+
+
+int ReadMemoryManagerTraceVersion(std::istream& stream) {
+  stream >> std::ws;
+  if (stream.peek() != 'M') {
+    return 1;
+  }
+  std::string magic;
+  int version = 0;
+  stream >> magic >> version;
+  if (magic != "MMTRACE" || version != 2) {
+    throw std::runtime_error("Unsupported trace header: " + magic + " " +
+                             std::to_string(version));
+  }
+  return version;
+}
+
+
+namespace {
+
+void CheckEarlierQueryIndex(int index, size_t count, size_t query_index) {
+  if (index < 0 || static_cast<size_t>(index) >= query_index ||
+      count > query_index - index) {
+    throw std::runtime_error("Query " + std::to_string(query_index + 1) +
+                             " refers to a query that is not before it");
+  }
+}
+
+void CheckTraceAlignment(size_t alignment,
+                         const MemoryManagerTraceLimits& limits) {
+  if (alignment > limits.memory_size) {
+    throw std::runtime_error("Alignment " + std::to_string(alignment) +
+                             " exceeds the memory size");
+  }
+}
+
+// Пачка из count запросов, начиная с query_index, должна быть непустой
+// и помещаться в трассу; проверяется до того, как под неё берётся память.
+void CheckTraceBatchSize(size_t count, size_t query_index,
+                         const MemoryManagerTraceLimits& limits) {
+  if (count == 0) {
+    throw std::runtime_error("Empty batch in trace");
+  }
+  if (count > limits.queries_number - query_index) {
+    throw std::runtime_error("Batch runs past the end of the trace");
+  }
+}
+
+}  // namespace
+
+
+void CheckEarlierQueryReference(const MemoryManagerQuery& query,
+                                size_t query_index) {
+  if (auto query_pointer = query.AsFreeQuery()) {
+    CheckEarlierQueryIndex(query_pointer->allocation_query_index, 1,
+                           query_index);
+  }
+}
+
+
+std::vector<MemoryManagerQuery> ReadMemoryManagerQueries(
+    std::istream& stream, int trace_version, size_t memory_size) {
+  unsigned queries_number;
+  stream >> queries_number;
+  std::vector<MemoryManagerQuery> queries;
+  if (trace_version == 1) {
+    for (auto query_n = 0U; query_n < queries_number; ++query_n) {
+      queries.push_back(ReadMemoryManagerQuery(stream));
+      CheckEarlierQueryReference(queries.back(), query_n);
+    }
+    return queries;
+  }
+  const MemoryManagerTraceLimits limits = {memory_size, queries_number};
+  queries.reserve(queries_number);
+  while (queries.size() < queries_number) {
+    ReadMemoryManagerTraceRecord(stream, queries.size(), limits, &queries);
+  }
+  return queries;
+}
+
+
+void ReadMemoryManagerTraceRecord(std::istream& stream, size_t query_index,
+                                  const MemoryManagerTraceLimits& limits,
+                                  std::vector<MemoryManagerQuery>* queries) {
+  char operation = 0;
+  stream >> operation;
+  switch (operation) {
+    case 'a': {
+      AllocationQuery allocation_query;
+      stream >> allocation_query.allocation_size;
+      queries->push_back(MemoryManagerQuery(allocation_query));
+      break;
+    }
+    case 'f': {
+      FreeQuery free_query;
+      stream >> free_query.allocation_query_index;
+      --free_query.allocation_query_index;
+      CheckEarlierQueryIndex(free_query.allocation_query_index, 1,
+                             query_index);
+      queries->push_back(MemoryManagerQuery(free_query));
+      break;
+    }
+    case 'r': {
+      ReallocationQuery reallocation_query;
+      stream >> reallocation_query.allocation_query_index
+             >> reallocation_query.allocation_size;
+      --reallocation_query.allocation_query_index;
+      CheckEarlierQueryIndex(reallocation_query.allocation_query_index, 1,
+                             query_index);
+      queries->push_back(MemoryManagerQuery(reallocation_query));
+      break;
+    }
+    case 'm': {
+      AlignedAllocationQuery aligned_query;
+      stream >> aligned_query.allocation_size >> aligned_query.alignment;
+      CheckTraceAlignment(aligned_query.alignment, limits);
+      queries->push_back(MemoryManagerQuery(aligned_query));
+      break;
+    }
+    case 'p': {
+      PlacedAllocationQuery placed_query;
+      stream >> placed_query.offset >> placed_query.allocation_size;
+      queries->push_back(MemoryManagerQuery(placed_query));
+      break;
+    }
+    case 'c': {
+      PrioritizedAllocationQuery prioritized_query;
+      stream >> prioritized_query.priority
+             >> prioritized_query.allocation_size;
+      queries->push_back(MemoryManagerQuery(prioritized_query));
+      break;
+    }
+    case 'b': {
+      size_t count = 0;
+      stream >> count;
+      CheckTraceBatchSize(count, query_index, limits);
+      BatchAllocationQuery batch_query;
+      batch_query.allocation_sizes.resize(count);
+      for (auto& allocation_size : batch_query.allocation_sizes) {
+        stream >> allocation_size;
+      }
+      queries->push_back(MemoryManagerQuery(std::move(batch_query)));
+      for (size_t element_n = 1; element_n < count; ++element_n) {
+        queries->push_back(MemoryManagerQuery(BatchContinuationQuery()));
+      }
+      break;
+    }
+    case 'g': {
+      size_t count = 0;
+      GangAllocationQuery gang_query;
+      stream >> count >> gang_query.alignment;
+      CheckTraceAlignment(gang_query.alignment, limits);
+      CheckTraceBatchSize(count, query_index, limits);
+      gang_query.allocation_sizes.resize(count);
+      for (auto& allocation_size : gang_query.allocation_sizes) {
+        stream >> allocation_size;
+      }
+      queries->push_back(MemoryManagerQuery(std::move(gang_query)));
+      for (size_t element_n = 1; element_n < count; ++element_n) {
+        queries->push_back(MemoryManagerQuery(BatchContinuationQuery()));
+      }
+      break;
+    }
+    case 'F': {
+      BatchFreeQuery batch_free_query;
+      stream >> batch_free_query.allocation_query_index
+             >> batch_free_query.count;
+      --batch_free_query.allocation_query_index;
+      CheckEarlierQueryIndex(batch_free_query.allocation_query_index,
+                             batch_free_query.count, query_index);
+      queries->push_back(MemoryManagerQuery(batch_free_query));
+      break;
+    }
+    case 's':
+      queries->push_back(MemoryManagerQuery(StatisticsQuery()));
+      break;
+    case 'x':
+      queries->push_back(MemoryManagerQuery(ResetQuery()));
+      break;
+    default:
+      throw std::runtime_error(std::string("Unknown trace operation: ") +
+                               operation);
+  }
+  if (!stream) {
+    throw std::runtime_error("Truncated trace");
+  }
+}
+
+
+MemoryManagerQuery ReadMemoryManagerQuery(std::istream& stream) {
+  int query_numeric;
+  stream >> query_numeric;
+  if (query_numeric >= 0) {
+    AllocationQuery allocation_query = {static_cast<size_t>(query_numeric)};
+    return MemoryManagerQuery(allocation_query);
+  } else {
+    FreeQuery free_query = {-query_numeric - 1};
+    return MemoryManagerQuery(free_query);
+  }
+}
+
+
+/** MemoryManagerQuery: BEGIN **/
+MemoryManagerQuery::MemoryManagerQuery(AllocationQuery allocation_query)
+  : query_(new ConcreteQuery<AllocationQuery>(allocation_query))
+{ }
+
+
+MemoryManagerQuery::MemoryManagerQuery(FreeQuery free_query)
+  : query_(new ConcreteQuery<FreeQuery>(free_query))
+{ }
+
+
+template <typename T>
+MemoryManagerQuery::MemoryManagerQuery(T body)
+  : query_(new ConcreteQuery<T>(std::move(body)))
+{ }
+
+
+template <typename T>
+const T* MemoryManagerQuery::As() const {
+  auto query = dynamic_cast<ConcreteQuery<T>*>(query_.get());
+  if (query) {
+    return &query->body;
+  }
+  return nullptr;
+}
+
+
+const AllocationQuery* MemoryManagerQuery::AsAllocationQuery() const {
+  auto query = dynamic_cast<ConcreteQuery<AllocationQuery>*>(query_.get());
+  if (query) {
+    return &query->body;
+  }
+  return nullptr;
+}
+
+
+const FreeQuery* MemoryManagerQuery::AsFreeQuery() const {
+  auto query = dynamic_cast<ConcreteQuery<FreeQuery>*>(query_.get());
+  if (query) {
+    return &query->body;
+  }
+  return nullptr;
+}
+
+
+/** MemoryManagerQuery: END **/
+
+
+std::vector<MemoryManagerAllocationResponse> RunMemoryManager(
+    size_t memory_size,
+    const std::vector<MemoryManagerQuery>& queries) {
+  MemoryManager memory_manager(memory_size);
+  return RunMemoryManager(&memory_manager, queries, AllocationOptions());
+}
+
+
+template <MEMORY_MANAGER_ENGINE Manager>
+std::vector<MemoryManagerAllocationResponse> RunMemoryManager(
+    Manager* memory_manager,
+    const std::vector<MemoryManagerQuery>& queries,
+    const AllocationOptions& allocation_options,
+    std::ostream* report) {
+  static_assert(IsMemoryManagerEngine<Manager>::value,
+                "RunMemoryManager needs a MemoryManagerEngine");
+  std::vector<typename Manager::Iterator> results(queries.size(),
+                                                 memory_manager->end());
+  std::vector<MemoryManagerAllocationResponse> responses;
+  for (auto query_n = 0U; query_n < queries.size(); ++query_n) {
+    ExecuteMemoryManagerQuery(queries[query_n], query_n, allocation_options,
+                              memory_manager, &results, &responses, report);
+  }
+  return responses;
+}
+
+
+template <class Manager, class Results>
+void ExecuteMemoryManagerQuery(
+    const MemoryManagerQuery& query,
+    size_t query_index,
+    const AllocationOptions& allocation_options,
+    Manager* memory_manager,
+    Results* results,
+    std::vector<MemoryManagerAllocationResponse>* responses,
+    std::ostream* report) {
+  using Iterator = typename Manager::Iterator;
+  const Iterator end = memory_manager->end();
+  auto respond = [&](size_t index, Iterator result) {
+    if (result != end) {
+      StoreAllocationResult(index, result, results);
+      responses->push_back(
+          MakeSuccessfulAllocation(memory_manager->Offset(result)));
+    } else {
+      responses->push_back(MakeFailedAllocation());
+    }
+  };
+  auto release = [&](size_t index) {
+    Iterator result;
+    if (ExtractAllocationResult(index, end, results, &result)) {
+      memory_manager->Free(result);
+    }
+  };
+
+  if (auto query_pointer = query.AsAllocationQuery()) {
+    respond(query_index,
+            memory_manager->Allocate(query_pointer->allocation_size,
+                                     allocation_options));
+  } else if (auto query_pointer = query.AsFreeQuery()) {
+    release(query_pointer->allocation_query_index);
+  } else if (auto query_pointer = query.As<ReallocationQuery>()) {
+    const size_t allocation_index = query_pointer->allocation_query_index;
+    Iterator previous;
+    if (!ExtractAllocationResult(allocation_index, end, results,
+                                 &previous)) {
+      respond(query_index,
+              memory_manager->Allocate(query_pointer->allocation_size,
+                                       allocation_options));
+      return;
+    }
+    auto result = memory_manager->Reallocate(
+        previous, query_pointer->allocation_size, allocation_options);
+    if (result == end) {
+      StoreAllocationResult(allocation_index, previous, results);
+    }
+    respond(query_index, result);
+  } else if (auto query_pointer = query.As<AlignedAllocationQuery>()) {
+    AllocationOptions aligned_options = allocation_options;
+    aligned_options.alignment = query_pointer->alignment;
+    respond(query_index,
+            memory_manager->Allocate(query_pointer->allocation_size,
+                                     aligned_options));
+  } else if (auto query_pointer = query.As<PrioritizedAllocationQuery>()) {
+    AllocationOptions prioritized_options = allocation_options;
+    prioritized_options.priority = query_pointer->priority;
+    respond(query_index,
+            memory_manager->Allocate(query_pointer->allocation_size,
+                                     prioritized_options));
+  } else if (auto query_pointer = query.As<PlacedAllocationQuery>()) {
+    respond(query_index,
+            memory_manager->AllocateAt(query_pointer->offset,
+                                       query_pointer->allocation_size));
+  } else if (auto query_pointer = query.As<BatchAllocationQuery>()) {
+    const auto& sizes = query_pointer->allocation_sizes;
+    for (size_t element_n = 0; element_n < sizes.size(); ++element_n) {
+      respond(query_index + element_n,
+              memory_manager->Allocate(sizes[element_n], allocation_options));
+    }
+  } else if (auto query_pointer = query.As<GangAllocationQuery>()) {
+    AllocationOptions gang_options = allocation_options;
+    gang_options.alignment = query_pointer->alignment;
+    const auto& sizes = query_pointer->allocation_sizes;
+    const auto blocks =
+        AllocateMemoryManagerGang(memory_manager, sizes, gang_options);
+    for (size_t element_n = 0; element_n < sizes.size(); ++element_n) {
+      respond(query_index + element_n,
+              blocks.empty() ? end : blocks[element_n]);
+    }
+  } else if (query.As<BatchContinuationQuery>()) {
+    return;
+  } else if (auto query_pointer = query.As<BatchFreeQuery>()) {
+    std::vector<Iterator> released;
+    for (size_t element_n = 0; element_n < query_pointer->count;
+         ++element_n) {
+      Iterator result;
+      if (ExtractAllocationResult(
+              query_pointer->allocation_query_index + element_n, end,
+              results, &result)) {
+        released.push_back(result);
+      }
+    }
+    FreeMemoryManagerBlocks(memory_manager, std::move(released));
+  } else if (query.As<StatisticsQuery>()) {
+    if (report != nullptr) {
+      *report << "stats " << query_index + 1 << ": free "
+              << memory_manager->FreeMemorySize() << " in "
+              << memory_manager->FreeSegmentsCount() << " segments, largest "
+              << memory_manager->LargestFreeSegmentSize() << ", "
+              << memory_manager->AllocatedBlocksCount() << " allocated blocks"
+              << endl;
+    }
+  } else if (query.As<ResetQuery>()) {
+    std::vector<Iterator> released;
+    ExtractAllocationResults(end, results, [&](Iterator result) {
+      released.push_back(result);
+    });
+    FreeMemoryManagerBlocks(memory_manager, std::move(released));
+  } else {
+    throw std::logic_error("Unknown Memory Manager query!");
+  }
+}
+
+
+/** LiveAllocationTable: BEGIN **/
+template <class Value>
+LiveAllocationTable<Value>::LiveAllocationTable()
+  : entries_(std::vector<Entry>(16, Entry{kEmptyKey, Value()}))
+  , capacity_bits_(4)
+  , size_(0)
+  , peak_size_(0)
+{ }
+
+
+template <class Value>
+void LiveAllocationTable<Value>::Insert(size_t key, Value value) {
+  if (4 * (size_ + 1) > 3 * entries_.size()) {
+    Grow();
+  }
+  const size_t mask = entries_.size() - 1;
+  size_t slot = HomeSlot(key);
+  while (entries_[slot].key != kEmptyKey) {
+    if (entries_[slot].key == key) {
+      entries_[slot].value = value;
+      return;
+    }
+    slot = (slot + 1) & mask;
+  }
+  entries_[slot] = Entry{key, value};
+  peak_size_ = std::max(peak_size_, ++size_);
+}
+
+
+template <class Value>
+bool LiveAllocationTable<Value>::Extract(size_t key, Value* value) {
+  const size_t mask = entries_.size() - 1;
+  size_t hole = HomeSlot(key);
+  while (entries_[hole].key != key) {
+    if (entries_[hole].key == kEmptyKey) {
+      return false;
+    }
+    hole = (hole + 1) & mask;
+  }
+  *value = entries_[hole].value;
+  for (size_t slot = (hole + 1) & mask; entries_[slot].key != kEmptyKey;
+       slot = (slot + 1) & mask) {
+    const size_t home_slot = HomeSlot(entries_[slot].key);
+    if (((slot - home_slot) & mask) >= ((slot - hole) & mask)) {
+      entries_[hole] = entries_[slot];
+      hole = slot;
+    }
+  }
+  entries_[hole].key = kEmptyKey;
+  --size_;
+  return true;
+}
+
+
+template <class Value>
+template <class Function>
+void LiveAllocationTable<Value>::ExtractAll(Function function) {
+  for (Entry& entry : entries_) {
+    if (entry.key != kEmptyKey) {
+      function(entry.value);
+      entry.key = kEmptyKey;
+    }
+  }
+  size_ = 0;
+}
+
+
+template <class Value>
+template <class Function>
+void LiveAllocationTable<Value>::ForEach(Function function) const {
+  for (const Entry& entry : entries_) {
+    if (entry.key != kEmptyKey) {
+      function(entry.key, entry.value);
+    }
+  }
+}
+
+
+template <class Value>
+size_t LiveAllocationTable<Value>::size() const {
+  return size_;
+}
+
+
+template <class Value>
+size_t LiveAllocationTable<Value>::PeakSize() const {
+  return peak_size_;
+}
+
+
+template <class Value>
+size_t LiveAllocationTable<Value>::MemorySize() const {
+  return entries_.capacity() * sizeof(Entry);
+}
+
+
+template <class Value>
+size_t LiveAllocationTable<Value>::HomeSlot(size_t key) const {
+  const uint64_t kMultiplier = 0x9E3779B97F4A7C15ULL;
+  return static_cast<size_t>((static_cast<uint64_t>(key) * kMultiplier) >>
+                             (64 - capacity_bits_));
+}
+
+
+template <class Value>
+void LiveAllocationTable<Value>::Grow() {
+  std::vector<Entry> entries(2 * entries_.size(), Entry{kEmptyKey, Value()});
+  entries.swap(entries_);
+  ++capacity_bits_;
+  const size_t mask = entries_.size() - 1;
+  for (const Entry& entry : entries) {
+    if (entry.key == kEmptyKey) {
+      continue;
+    }
+    size_t slot = HomeSlot(entry.key);
+    while (entries_[slot].key != kEmptyKey) {
+      slot = (slot + 1) & mask;
+    }
+    entries_[slot] = entry;
+  }
+}
+
+
+template <class Value>
+void OutputLiveAllocationTableFootprint(
+    const LiveAllocationTable<Value>& live_allocations,
+    std::ostream& ostream) {
+  ostream << "live table: " << live_allocations.PeakSize()
+          << " peak entries, " << live_allocations.MemorySize()
+          << " bytes" << endl;
+}
+
+
+/** LiveAllocationTable: END **/
+
+
+template <class Iterator>
+void StoreAllocationResult(size_t index, Iterator result,
+                           std::vector<Iterator>* results) {
+  (*results)[index] = result;
+}
+
+
+template <class Iterator>
+bool ExtractAllocationResult(size_t index, Iterator end,
+                             std::vector<Iterator>* results,
+                             Iterator* result) {
+  *result = (*results)[index];
+  (*results)[index] = end;
+  return *result != end;
+}
+
+
+template <class Iterator, class Function>
+void ExtractAllocationResults(Iterator end, std::vector<Iterator>* results,
+                              Function function) {
+  for (auto& result : *results) {
+    if (result != end) {
+      function(result);
+      result = end;
+    }
+  }
+}
+
+
+template <class Iterator>
+void StoreAllocationResult(size_t index, Iterator result,
+                           LiveAllocationTable<Iterator>* results) {
+  results->Insert(index, result);
+}
+
+
+template <class Iterator>
+bool ExtractAllocationResult(size_t index, Iterator,
+                             LiveAllocationTable<Iterator>* results,
+                             Iterator* result) {
+  return results->Extract(index, result);
+}
+
+
+template <class Iterator, class Function>
+void ExtractAllocationResults(Iterator,
+                              LiveAllocationTable<Iterator>* results,
+                              Function function) {
+  results->ExtractAll(function);
+}
+
+
+template <class Manager>
+std::vector<MemoryManagerAllocationResponse> RunMemoryManagerLive(
+    Manager* memory_manager,
+    const std::vector<MemoryManagerQuery>& queries,
+    const AllocationOptions& allocation_options,
+    LiveAllocationTable<typename Manager::Iterator>* live_allocations,
+    std::ostream* report) {
+  std::vector<MemoryManagerAllocationResponse> responses;
+  for (auto query_n = 0U; query_n < queries.size(); ++query_n) {
+    ExecuteMemoryManagerQuery(queries[query_n], query_n, allocation_options,
+                              memory_manager, live_allocations, &responses,
+                              report);
+  }
+  return responses;
+}
+
+
+template <class Manager>
+void StreamMemoryManagerQueries(
+    Manager* memory_manager,
+    std::istream& stream,
+    int trace_version,
+    size_t memory_size,
+    const AllocationOptions& allocation_options,
+    bool binary_output,
+    LiveAllocationTable<typename Manager::Iterator>* live_allocations,
+    std::ostream& ostream,
+    std::ostream* report) {
+  const size_t kResponsesBatchSize = 1 << 12;
+  std::vector<MemoryManagerAllocationResponse> responses;
+  responses.reserve(kResponsesBatchSize);
+  auto flush = [&]() {
+    if (binary_output) {
+      OutputMemoryManagerResponsesBinary(responses, ostream);
+    } else {
+      OutputMemoryManagerResponses(responses, ostream);
+    }
+    responses.clear();
+  };
+  unsigned queries_number;
+  stream >> queries_number;
+  const MemoryManagerTraceLimits limits = {memory_size, queries_number};
+  std::vector<MemoryManagerQuery> record_queries;
+  for (auto query_n = 0U; query_n < queries_number;) {
+    record_queries.clear();
+    if (trace_version == 1) {
+      record_queries.push_back(ReadMemoryManagerQuery(stream));
+      CheckEarlierQueryReference(record_queries.back(), query_n);
+    } else {
+      ReadMemoryManagerTraceRecord(stream, query_n, limits,
+                                   &record_queries);
+    }
+    for (const auto& query : record_queries) {
+      ExecuteMemoryManagerQuery(query, query_n++, allocation_options,
+                                memory_manager, live_allocations,
+                                &responses, report);
+    }
+    if (responses.size() >= kResponsesBatchSize) {
+      flush();
+    }
+  }
+  flush();
+}
+
+
+/** Query cost annotation: BEGIN **/
+template <class Manager>
+std::vector<MemoryManagerAllocationResponse> RunMemoryManagerAnnotated(
+    Manager* memory_manager,
+    const std::vector<MemoryManagerQuery>& queries,
+    const AllocationOptions& allocation_options,
+    std::vector<MemoryManagerQueryCost>* costs,
+    std::ostream* report) {
+  using Clock = std::chrono::steady_clock;
+  std::vector<typename Manager::Iterator> results(queries.size(),
+                                                 memory_manager->end());
+  std::vector<MemoryManagerAllocationResponse> responses;
+  costs->clear();
+  costs->reserve(queries.size());
+  MemoryManagerCounters before = memory_manager->Counters();
+  for (auto query_n = 0U; query_n < queries.size(); ++query_n) {
+    const auto start = Clock::now();
+    ExecuteMemoryManagerQuery(queries[query_n], query_n, allocation_options,
+                              memory_manager, &results, &responses, report);
+    const auto finish = Clock::now();
+    const MemoryManagerCounters after = memory_manager->Counters();
+    MemoryManagerQueryCost cost;
+    cost.nanoseconds =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            finish - start).count();
+    cost.heap_operations = after.heap_operations - before.heap_operations;
+    cost.sift_steps = after.sift_steps - before.sift_steps;
+    cost.splits = after.splits - before.splits;
+    cost.merges = after.merges - before.merges;
+    cost.free_segments_count = memory_manager->FreeSegmentsCount();
+    cost.free_memory_size = memory_manager->FreeMemorySize();
+    costs->push_back(cost);
+    before = after;
+  }
+  return responses;
+}
+
+
+void OutputMemoryManagerQueryCosts(
+    const std::vector<MemoryManagerQueryCost>& costs,
+    const std::string& path) {
+  const std::string kBinarySuffix = ".bin";
+  const bool binary = path.size() >= kBinarySuffix.size() &&
+      path.compare(path.size() - kBinarySuffix.size(), kBinarySuffix.size(),
+                   kBinarySuffix) == 0;
+  std::ofstream stream(path, binary ? std::ios::binary : std::ios::out);
+  if (!stream) {
+    throw std::runtime_error("Cannot open " + path);
+  }
+  if (!binary) {
+    stream << "query,nanoseconds,heap_operations,sift_steps,splits,merges,"
+              "free_segments,free_memory\n";
+    for (size_t query_n = 0; query_n < costs.size(); ++query_n) {
+      const auto& cost = costs[query_n];
+      stream << query_n << ',' << cost.nanoseconds << ','
+             << cost.heap_operations << ',' << cost.sift_steps << ','
+             << cost.splits << ',' << cost.merges << ','
+             << cost.free_segments_count << ',' << cost.free_memory_size
+             << '\n';
+    }
+    return;
+  }
+  std::vector<char> buffer;
+  auto append = [&buffer](uint64_t value) {
+    for (size_t byte_n = 0; byte_n < sizeof(value); ++byte_n) {
+      buffer.push_back(static_cast<char>(value >> (8 * byte_n)));
+    }
+  };
+  for (size_t query_n = 0; query_n < costs.size(); ++query_n) {
+    const auto& cost = costs[query_n];
+    append(query_n);
+    append(cost.nanoseconds);
+    append(cost.heap_operations);
+    append(cost.sift_steps);
+    append(cost.splits);
+    append(cost.merges);
+    append(cost.free_segments_count);
+    append(cost.free_memory_size);
+  }
+  stream.write(buffer.data(), buffer.size());
+}
+
+
+void OutputMemoryManagerQueryCostSummary(
+    const std::vector<MemoryManagerQueryCost>& costs,
+    const std::vector<MemoryManagerQuery>& queries,
+    size_t top_count,
+    std::ostream& ostream) {
+  std::vector<size_t> query_indices(costs.size());
+  for (size_t query_n = 0; query_n < costs.size(); ++query_n) {
+    query_indices[query_n] = query_n;
+  }
+  top_count = std::min(top_count, query_indices.size());
+  std::partial_sort(
+      query_indices.begin(), query_indices.begin() + top_count,
+      query_indices.end(),
+      [&costs](size_t first, size_t second) {
+        return costs[first].nanoseconds > costs[second].nanoseconds;
+      });
+  ostream << "top " << top_count << " queries by time:" << endl;
+  for (size_t rank = 0; rank < top_count; ++rank) {
+    const size_t query_n = query_indices[rank];
+    const auto& cost = costs[query_n];
+    ostream << "  #" << query_n << ' ';
+    if (auto query_pointer = queries[query_n].AsAllocationQuery()) {
+      ostream << "allocate " << query_pointer->allocation_size;
+    } else if (auto query_pointer = queries[query_n].AsFreeQuery()) {
+      ostream << "free #" << query_pointer->allocation_query_index;
+    }
+    ostream << ": " << cost.nanoseconds << " ns, "
+            << cost.heap_operations << " heap ops, "
+            << cost.sift_steps << " sift steps, "
+            << cost.splits << " splits, " << cost.merges << " merges; "
+            << cost.free_segments_count << " free segments, "
+            << cost.free_memory_size << " free" << endl;
+  }
+}
+
+
+/** Query cost annotation: END **/
+
+
+/** Open-loop replay: BEGIN **/
+TimedMemoryManagerQueries ReadTimedMemoryManagerQueries(
+    std::istream& stream) {
+  unsigned queries_number;
+  stream >> queries_number;
+  TimedMemoryManagerQueries timed_queries;
+  uint64_t arrival_time = 0;
+  for (auto query_n = 0U; query_n < queries_number; ++query_n) {
+    stream >> std::ws;
+    if (stream.peek() == '@') {
+      stream.get();
+      stream >> arrival_time;
+    }
+    int query_numeric;
+    stream >> query_numeric;
+    if (query_numeric >= 0) {
+      AllocationQuery allocation_query = {static_cast<size_t>(query_numeric)};
+      timed_queries.queries.push_back(MemoryManagerQuery(allocation_query));
+    } else {
+      FreeQuery free_query = {-query_numeric - 1};
+      timed_queries.queries.push_back(MemoryManagerQuery(free_query));
+      CheckEarlierQueryReference(timed_queries.queries.back(), query_n);
+    }
+    timed_queries.arrival_times.push_back(arrival_time);
+  }
+  return timed_queries;
+}
+
+
+std::vector<MemoryManagerAllocationResponse> ReplayMemoryManagerOpenLoop(
+    size_t memory_size,
+    const TimedMemoryManagerQueries& timed_queries,
+    const AllocationOptions& allocation_options,
+    double rate_multiplier,
+    LatencyHistogram* latencies) {
+  MemoryManager memory_manager(memory_size);
+  return ReplayMemoryManagerOpenLoop(&memory_manager, timed_queries,
+                                     allocation_options, rate_multiplier,
+                                     latencies);
+}
+
+
+template <class Manager>
+std::vector<MemoryManagerAllocationResponse> ReplayMemoryManagerOpenLoop(
+    Manager* memory_manager,
+    const TimedMemoryManagerQueries& timed_queries,
+    const AllocationOptions& allocation_options,
+    double rate_multiplier,
+    LatencyHistogram* latencies) {
+  if (!std::isfinite(rate_multiplier) || rate_multiplier <= 0) {
+    throw std::invalid_argument("Rate multiplier must be positive");
+  }
+  using Clock = std::chrono::steady_clock;
+  // Дальше этого порога ждём во сне, а остаток докручиваем активно:
+  // планировщик просыпается с опозданием порядка десятков микросекунд.
+  const auto kSpinThreshold = std::chrono::microseconds(200);
+
+  const auto& queries = timed_queries.queries;
+  std::vector<typename Manager::Iterator> results(queries.size(),
+                                                 memory_manager->end());
+  std::vector<MemoryManagerAllocationResponse> responses;
+  const auto start = Clock::now();
+  for (auto query_n = 0U; query_n < queries.size(); ++query_n) {
+    const auto intended_start = start +
+        std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double, std::nano>(
+                timed_queries.arrival_times[query_n] / rate_multiplier));
+    while (intended_start - Clock::now() > kSpinThreshold) {
+      if (!MemoryManagerIdleStep(memory_manager)) {
+        std::this_thread::sleep_until(intended_start - kSpinThreshold);
+        break;
+      }
+    }
+    while (Clock::now() < intended_start) {
+    }
+    ExecuteMemoryManagerQuery(queries[query_n], query_n, allocation_options,
+                              memory_manager, &results, &responses);
+    latencies->Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - intended_start).count());
+  }
+  return responses;
+}
+
+
+/** Open-loop replay: END **/
+
+
+/** Binary responses: BEGIN **/
+int64_t MemoryManagerResponseValue(
+    const MemoryManagerAllocationResponse& response) {
+  return response.success ? static_cast<int64_t>(response.position) + 1 : -1;
+}
+
+
+MemoryManagerAllocationResponse MakeMemoryManagerResponse(int64_t value) {
+  return value > 0 ? MakeSuccessfulAllocation(value - 1) :
+                     MakeFailedAllocation();
+}
+
+
+void OutputMemoryManagerResponsesBinary(
+    const std::vector<MemoryManagerAllocationResponse>& responses,
+    std::ostream& ostream) {
+  const size_t kBufferSize = 1 << 16;
+  std::vector<char> buffer(kBufferSize);
+  size_t buffer_size = 0;
+  for (const auto& response : responses) {
+    if (buffer_size + sizeof(int64_t) > kBufferSize) {
+      ostream.write(buffer.data(), buffer_size);
+      buffer_size = 0;
+    }
+    const auto value =
+        static_cast<uint64_t>(MemoryManagerResponseValue(response));
+    for (size_t byte_n = 0; byte_n < sizeof(int64_t); ++byte_n) {
+      buffer[buffer_size++] = static_cast<char>(value >> (8 * byte_n));
+    }
+  }
+  ostream.write(buffer.data(), buffer_size);
+  ostream.flush();
+}
+
+
+std::vector<MemoryManagerAllocationResponse> ReadMemoryManagerResponsesBinary(
+    const std::string& path) {
+  MappedInputFile input(path);
+  if (input.size() % sizeof(int64_t) != 0) {
+    throw std::runtime_error("Binary responses are truncated: " + path);
+  }
+  const auto bytes = reinterpret_cast<const unsigned char*>(input.data());
+  std::vector<MemoryManagerAllocationResponse> responses;
+  responses.reserve(input.size() / sizeof(int64_t));
+  for (size_t offset = 0; offset < input.size(); offset += sizeof(int64_t)) {
+    uint64_t value = 0;
+    for (size_t byte_n = 0; byte_n < sizeof(int64_t); ++byte_n) {
+      value |= static_cast<uint64_t>(bytes[offset + byte_n]) << (8 * byte_n);
+    }
+    responses.push_back(MakeMemoryManagerResponse(static_cast<int64_t>(value)));
+  }
+  return responses;
+}
+
+
+std::vector<MemoryManagerAllocationResponse> ReadMemoryManagerResponses(
+    std::istream& stream) {
+  std::vector<MemoryManagerAllocationResponse> responses;
+  int64_t value;
+  while (stream >> value) {
+    responses.push_back(MakeMemoryManagerResponse(value));
+  }
+  return responses;
+}
+
+
+/** Binary responses: END **/
+
+
+/** Descriptor output: BEGIN **/
+char* FormatMemoryManagerResponse(
+    const MemoryManagerAllocationResponse& response, char* output) {
+  if (!response.success) {
+    *output++ = '-';
+    *output++ = '1';
+    *output++ = '\n';
+    return output;
+  }
+  char digits[24];
+  size_t digits_count = 0;
+  size_t value = response.position + 1;
+  do {
+    digits[digits_count++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value);
+  while (digits_count) {
+    *output++ = digits[--digits_count];
+  }
+  *output++ = '\n';
+  return output;
+}
+
+
+namespace {
+
+// Наибольшая длина одного ответа: 20 цифр size_t и перевод строки.
+const size_t kMaxFormattedResponseSize = 21;
+
+
+void WriteAll(int descriptor, const char* data, size_t size) {
+#if defined(__unix__)
+  while (size) {
+    const ssize_t written = write(descriptor, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("Cannot write responses");
+    }
+    data += written;
+    size -= written;
+  }
+#else
+  std::cout.write(data, size);
+#endif
+}
+
+
+#if defined(__linux__)
+/*
+ * Отдаёт буфер в pipe через vmsplice. Возвращает false, если vmsplice
+ * не поддерживается и часть буфера начиная с *offset надо дописать write.
+ */
+bool SpliceAll(int descriptor, const char* data, size_t size,
+               size_t* offset) {
+  while (*offset < size) {
+    struct iovec chunk = {const_cast<char*>(data) + *offset, size - *offset};
+    const ssize_t spliced = vmsplice(descriptor, &chunk, 1, 0);
+    if (spliced < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return false;
+    }
+    *offset += spliced;
+  }
+  return true;
+}
+#endif
+
+}  // namespace
+
+
+void OutputMemoryManagerResponsesToDescriptor(
+    const std::vector<MemoryManagerAllocationResponse>& responses,
+    int descriptor) {
+  size_t buffer_size = 1 << 16;
+  bool splice = false;
+#if defined(__linux__)
+  struct stat descriptor_status;
+  if (fstat(descriptor, &descriptor_status) == 0 &&
+      S_ISFIFO(descriptor_status.st_mode)) {
+    const int pipe_size = fcntl(descriptor, F_GETPIPE_SZ);
+    if (pipe_size > 0) {
+      buffer_size = pipe_size;
+      splice = true;
+    }
+  }
+  // Буфер выделяется через mmap и не возвращается аллокатору: после
+  // munmap страницы, ещё лежащие в pipe, остаются нетронутыми.
+  auto map_buffer = [buffer_size]() {
+    void* address = mmap(nullptr, buffer_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (address == MAP_FAILED) {
+      throw std::runtime_error("Cannot allocate output buffer");
+    }
+    return static_cast<char*>(address);
+  };
+  char* buffer = map_buffer();
+#else
+  std::vector<char> buffer_storage(buffer_size);
+  char* buffer = buffer_storage.data();
+#endif
+
+  char* output = buffer;
+  auto flush = [&]() {
+    const size_t size = output - buffer;
+    size_t offset = 0;
+#if defined(__linux__)
+    if (splice && !SpliceAll(descriptor, buffer, size, &offset)) {
+      splice = false;
+    }
+#endif
+    WriteAll(descriptor, buffer + offset, size - offset);
+#if defined(__linux__)
+    if (offset != 0) {
+      munmap(buffer, buffer_size);
+      buffer = map_buffer();
+    }
+#endif
+    output = buffer;
+  };
+  for (const auto& response : responses) {
+    if (output + kMaxFormattedResponseSize > buffer + buffer_size) {
+      flush();
+    }
+    output = FormatMemoryManagerResponse(response, output);
+  }
+  flush();
+
+#if defined(__linux__)
+  munmap(buffer, buffer_size);
+#endif
+}
+
+
+/** Descriptor output: END **/
+
+
+/** MappedInputFile: BEGIN **/
+MappedInputFile::MappedInputFile(const std::string& path)
+  : data_(nullptr)
+  , size_(0)
+  , mapped_(false)
+  , buffer_(std::vector<char>())
+{
+#if defined(__unix__)
+  const int descriptor = open(path.c_str(), O_RDONLY);
+  if (descriptor < 0) {
+    throw std::runtime_error("Cannot open " + path);
+  }
+  struct stat file_status;
+  if (fstat(descriptor, &file_status) == 0 && S_ISREG(file_status.st_mode) &&
+      file_status.st_size > 0) {
+    void* address = mmap(nullptr, file_status.st_size, PROT_READ, MAP_PRIVATE,
+                         descriptor, 0);
+    if (address != MAP_FAILED) {
+      madvise(address, file_status.st_size, MADV_SEQUENTIAL);
+      data_ = static_cast<const char*>(address);
+      size_ = file_status.st_size;
+      mapped_ = true;
+    }
+  }
+  if (!mapped_) {
+    char chunk[1 << 16];
+    ssize_t chunk_size;
+    while ((chunk_size = read(descriptor, chunk, sizeof(chunk))) > 0) {
+      buffer_.insert(buffer_.end(), chunk, chunk + chunk_size);
+    }
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+  }
+  close(descriptor);
+#else
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream) {
+    throw std::runtime_error("Cannot open " + path);
+  }
+  buffer_.assign(std::istreambuf_iterator<char>(stream),
+                 std::istreambuf_iterator<char>());
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+#endif
+}
+
+
+MappedInputFile::~MappedInputFile() {
+#if defined(__unix__)
+  if (mapped_) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+#endif
+}
+
+
+const char* MappedInputFile::data() const {
+  return data_;
+}
+
+
+size_t MappedInputFile::size() const {
+  return size_;
+}
+
+
+/** MappedInputFile: END **/
+
+
+/** DecompressingInputBuffer: BEGIN **/
+DecompressingInputBuffer::DecompressingInputBuffer(
+    const char* data, size_t size, Format format, size_t threads_count)
+  : format_(format)
+  , threads_count_(std::max<size_t>(threads_count, 1))
+  , blocks_(std::vector<Block>())
+  , next_block_(0)
+  , decoders_(std::deque<std::unique_ptr<Decoder>>())
+  , chunk_(std::string())
+{
+  SplitBlocks(data, size);
+  StartDecoders();
+}
+
+
+DecompressingInputBuffer::~DecompressingInputBuffer() {
+  for (auto& decoder : decoders_) {
+    decoder->queue.Cancel();
+  }
+  for (auto& decoder : decoders_) {
+    decoder->thread.join();
+  }
+}
+
+
+bool DecompressingInputBuffer::DetectFormat(const char* data, size_t size,
+                                            Format* format) {
+  const auto bytes = reinterpret_cast<const unsigned char*>(data);
+  if (size >= 2 && bytes[0] == 0x1f && bytes[1] == 0x8b) {
+    *format = Format::kGzip;
+    return true;
+  }
+  if (size >= 4 && bytes[0] == 0x28 && bytes[1] == 0xb5 &&
+      bytes[2] == 0x2f && bytes[3] == 0xfd) {
+    *format = Format::kZstd;
+    return true;
+  }
+  return false;
+}
+
+
+DecompressingInputBuffer::int_type DecompressingInputBuffer::underflow() {
+  while (gptr() == egptr()) {
+    if (decoders_.empty()) {
+      return traits_type::eof();
+    }
+    Decoder& decoder = *decoders_.front();
+    if (decoder.queue.Pop(&chunk_)) {
+      setg(&chunk_[0], &chunk_[0], &chunk_[0] + chunk_.size());
+      continue;
+    }
+    decoder.thread.join();
+    const std::exception_ptr error = decoder.queue.Error();
+    decoders_.pop_front();
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    StartDecoders();
+  }
+  return traits_type::to_int_type(*gptr());
+}
+
+
+/*
+ * Режет вход на куски по границам независимо распаковываемых частей. Если
+ * очередную границу найти нельзя (обычный gzip), весь остаток — один кусок.
+ */
+void DecompressingInputBuffer::SplitBlocks(const char* data, size_t size) {
+  const auto bytes = reinterpret_cast<const unsigned char*>(data);
+  size_t block_begin = 0;
+  size_t position = 0;
+  while (position < size) {
+    size_t part_size = 0;
+    if (format_ == Format::kZstd) {
+#if defined(MEMORY_MANAGER_WITH_ZSTD)
+      part_size = ZSTD_findFrameCompressedSize(data + position,
+                                               size - position);
+      if (ZSTD_isError(part_size)) {
+        part_size = 0;
+      }
+#endif
+    } else if (size - position >= 18 && bytes[position + 3] & 4 &&
+               bytes[position + 12] == 'B' && bytes[position + 13] == 'C' &&
+               bytes[position + 14] == 2 && bytes[position + 15] == 0) {
+      part_size = (bytes[position + 16] | bytes[position + 17] << 8) + 1;
+    }
+    if (part_size == 0 || part_size > size - position) {
+      position = size;
+      break;
+    }
+    position += part_size;
+    if (position - block_begin >= kBlockSize) {
+      blocks_.push_back({data + block_begin, position - block_begin});
+      block_begin = position;
+    }
+  }
+  if (block_begin < size) {
+    blocks_.push_back({data + block_begin, size - block_begin});
+  }
+}
+
+
+void DecompressingInputBuffer::StartDecoders() {
+  while (decoders_.size() < threads_count_ && next_block_ < blocks_.size()) {
+    decoders_.emplace_back(new Decoder());
+    Decoder* decoder = decoders_.back().get();
+    decoder->thread = std::thread(Decode, format_, blocks_[next_block_++],
+                                  &decoder->queue);
+  }
+}
+
+
+void DecompressingInputBuffer::Decode(Format format, Block block,
+                                      ChunkQueue* queue) {
+  static_cast<void>(block);  // Не нужен, если нет ни zlib, ни libzstd.
+  std::exception_ptr error;
+  try {
+    std::string chunk(kChunkSize, '\0');
+    if (format == Format::kGzip) {
+#if defined(MEMORY_MANAGER_WITH_ZLIB)
+      z_stream stream = z_stream();
+      if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+        throw std::runtime_error("inflateInit2 failed");
+      }
+      std::unique_ptr<z_stream, int (*)(z_stream*)> stream_guard(&stream,
+                                                                 inflateEnd);
+      size_t consumed = 0;
+      bool finished = false;
+      while (!finished) {
+        if (stream.avail_in == 0) {
+          const size_t slice = std::min<size_t>(block.size - consumed,
+                                                1U << 30);
+          stream.next_in = reinterpret_cast<Bytef*>(
+              const_cast<char*>(block.data + consumed));
+          stream.avail_in = slice;
+          consumed += slice;
+        }
+        stream.next_out = reinterpret_cast<Bytef*>(&chunk[0]);
+        stream.avail_out = kChunkSize;
+        const int result = inflate(&stream, Z_NO_FLUSH);
+        if (result == Z_STREAM_END) {
+          if (stream.avail_in == 0 && consumed == block.size) {
+            finished = true;
+          } else {
+            inflateReset(&stream);
+          }
+        } else if (result == Z_BUF_ERROR && stream.avail_in == 0 &&
+                   consumed == block.size) {
+          throw std::runtime_error("Truncated gzip input");
+        } else if (result != Z_OK && result != Z_BUF_ERROR) {
+          throw std::runtime_error(std::string("gzip: ") +
+                                   (stream.msg ? stream.msg : "error"));
+        }
+        const size_t produced = kChunkSize - stream.avail_out;
+        if (produced != 0 && !queue->Push(chunk.substr(0, produced))) {
+          break;
+        }
+      }
+#else
+      throw std::runtime_error(
+          "gzip input needs a build with -DMEMORY_MANAGER_WITH_ZLIB -lz");
+#endif
+    } else {
+#if defined(MEMORY_MANAGER_WITH_ZSTD)
+      std::unique_ptr<ZSTD_DStream, size_t (*)(ZSTD_DStream*)> stream(
+          ZSTD_createDStream(), ZSTD_freeDStream);
+      ZSTD_initDStream(stream.get());
+      ZSTD_inBuffer input = {block.data, block.size, 0};
+      size_t result = 0;
+      bool output_full = false;
+      while (input.pos < input.size || output_full) {
+        ZSTD_outBuffer output = {&chunk[0], kChunkSize, 0};
+        result = ZSTD_decompressStream(stream.get(), &output, &input);
+        if (ZSTD_isError(result)) {
+          throw std::runtime_error(std::string("zstd: ") +
+                                   ZSTD_getErrorName(result));
+        }
+        output_full = output.pos == output.size;
+        if (output.pos != 0 &&
+            !queue->Push(chunk.substr(0, output.pos))) {
+          break;
+        }
+      }
+      if (result != 0 && !output_full) {
+        throw std::runtime_error("Truncated zstd input");
+      }
+#else
+      throw std::runtime_error(
+          "zstd input needs a build with -DMEMORY_MANAGER_WITH_ZSTD -lzstd");
+#endif
+    }
+  } catch (...) {
+    error = std::current_exception();
+  }
+  queue->Close(error);
+}
+
+
+DecompressingInputBuffer::ChunkQueue::ChunkQueue()
+  : chunks_(std::deque<std::string>())
+  , closed_(false)
+  , cancelled_(false)
+  , error_(nullptr)
+{ }
+
+
+bool DecompressingInputBuffer::ChunkQueue::Push(std::string chunk) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  changed_.wait(lock, [this]() {
+    return cancelled_ || chunks_.size() < kQueuedChunksCount;
+  });
+  if (cancelled_) {
+    return false;
+  }
+  chunks_.push_back(std::move(chunk));
+  changed_.notify_all();
+  return true;
+}
+
+
+bool DecompressingInputBuffer::ChunkQueue::Pop(std::string* chunk) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  changed_.wait(lock, [this]() { return closed_ || !chunks_.empty(); });
+  if (chunks_.empty()) {
+    return false;
+  }
+  *chunk = std::move(chunks_.front());
+  chunks_.pop_front();
+  changed_.notify_all();
+  return true;
+}
+
+
+void DecompressingInputBuffer::ChunkQueue::Close(std::exception_ptr error) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  closed_ = true;
+  error_ = error;
+  changed_.notify_all();
+}
+
+
+void DecompressingInputBuffer::ChunkQueue::Cancel() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  cancelled_ = true;
+  changed_.notify_all();
+}
+
+
+std::exception_ptr DecompressingInputBuffer::ChunkQueue::Error() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return error_;
+}
+
+
+/** DecompressingInputBuffer: END **/
+
+
+/** TraceInput: BEGIN **/
+TraceInput::TraceInput(const std::string& path, size_t threads_count)
+  : mapped_file_(nullptr)
+  , compressed_data_(std::string())
+  , buffer_(nullptr)
+  , stream_(nullptr)
+{
+  if (threads_count == 0) {
+    threads_count = std::max(1U, std::thread::hardware_concurrency());
+  }
+  DecompressingInputBuffer::Format format;
+  if (path == "/dev/stdin") {
+    // Несжатая трасса не может начинаться с первого байта сигнатур.
+    const int first_byte = std::cin.peek();
+    if (first_byte != 0x1f && first_byte != 0x28) {
+      return;
+    }
+    compressed_data_.assign(std::istreambuf_iterator<char>(std::cin),
+                            std::istreambuf_iterator<char>());
+    if (!DecompressingInputBuffer::DetectFormat(
+            compressed_data_.data(), compressed_data_.size(), &format)) {
+      throw std::runtime_error("Unrecognized compressed input");
+    }
+    buffer_.reset(new DecompressingInputBuffer(
+        compressed_data_.data(), compressed_data_.size(), format,
+        threads_count));
+  } else {
+    mapped_file_.reset(new MappedInputFile(path));
+    if (!DecompressingInputBuffer::DetectFormat(
+            mapped_file_->data(), mapped_file_->size(), &format)) {
+      mapped_file_.reset();
+      stream_.reset(new std::ifstream(path));
+      return;
+    }
+    buffer_.reset(new DecompressingInputBuffer(
+        mapped_file_->data(), mapped_file_->size(), format, threads_count));
+  }
+  stream_.reset(new std::istream(buffer_.get()));
+  stream_->exceptions(std::ios::badbit);
+}
+
+
+std::istream& TraceInput::stream() {
+  return stream_ ? *stream_ : std::cin;
+}
+
+
+/** TraceInput: END **/
+
+
+template <class Manager>
+void OutputMemoryManagerFragmentation(const Manager& memory_manager,
+                                      std::ostream& ostream) {
+  const auto& statistics = memory_manager.PlacementStatistics();
+  const size_t free_memory_size = memory_manager.FreeMemorySize();
+  const double fragmentation = free_memory_size ?
+      1.0 - static_cast<double>(memory_manager.LargestFreeSegmentSize()) /
+            free_memory_size :
+      0.0;
+  ostream << "shifted allocations " << statistics.shifted_allocations << endl
+          << "padding size " << statistics.padding_size << endl
+          << "free memory " << free_memory_size << " in "
+          << memory_manager.FreeSegmentsCount() << " segments" << endl
+          << "largest free segment "
+          << memory_manager.LargestFreeSegmentSize() << endl
+          << "fragmentation " << fragmentation << endl;
+}
+
+
+template <class Manager>
+void OutputMemoryManagerFootprint(const Manager& memory_manager,
+                                  std::ostream& ostream) {
+  const size_t blocks_count = memory_manager.AllocatedBlocksCount();
+  ostream << "metadata " << memory_manager.MetadataSize() << " bytes for "
+          << blocks_count << " live blocks and "
+          << memory_manager.FreeSegmentsCount() << " free segments" << endl;
+  if (blocks_count) {
+    ostream << "metadata per live block "
+            << static_cast<double>(memory_manager.MetadataSize()) /
+               blocks_count << " bytes" << endl;
+  }
+}
+
+
+template <class Manager>
+void EnableMemoryManagerLayoutDigest(Manager*) {
+  throw std::invalid_argument("--digest needs engine=list");
+}
+
+
+template <class FreeSegmentIndex>
+void EnableMemoryManagerLayoutDigest(
+    BasicMemoryManager<FreeSegmentIndex>* memory_manager) {
+  memory_manager->EnableLayoutDigest();
+}
+
+
+template <class FreeSegmentIndex>
+void OutputMemoryManagerLayoutDigest(
+    const BasicMemoryManager<FreeSegmentIndex>& memory_manager,
+    std::ostream& ostream) {
+  const std::ios_base::fmtflags flags = ostream.flags();
+  ostream << "layout digest " << std::hex
+          << memory_manager.LayoutDigest()->Root() << endl;
+  ostream.flags(flags);
+}
+
+
+template <class Manager>
+void OutputMemoryManagerLayoutDigest(const Manager&, std::ostream&) {
+}
+
+
+/** LatencyHistogram: BEGIN **/
+LatencyHistogram::LatencyHistogram(int significant_bits)
+  : significant_bits_(significant_bits)
+  , counts_((size_t(1) << significant_bits) +
+            (64 - significant_bits) * (size_t(1) << (significant_bits - 1)))
+  , max_(0)
+  , count_(0)
+{ }
+
+
+void LatencyHistogram::Record(uint64_t value) {
+  ++counts_[BucketIndex(value)];
+  max_ = std::max(max_, value);
+  ++count_;
+}
+
+
+uint64_t LatencyHistogram::ValueAtPercentile(double percentile) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  const auto rank = static_cast<uint64_t>(percentile / 100.0 * count_ + 0.5);
+  uint64_t seen = 0;
+  for (size_t bucket_index = 0; bucket_index < counts_.size();
+       ++bucket_index) {
+    seen += counts_[bucket_index];
+    if (seen >= std::max<uint64_t>(rank, 1)) {
+      return std::min(BucketValue(bucket_index), max_);
+    }
+  }
+  return max_;
+}
+
+
+uint64_t LatencyHistogram::Max() const {
+  return max_;
+}
+
+
+size_t LatencyHistogram::Count() const {
+  return count_;
+}
+
+
+size_t LatencyHistogram::BucketIndex(uint64_t value) const {
+  const int most_significant_bit = 63 - __builtin_clzll(value | 1);
+  if (most_significant_bit < significant_bits_) {
+    return value;
+  }
+  const int shift = most_significant_bit - significant_bits_ + 1;
+  const size_t half_bucket_count = size_t(1) << (significant_bits_ - 1);
+  return (size_t(1) << significant_bits_) + (shift - 1) * half_bucket_count +
+         ((value >> shift) - half_bucket_count);
+}
+
+
+uint64_t LatencyHistogram::BucketValue(size_t bucket_index) const {
+  const size_t exact_bucket_count = size_t(1) << significant_bits_;
+  if (bucket_index < exact_bucket_count) {
+    return bucket_index;
+  }
+  const size_t half_bucket_count = exact_bucket_count / 2;
+  const size_t shift = (bucket_index - exact_bucket_count) / half_bucket_count
+                       + 1;
+  const uint64_t sub_bucket =
+      (bucket_index - exact_bucket_count) % half_bucket_count +
+      half_bucket_count;
+  return ((sub_bucket + 1) << shift) - 1;
+}
+
+
+/** LatencyHistogram: END **/
+
+
+namespace {
+
+template <class Manager>
+void BenchmarkFreeSegmentIndex(
+    const char* name,
+    size_t memory_size,
+    const std::vector<MemoryManagerQuery>& queries,
+    std::ostream& ostream) {
+  const int kRepetitions = 5;
+  double best_seconds = 0;
+  int64_t checksum = 0;
+  for (int repetition = 0; repetition < kRepetitions; ++repetition) {
+    Manager memory_manager(memory_size);
+    const auto start = std::chrono::steady_clock::now();
+    const auto responses =
+        RunMemoryManager(&memory_manager, queries, AllocationOptions());
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (repetition == 0 || elapsed.count() < best_seconds) {
+      best_seconds = elapsed.count();
+    }
+    checksum = 0;
+    for (const auto& response : responses) {
+      checksum = checksum * 31 + MemoryManagerResponseValue(response);
+    }
+  }
+  ostream << name << ": " << best_seconds << " s, "
+          << queries.size() / best_seconds << " queries/s, checksum "
+          << checksum << endl;
+}
+
+}  // namespace
+
+
+void BenchmarkFreeSegmentIndexes(
+    size_t memory_size,
+    const std::vector<MemoryManagerQuery>& queries,
+    std::ostream& ostream) {
+  MemoryManagerEngines::ForEach([&](auto engine) {
+    using Engine = decltype(engine);
+    BenchmarkFreeSegmentIndex<typename Engine::Manager>(
+        Engine::kName, memory_size, queries, ostream);
+  });
+}
+
+
+void BenchmarkMemoryManagerBank(
+    size_t tenants_count,
+    size_t steps_count,
+    std::ostream& ostream) {
+  using Clock = std::chrono::steady_clock;
+  using Operation = MemoryManagerBankOperation;
+  const size_t kMemorySize = 1024;
+  const size_t kMaxSegments = 16;
+  // Не больше (kMaxSegments - 1) / 2 живых блоков: тогда сегментов
+  // у арендатора всегда не больше kMaxSegments.
+  const size_t kMaxLiveBlocks = (kMaxSegments - 1) / 2;
+
+  std::vector<MemoryManager> memory_managers;
+  memory_managers.reserve(tenants_count);
+  for (size_t tenant = 0; tenant < tenants_count; ++tenant) {
+    memory_managers.emplace_back(kMemorySize);
+  }
+  std::vector<std::vector<MemoryManager::Iterator>> live_blocks(
+      tenants_count);
+  std::vector<std::vector<Operation>> batches(
+      steps_count, std::vector<Operation>(tenants_count));
+  std::vector<std::vector<int64_t>> expected_results(
+      steps_count, std::vector<int64_t>(tenants_count));
+  uint64_t random_state = 88172645463325252ULL;
+  auto random = [&random_state]() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+  };
+
+  double managers_seconds = 0;
+  for (size_t step = 0; step < steps_count; ++step) {
+    std::vector<size_t> freed_blocks(tenants_count);
+    for (size_t tenant = 0; tenant < tenants_count; ++tenant) {
+      auto& blocks = live_blocks[tenant];
+      Operation& operation = batches[step][tenant];
+      const auto choice = random() % 8;
+      if (!blocks.empty() && (choice < 3 || blocks.size() == kMaxLiveBlocks)) {
+        freed_blocks[tenant] = random() % blocks.size();
+        operation.kind = Operation::Kind::kFree;
+        operation.offset = blocks[freed_blocks[tenant]]->left;
+        operation.size = blocks[freed_blocks[tenant]]->Size();
+      } else if (choice < 7) {
+        operation.kind = Operation::Kind::kAllocate;
+        operation.size = random() % (kMemorySize / 4) + 1;
+        operation.offset = 0;
+      } else {
+        operation.kind = Operation::Kind::kNone;
+      }
+    }
+    const auto start = Clock::now();
+    for (size_t tenant = 0; tenant < tenants_count; ++tenant) {
+      const Operation& operation = batches[step][tenant];
+      auto& blocks = live_blocks[tenant];
+      expected_results[step][tenant] = MemoryManagerBank::kFailedAllocation;
+      if (operation.kind == Operation::Kind::kAllocate) {
+        auto block = memory_managers[tenant].Allocate(operation.size);
+        if (block != memory_managers[tenant].end()) {
+          expected_results[step][tenant] = block->left;
+          blocks.push_back(block);
+        }
+      } else if (operation.kind == Operation::Kind::kFree) {
+        memory_managers[tenant].Free(blocks[freed_blocks[tenant]]);
+        blocks.erase(blocks.begin() + freed_blocks[tenant]);
+      }
+    }
+    managers_seconds +=
+        std::chrono::duration<double>(Clock::now() - start).count();
+  }
+
+  MemoryManagerBank bank(tenants_count, kMemorySize, kMaxSegments);
+  std::vector<int64_t> results(tenants_count);
+  size_t mismatches_count = 0;
+  double bank_seconds = 0;
+  for (size_t step = 0; step < steps_count; ++step) {
+    const auto start = Clock::now();
+    bank.Execute(batches[step], &results);
+    bank_seconds +=
+        std::chrono::duration<double>(Clock::now() - start).count();
+    for (size_t tenant = 0; tenant < tenants_count; ++tenant) {
+      if (batches[step][tenant].kind == Operation::Kind::kAllocate &&
+          results[tenant] != expected_results[step][tenant]) {
+        ++mismatches_count;
+      }
+    }
+  }
+  const double operations_count =
+      static_cast<double>(tenants_count) * steps_count;
+  ostream << "tenants " << tenants_count << ", steps " << steps_count << endl
+          << "memory managers: " << managers_seconds << " s, "
+          << operations_count / managers_seconds << " ops/s" << endl
+          << "bank: " << bank_seconds << " s, "
+          << operations_count / bank_seconds << " ops/s" << endl
+          << "mismatches " << mismatches_count << endl;
+}
+
+
+/** MemoryManagerResource: BEGIN **/
+MemoryManagerResource::MemoryManagerResource(size_t memory_size)
+  : arena_storage_(new char[memory_size + kArenaAlignment])
+  , arena_(nullptr)
+  , memory_manager_(MemoryManager(memory_size))
+  , blocks_(LiveAllocationTable<MemoryManager::Iterator>())
+{
+  const auto address = reinterpret_cast<uintptr_t>(arena_storage_.get());
+  arena_ = arena_storage_.get() +
+           (kArenaAlignment - address % kArenaAlignment) % kArenaAlignment;
+}
+
+
+const MemoryManager& MemoryManagerResource::Manager() const {
+  return memory_manager_;
+}
+
+
+void* MemoryManagerResource::do_allocate(size_t bytes, size_t alignment) {
+  AllocationOptions options;
+  options.alignment = alignment;
+  const auto block = memory_manager_.Allocate(std::max<size_t>(bytes, 1),
+                                              options);
+  if (block == memory_manager_.end()) {
+    throw std::bad_alloc();
+  }
+  blocks_.Insert(block->left, block);
+  return arena_ + block->left;
+}
+
+
+void MemoryManagerResource::do_deallocate(void* pointer, size_t, size_t) {
+  MemoryManager::Iterator block;
+  if (!blocks_.Extract(static_cast<char*>(pointer) - arena_, &block)) {
+    throw std::invalid_argument("Pointer does not belong to the resource");
+  }
+  memory_manager_.Free(block);
+}
+
+
+bool MemoryManagerResource::do_is_equal(
+    const std::pmr::memory_resource& other) const noexcept {
+  return this == &other;
+}
+
+
+/** MemoryManagerResource: END **/
+
+
+/** RelocatableMemoryManager: BEGIN **/
+RelocatableMemoryManager::RelocatableMemoryManager(size_t memory_size,
+                                                   size_t max_blocks_count)
+  : arena_(new char[memory_size])
+  , blocks_(new Block[max_blocks_count])
+  , max_blocks_count_(max_blocks_count)
+  , segments_(std::vector<MemoryManager::Iterator>())
+  , free_handles_(std::vector<Handle>())
+  , memory_manager_(MemoryManager(memory_size))
+  , handles_by_offset_(LiveAllocationTable<Handle>())
+  , cursor_(kNullHandle)
+  , moved_size_(0)
+{ }
+
+
+RelocatableMemoryManager::Handle RelocatableMemoryManager::Allocate(
+    size_t size) {
+  if (free_handles_.empty() && segments_.size() == max_blocks_count_) {
+    return kNullHandle;
+  }
+  const auto segment = memory_manager_.Allocate(std::max<size_t>(size, 1));
+  if (segment == memory_manager_.end()) {
+    return kNullHandle;
+  }
+  Handle handle;
+  if (free_handles_.empty()) {
+    handle = segments_.size();
+    segments_.push_back(segment);
+  } else {
+    handle = free_handles_.back();
+    free_handles_.pop_back();
+    segments_[handle] = segment;
+  }
+  Block& block = blocks_[handle];
+  block.size = segment->Size();
+  block.pin_state.store(0, std::memory_order_relaxed);
+  block.offset.store(segment->left, std::memory_order_release);
+  handles_by_offset_.Insert(segment->left, handle);
+  return handle;
+}
+
+
+void RelocatableMemoryManager::Free(Handle handle) {
+  if (blocks_[handle].pin_state.load(std::memory_order_acquire) != 0) {
+    throw std::logic_error("Freeing a pinned block");
+  }
+  const auto segment = segments_[handle];
+  Handle extracted;
+  handles_by_offset_.Extract(segment->left, &extracted);
+  memory_manager_.Free(segment);
+  free_handles_.push_back(handle);
+  if (cursor_ == handle) {
+    cursor_ = kNullHandle;
+  }
+}
+
+
+size_t RelocatableMemoryManager::CompactStep(size_t max_bytes) {
+  const bool from_beginning = cursor_ == kNullHandle;
+  auto segment = from_beginning ? memory_manager_.begin() : segments_[cursor_];
+  size_t moved_size = 0;
+  while (moved_size < max_bytes) {
+    if (segment == memory_manager_.end()) {
+      cursor_ = kNullHandle;
+      // Проход, начатый с середины, мог пропустить дыры в начале арены.
+      if (moved_size == 0 && !from_beginning) {
+        return CompactStep(max_bytes);
+      }
+      break;
+    }
+    if (segment->heap_index == MemorySegmentHeap::kNullIndex &&
+        Relocate(segment)) {
+      moved_size += segment->Size();
+    }
+    ++segment;
+  }
+  moved_size_ += moved_size;
+  return moved_size;
+}
+
+
+bool RelocatableMemoryManager::Relocate(MemoryManager::Iterator segment) {
+  if (segment == memory_manager_.begin() ||
+      std::prev(segment)->heap_index == MemorySegmentHeap::kNullIndex) {
+    return false;
+  }
+  Handle handle;
+  handles_by_offset_.Extract(segment->left, &handle);
+  Block& block = blocks_[handle];
+  uint32_t pin_state = 0;
+  if (!block.pin_state.compare_exchange_strong(
+          pin_state, kMovingFlag, std::memory_order_acquire)) {
+    handles_by_offset_.Insert(segment->left, handle);
+    return false;
+  }
+  const int old_offset = segment->left;
+  memory_manager_.SlideLeft(segment);
+  std::memmove(arena_.get() + segment->left, arena_.get() + old_offset,
+               segment->Size());
+  block.offset.store(segment->left, std::memory_order_relaxed);
+  block.pin_state.store(0, std::memory_order_release);
+  handles_by_offset_.Insert(segment->left, handle);
+  cursor_ = handle;
+  return true;
+}
+
+
+char* RelocatableMemoryManager::Pin(Handle handle) {
+  Block& block = blocks_[handle];
+  uint32_t pin_state = block.pin_state.load(std::memory_order_relaxed);
+  while (true) {
+    if (pin_state & kMovingFlag) {
+      std::this_thread::yield();
+      pin_state = block.pin_state.load(std::memory_order_relaxed);
+    } else if (block.pin_state.compare_exchange_weak(
+                   pin_state, pin_state + 1, std::memory_order_acquire,
+                   std::memory_order_relaxed)) {
+      break;
+    }
+  }
+  return arena_.get() + block.offset.load(std::memory_order_relaxed);
+}
+
+
+void RelocatableMemoryManager::Unpin(Handle handle) {
+  blocks_[handle].pin_state.fetch_sub(1, std::memory_order_release);
+}
+
+
+int RelocatableMemoryManager::Offset(Handle handle) const {
+  return blocks_[handle].offset.load(std::memory_order_acquire);
+}
+
+
+size_t RelocatableMemoryManager::Size(Handle handle) const {
+  return blocks_[handle].size;
+}
+
+
+size_t RelocatableMemoryManager::FreeMemorySize() const {
+  return memory_manager_.FreeMemorySize();
+}
+
+
+size_t RelocatableMemoryManager::FreeSegmentsCount() const {
+  return memory_manager_.FreeSegmentsCount();
+}
+
+
+size_t RelocatableMemoryManager::LargestFreeSegmentSize() const {
+  return memory_manager_.LargestFreeSegmentSize();
+}
+
+
+size_t RelocatableMemoryManager::MovedSize() const {
+  return moved_size_;
+}
+
+
+/** RelocatableMemoryManager: END **/
+
+
+/** PersistentMemoryManager: BEGIN **/
+PersistentMemoryManager::PersistentMemoryManager(
+    const std::string& path, size_t memory_size, size_t max_segments,
+    bool synchronous)
+  : descriptor_(-1)
+  , words_(nullptr)
+  , words_count_(0)
+  , records_word_(kJournalWord + 2 * kJournalCapacity)
+  , heap_word_(0)
+  , synchronous_(synchronous)
+  , recovered_(false)
+  , pending_slots_(std::vector<PendingSlot>(kPendingSlotsCount,
+                                            PendingSlot{0, 0, 0}))
+  , pending_(std::vector<uint32_t>())
+  , generation_(1)
+{
+  if (memory_size > static_cast<size_t>(std::numeric_limits<int>::max()) ||
+      max_segments == 0 ||
+      max_segments >= (kNullHandle - records_word_) / (kRecordWords + 1)) {
+    throw std::invalid_argument("Unsupported persistent memory manager size");
+  }
+  heap_word_ = records_word_ + max_segments * kRecordWords;
+  words_count_ = heap_word_ + max_segments;
+  pending_.reserve(kJournalCapacity);
+#if defined(__unix__)
+  descriptor_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (descriptor_ < 0) {
+    throw std::runtime_error("Cannot open " + path);
+  }
+  try {
+    struct stat file_status;
+    if (fstat(descriptor_, &file_status) != 0) {
+      throw std::runtime_error("Cannot stat " + path);
+    }
+    const size_t file_size = words_count_ * sizeof(uint32_t);
+    const bool fresh = file_status.st_size == 0;
+    if (fresh && ftruncate(descriptor_, file_size) != 0) {
+      throw std::runtime_error("Cannot resize " + path);
+    }
+    if (!fresh && static_cast<size_t>(file_status.st_size) != file_size) {
+      throw std::runtime_error(path + " has a different layout");
+    }
+    void* address = mmap(nullptr, file_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, descriptor_, 0);
+    if (address == MAP_FAILED) {
+      throw std::runtime_error("Cannot map " + path);
+    }
+    words_ = static_cast<uint32_t*>(address);
+    // Магическое слово пишется последним, так что файл, создание которого
+    // прервалось, просто размечается заново.
+    if (words_[kMagicWord] == 0) {
+      Format(memory_size, max_segments);
+    } else if (words_[kMagicWord] != kMagic ||
+               words_[kVersionWord] != kVersion ||
+               words_[kMemorySizeWord] != memory_size ||
+               words_[kMaxSegmentsWord] != max_segments ||
+               words_[kHeapSizeWord] > max_segments ||
+               words_[kUnusedRecordsWord] > max_segments) {
+      throw std::runtime_error(path + " has a different layout");
+    } else {
+      Recover();
+    }
+  } catch (...) {
+    Close();
+    throw;
+  }
+#else
+  throw std::runtime_error("PersistentMemoryManager needs mmap");
+#endif
+}
+
+
+PersistentMemoryManager::~PersistentMemoryManager() {
+  Close();
+}
+
+
+PersistentMemoryManager::Iterator PersistentMemoryManager::Allocate(
+    size_t size) {
+  if (words_[kHeapSizeWord] == 0) {
+    return end();
+  }
+  const uint32_t top = HeapAt(0);
+  const uint32_t left = Get(top, kLeft);
+  if (size > Get(top, kRight) - left) {
+    return end();
+  }
+  uint32_t block = top;
+  if (size == Get(top, kRight) - left) {
+    HeapErase(0);
+  } else {
+    block = NewRecord();
+    const uint32_t previous = Get(top, kPrev);
+    Set(block, kLeft, left);
+    Set(block, kRight, left + size);
+    Set(block, kPrev, previous);
+    Set(block, kNext, top);
+    Set(block, kHeapIndex, kNullHandle);
+    if (previous != kNullHandle) {
+      Set(previous, kNext, block);
+    } else {
+      Store(kSegmentsHeadWord, block);
+    }
+    Set(top, kPrev, block);
+    Set(top, kLeft, left + size);
+    HeapSiftDown(0);
+  }
+  Store(kFreeMemoryWord, Load(kFreeMemoryWord) - size);
+  Store(kAllocatedBlocksWord, Load(kAllocatedBlocksWord) + 1);
+  Commit();
+  return block;
+}
+
+
+void PersistentMemoryManager::Free(Iterator position) {
+  if (Get(position, kHeapIndex) != kNullHandle) {
+    throw std::logic_error("Freeing a free persistent segment");
+  }
+  uint32_t left = Get(position, kLeft);
+  uint32_t right = Get(position, kRight);
+  Store(kFreeMemoryWord, Load(kFreeMemoryWord) + (right - left));
+  Store(kAllocatedBlocksWord, Load(kAllocatedBlocksWord) - 1);
+  const uint32_t previous = Get(position, kPrev);
+  if (previous != kNullHandle && Get(previous, kHeapIndex) != kNullHandle) {
+    left = Get(previous, kLeft);
+    HeapErase(Get(previous, kHeapIndex));
+    Unlink(previous);
+    DeleteRecord(previous);
+  }
+  const uint32_t next = Get(position, kNext);
+  if (next != kNullHandle && Get(next, kHeapIndex) != kNullHandle) {
+    right = Get(next, kRight);
+    HeapErase(Get(next, kHeapIndex));
+    Unlink(next);
+    DeleteRecord(next);
+  }
+  Set(position, kLeft, left);
+  Set(position, kRight, right);
+  HeapPush(position);
+  Commit();
+}
+
+
+PersistentMemoryManager::Iterator PersistentMemoryManager::end() const {
+  return kNullHandle;
+}
+
+
+size_t PersistentMemoryManager::FreeMemorySize() const {
+  return words_[kFreeMemoryWord];
+}
+
+
+size_t PersistentMemoryManager::FreeSegmentsCount() const {
+  return words_[kHeapSizeWord];
+}
+
+
+size_t PersistentMemoryManager::LargestFreeSegmentSize() const {
+  if (words_[kHeapSizeWord] == 0) {
+    return 0;
+  }
+  const uint32_t top = HeapAt(0);
+  return Get(top, kRight) - Get(top, kLeft);
+}
+
+
+int PersistentMemoryManager::Offset(Iterator position) const {
+  return Get(position, kLeft);
+}
+
+
+size_t PersistentMemoryManager::AllocatedBlocksCount() const {
+  return words_[kAllocatedBlocksWord];
+}
+
+
+bool PersistentMemoryManager::Recovered() const {
+  return recovered_;
+}
+
+
+/*
+ * Проходит список сегментов от головы и сверяет его с заголовком и кучей:
+ * сегменты покрывают [0, memory_size) подряд, соседние свободные слиты,
+ * свободные — ровно те, что в куче, и на своих местах, а сама куча
+ * упорядочена.
+ */
+bool PersistentMemoryManager::Verify() const {
+  const uint32_t max_segments = words_[kMaxSegmentsWord];
+  const uint32_t heap_size = words_[kHeapSizeWord];
+  uint32_t expected_left = 0;
+  uint32_t previous = kNullHandle;
+  bool previous_free = false;
+  size_t segments_count = 0;
+  size_t free_segments_count = 0;
+  size_t free_memory_size = 0;
+  size_t allocated_blocks_count = 0;
+  for (uint32_t record = words_[kSegmentsHeadWord]; record != kNullHandle;
+       record = Get(record, kNext)) {
+    if (record >= words_[kUnusedRecordsWord] ||
+        ++segments_count > max_segments || Get(record, kPrev) != previous ||
+        Get(record, kLeft) != expected_left ||
+        Get(record, kRight) < expected_left) {
+      return false;
+    }
+    const uint32_t heap_index = Get(record, kHeapIndex);
+    const bool free = heap_index != kNullHandle;
+    if (free) {
+      if (previous_free || heap_index >= heap_size ||
+          HeapAt(heap_index) != record) {
+        return false;
+      }
+      ++free_segments_count;
+      free_memory_size += Get(record, kRight) - Get(record, kLeft);
+    } else {
+      ++allocated_blocks_count;
+    }
+    expected_left = Get(record, kRight);
+    previous = record;
+    previous_free = free;
+  }
+  if (expected_left != words_[kMemorySizeWord] ||
+      free_segments_count != heap_size ||
+      free_memory_size != words_[kFreeMemoryWord] ||
+      allocated_blocks_count != words_[kAllocatedBlocksWord] ||
+      words_[kJournalCountWord] != 0) {
+    return false;
+  }
+  for (uint32_t position = 1; position < heap_size; ++position) {
+    if (HeapAbove(HeapAt(position), HeapAt((position - 1) / 2))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void PersistentMemoryManager::Format(size_t memory_size,
+                                     size_t max_segments) {
+  words_[kVersionWord] = kVersion;
+  words_[kMemorySizeWord] = memory_size;
+  words_[kMaxSegmentsWord] = max_segments;
+  words_[kSegmentsHeadWord] = 0;
+  words_[kFreeRecordsWord] = kNullHandle;
+  words_[kUnusedRecordsWord] = 1;
+  words_[kHeapSizeWord] = 1;
+  words_[kFreeMemoryWord] = memory_size;
+  words_[kAllocatedBlocksWord] = 0;
+  words_[kJournalCountWord] = 0;
+  uint32_t* initial_record = words_ + records_word_;
+  initial_record[kLeft] = 0;
+  initial_record[kRight] = memory_size;
+  initial_record[kPrev] = kNullHandle;
+  initial_record[kNext] = kNullHandle;
+  initial_record[kHeapIndex] = 0;
+  words_[heap_word_] = 0;
+  Sync(0, words_count_);
+  words_[kMagicWord] = kMagic;
+  Sync(0, kHeaderWords);
+}
+
+
+/*
+ * Перенос зафиксированного журнала, если падение случилось между
+ * точкой фиксации и его обнулением.
+ */
+void PersistentMemoryManager::Recover() {
+  const uint32_t count = words_[kJournalCountWord];
+  if (count == 0) {
+    return;
+  }
+  const uint32_t* journal = words_ + kJournalWord;
+  const uint64_t checksum =
+      words_[kJournalChecksumWord] |
+      static_cast<uint64_t>(words_[kJournalChecksumWord + 1]) << 32;
+  if (count <= kJournalCapacity &&
+      JournalChecksum(journal, count) == checksum) {
+    for (uint32_t entry_n = 0; entry_n < count; ++entry_n) {
+      if (journal[2 * entry_n] >= words_count_) {
+        throw std::runtime_error("Corrupted persistent journal");
+      }
+      words_[journal[2 * entry_n]] = journal[2 * entry_n + 1];
+    }
+    Sync(kHeaderWords, words_count_ - kHeaderWords);
+    recovered_ = true;
+  }
+  words_[kJournalCountWord] = 0;
+  Sync(0, kHeaderWords);
+}
+
+
+void PersistentMemoryManager::Close() {
+#if defined(__unix__)
+  if (words_ != nullptr) {
+    Sync(0, words_count_);
+    munmap(words_, words_count_ * sizeof(uint32_t));
+    words_ = nullptr;
+  }
+  if (descriptor_ >= 0) {
+    close(descriptor_);
+    descriptor_ = -1;
+  }
+#endif
+}
+
+
+void PersistentMemoryManager::Sync(size_t first_word,
+                                   size_t words_count) const {
+#if defined(__unix__)
+  if (!synchronous_ || words_count == 0) {
+    return;
+  }
+  static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  const uintptr_t begin =
+      reinterpret_cast<uintptr_t>(words_ + first_word) & ~(page_size - 1);
+  const uintptr_t end =
+      reinterpret_cast<uintptr_t>(words_ + first_word + words_count);
+  if (msync(reinterpret_cast<void*>(begin), end - begin, MS_SYNC) != 0) {
+    throw std::runtime_error("msync failed");
+  }
+#endif
+}
+
+
+uint64_t PersistentMemoryManager::JournalChecksum(const uint32_t* journal,
+                                                  uint32_t count) {
+  uint64_t checksum = 0x9e3779b97f4a7c15ULL * (count + 1);
+  for (uint32_t entry_n = 0; entry_n < count; ++entry_n) {
+    checksum ^= static_cast<uint64_t>(journal[2 * entry_n]) << 32 |
+                journal[2 * entry_n + 1];
+    checksum *= 0xbf58476d1ce4e5b9ULL;
+    checksum ^= checksum >> 31;
+  }
+  return checksum;
+}
+
+
+/*
+ * Записи операции лежат в открытой адресации pending_slots_; слот
+ * действителен, только если его generation совпадает с текущим, так что
+ * после фиксации таблицу не нужно чистить.
+ */
+uint32_t PersistentMemoryManager::Load(uint32_t word) const {
+  const size_t mask = kPendingSlotsCount - 1;
+  for (size_t slot = (word * 2654435761u) & mask;
+       pending_slots_[slot].generation == generation_;
+       slot = (slot + 1) & mask) {
+    if (pending_slots_[slot].word == word) {
+      return pending_slots_[slot].value;
+    }
+  }
+  return words_[word];
+}
+
+
+void PersistentMemoryManager::Store(uint32_t word, uint32_t value) {
+  const size_t mask = kPendingSlotsCount - 1;
+  size_t slot = (word * 2654435761u) & mask;
+  for (; pending_slots_[slot].generation == generation_;
+       slot = (slot + 1) & mask) {
+    if (pending_slots_[slot].word == word) {
+      pending_slots_[slot].value = value;
+      return;
+    }
+  }
+  if (pending_.size() == kJournalCapacity) {
+    throw std::logic_error("Persistent operation overflows the journal");
+  }
+  pending_slots_[slot] = PendingSlot{word, value, generation_};
+  pending_.push_back(slot);
+}
+
+
+void PersistentMemoryManager::Commit() {
+  const uint32_t count = pending_.size();
+  uint32_t* journal = words_ + kJournalWord;
+  for (uint32_t entry_n = 0; entry_n < count; ++entry_n) {
+    const PendingSlot& slot = pending_slots_[pending_[entry_n]];
+    journal[2 * entry_n] = slot.word;
+    journal[2 * entry_n + 1] = slot.value;
+  }
+  Sync(kJournalWord, 2 * count);
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  const uint64_t checksum = JournalChecksum(journal, count);
+  words_[kJournalChecksumWord] = static_cast<uint32_t>(checksum);
+  words_[kJournalChecksumWord + 1] = static_cast<uint32_t>(checksum >> 32);
+  words_[kJournalCountWord] = count;
+  Sync(0, kHeaderWords);
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+
+#if defined(__unix__)
+  static const uint32_t page_words = sysconf(_SC_PAGESIZE) / sizeof(uint32_t);
+#else
+  const uint32_t page_words = 1;
+#endif
+  std::vector<uint32_t> touched_pages;
+  for (uint32_t entry_n = 0; entry_n < count; ++entry_n) {
+    words_[journal[2 * entry_n]] = journal[2 * entry_n + 1];
+    if (synchronous_) {
+      touched_pages.push_back(journal[2 * entry_n] / page_words);
+    }
+  }
+  std::sort(touched_pages.begin(), touched_pages.end());
+  touched_pages.erase(std::unique(touched_pages.begin(), touched_pages.end()),
+                      touched_pages.end());
+  for (auto page : touched_pages) {
+    Sync(static_cast<size_t>(page) * page_words,
+         std::min<size_t>(page_words, words_count_ - page * page_words));
+  }
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  words_[kJournalCountWord] = 0;
+  Sync(0, kHeaderWords);
+
+  pending_.clear();
+  if (++generation_ == 0) {
+    for (auto& slot : pending_slots_) {
+      slot.generation = 0;
+    }
+    generation_ = 1;
+  }
+}
+
+
+uint32_t PersistentMemoryManager::Get(uint32_t record, Field field) const {
+  return Load(records_word_ + record * kRecordWords + field);
+}
+
+
+void PersistentMemoryManager::Set(uint32_t record, Field field,
+                                  uint32_t value) {
+  Store(records_word_ + record * kRecordWords + field, value);
+}
+
+
+/*
+ * Берёт запись из списка неиспользуемых или ещё нетронутую; когда
+ * записей нет, бросает исключение до первой записи в операции.
+ */
+uint32_t PersistentMemoryManager::NewRecord() {
+  const uint32_t head = Load(kFreeRecordsWord);
+  if (head != kNullHandle) {
+    Store(kFreeRecordsWord, Get(head, kNext));
+    return head;
+  }
+  const uint32_t unused = Load(kUnusedRecordsWord);
+  if (unused == Load(kMaxSegmentsWord)) {
+    throw std::length_error("Persistent memory manager ran out of records");
+  }
+  Store(kUnusedRecordsWord, unused + 1);
+  return unused;
+}
+
+
+void PersistentMemoryManager::DeleteRecord(uint32_t record) {
+  Set(record, kNext, Load(kFreeRecordsWord));
+  Store(kFreeRecordsWord, record);
+}
+
+
+void PersistentMemoryManager::Unlink(uint32_t record) {
+  const uint32_t previous = Get(record, kPrev);
+  const uint32_t next = Get(record, kNext);
+  if (previous != kNullHandle) {
+    Set(previous, kNext, next);
+  } else {
+    Store(kSegmentsHeadWord, next);
+  }
+  if (next != kNullHandle) {
+    Set(next, kPrev, previous);
+  }
+}
+
+
+uint32_t PersistentMemoryManager::HeapAt(uint32_t position) const {
+  return Load(heap_word_ + position);
+}
+
+
+bool PersistentMemoryManager::HeapAbove(uint32_t first_record,
+                                        uint32_t second_record) const {
+  const uint32_t first_size =
+      Get(first_record, kRight) - Get(first_record, kLeft);
+  const uint32_t second_size =
+      Get(second_record, kRight) - Get(second_record, kLeft);
+  if (first_size == second_size) {
+    return Get(first_record, kLeft) < Get(second_record, kLeft);
+  }
+  return first_size > second_size;
+}
+
+
+void PersistentMemoryManager::HeapSwap(uint32_t first_position,
+                                       uint32_t second_position) {
+  const uint32_t first_record = HeapAt(first_position);
+  const uint32_t second_record = HeapAt(second_position);
+  Store(heap_word_ + first_position, second_record);
+  Store(heap_word_ + second_position, first_record);
+  Set(first_record, kHeapIndex, second_position);
+  Set(second_record, kHeapIndex, first_position);
+}
+
+
+uint32_t PersistentMemoryManager::HeapSiftUp(uint32_t position) {
+  while (position != 0 &&
+         HeapAbove(HeapAt(position), HeapAt((position - 1) / 2))) {
+    HeapSwap(position, (position - 1) / 2);
+    position = (position - 1) / 2;
+  }
+  return position;
+}
+
+
+void PersistentMemoryManager::HeapSiftDown(uint32_t position) {
+  const uint32_t heap_size = Load(kHeapSizeWord);
+  while (2 * position + 1 < heap_size) {
+    uint32_t best_son = 2 * position + 1;
+    if (best_son + 1 < heap_size &&
+        HeapAbove(HeapAt(best_son + 1), HeapAt(best_son))) {
+      ++best_son;
+    }
+    if (!HeapAbove(HeapAt(best_son), HeapAt(position))) {
+      return;
+    }
+    HeapSwap(best_son, position);
+    position = best_son;
+  }
+}
+
+
+void PersistentMemoryManager::HeapPush(uint32_t record) {
+  const uint32_t position = Load(kHeapSizeWord);
+  Store(heap_word_ + position, record);
+  Set(record, kHeapIndex, position);
+  Store(kHeapSizeWord, position + 1);
+  HeapSiftUp(position);
+}
+
+
+void PersistentMemoryManager::HeapErase(uint32_t position) {
+  const uint32_t last = Load(kHeapSizeWord) - 1;
+  Set(HeapAt(position), kHeapIndex, kNullHandle);
+  Store(kHeapSizeWord, last);
+  if (position == last) {
+    return;
+  }
+  const uint32_t last_record = HeapAt(last);
+  Store(heap_word_ + position, last_record);
+  Set(last_record, kHeapIndex, position);
+  HeapSiftDown(HeapSiftUp(position));
+}
+
+
+/** PersistentMemoryManager: END **/
+
+
+namespace {
+
+uint64_t NextRandom(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+
+char BlockPattern(RelocatableMemoryManager::Handle handle) {
+  return static_cast<char>((handle * 2654435761u) >> 24);
+}
+
+
+RelocatableMemoryManager::Handle AllocatePatternedBlock(
+    RelocatableMemoryManager* memory_manager, size_t size) {
+  const auto handle = memory_manager->Allocate(size);
+  if (handle != RelocatableMemoryManager::kNullHandle) {
+    std::memset(memory_manager->Pin(handle), BlockPattern(handle),
+                memory_manager->Size(handle));
+    memory_manager->Unpin(handle);
+  }
+  return handle;
+}
+
+
+bool CheckBlockPattern(RelocatableMemoryManager* memory_manager,
+                       RelocatableMemoryManager::Handle handle) {
+  const char* block = memory_manager->Pin(handle);
+  const size_t size = memory_manager->Size(handle);
+  const char pattern = BlockPattern(handle);
+  const bool matches = block[0] == pattern && block[size / 2] == pattern &&
+                       block[size - 1] == pattern;
+  memory_manager->Unpin(handle);
+  return matches;
+}
+
+
+/*
+ * Заполняет арену блоками от 64 байт до 16 КиБ и освобождает каждый
+ * второй; в *handles остаются живые блоки.
+ */
+void FragmentRelocatableArena(
+    RelocatableMemoryManager* memory_manager,
+    std::vector<RelocatableMemoryManager::Handle>* handles) {
+  uint64_t random_state = 88172645463325252ULL;
+  std::vector<RelocatableMemoryManager::Handle> allocated;
+  while (true) {
+    const size_t size = 64 + NextRandom(&random_state) % (16 << 10);
+    const auto handle = AllocatePatternedBlock(memory_manager, size);
+    if (handle == RelocatableMemoryManager::kNullHandle) {
+      break;
+    }
+    allocated.push_back(handle);
+  }
+  for (size_t block_n = 0; block_n < allocated.size(); ++block_n) {
+    if (block_n % 2 == 0) {
+      memory_manager->Free(allocated[block_n]);
+    } else {
+      handles->push_back(allocated[block_n]);
+    }
+  }
+}
+
+}  // namespace
+
+
+void BenchmarkCompaction(size_t step_size, std::ostream& ostream) {
+  using Clock = std::chrono::steady_clock;
+  const size_t kMemorySize = 64 << 20;
+  const size_t kChurnStepsCount = 1000;
+  auto nanoseconds_since = [](Clock::time_point start) {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - start).count());
+  };
+
+  {
+    RelocatableMemoryManager memory_manager(kMemorySize);
+    std::vector<RelocatableMemoryManager::Handle> handles;
+    FragmentRelocatableArena(&memory_manager, &handles);
+    ostream << "blocks " << handles.size() << " free "
+            << memory_manager.FreeMemorySize() << " largest_free "
+            << memory_manager.LargestFreeSegmentSize() << endl;
+    const auto start = Clock::now();
+    while (memory_manager.CompactStep(static_cast<size_t>(-1)) != 0) {
+    }
+    const uint64_t pause = nanoseconds_since(start);
+    size_t mismatches_count = 0;
+    for (auto handle : handles) {
+      mismatches_count += !CheckBlockPattern(&memory_manager, handle);
+    }
+    ostream << "stop-the-world pause_ns " << pause << " moved "
+            << memory_manager.MovedSize() << " largest_free "
+            << memory_manager.LargestFreeSegmentSize() << " mismatches "
+            << mismatches_count << endl;
+  }
+
+  RelocatableMemoryManager memory_manager(kMemorySize);
+  std::vector<RelocatableMemoryManager::Handle> handles;
+  FragmentRelocatableArena(&memory_manager, &handles);
+
+  // Читатель трогает только блоки из handles, которые владелец
+  // не освобождает; выделяет и освобождает он отдельные блоки.
+  std::atomic<bool> done(false);
+  std::atomic<size_t> reader_mismatches_count(0);
+  std::atomic<size_t> reader_pins_count(0);
+  std::thread reader([&]() {
+    uint64_t random_state = 2463534242ULL;
+    while (!done.load(std::memory_order_relaxed)) {
+      const auto handle =
+          handles[NextRandom(&random_state) % handles.size()];
+      if (!CheckBlockPattern(&memory_manager, handle)) {
+        reader_mismatches_count.fetch_add(1, std::memory_order_relaxed);
+      }
+      reader_pins_count.fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+
+  uint64_t random_state = 1181783497276652981ULL;
+  std::vector<RelocatableMemoryManager::Handle> churn;
+  LatencyHistogram step_latencies;
+  uint64_t total_pause = 0;
+  size_t churn_operations_count = 0;
+  for (size_t step_n = 0;; ++step_n) {
+    const auto start = Clock::now();
+    const size_t moved_size = memory_manager.CompactStep(step_size);
+    const uint64_t pause = nanoseconds_since(start);
+    step_latencies.Record(pause);
+    total_pause += pause;
+    if (step_n >= kChurnStepsCount) {
+      if (moved_size == 0) {
+        break;
+      }
+      continue;
+    }
+    const auto handle = AllocatePatternedBlock(
+        &memory_manager, 64 + NextRandom(&random_state) % (16 << 10));
+    if (handle != RelocatableMemoryManager::kNullHandle) {
+      churn.push_back(handle);
+    }
+    if (!churn.empty() && NextRandom(&random_state) % 2 == 0) {
+      const size_t block_n = NextRandom(&random_state) % churn.size();
+      memory_manager.Free(churn[block_n]);
+      churn[block_n] = churn.back();
+      churn.pop_back();
+    }
+    churn_operations_count += 2;
+  }
+  done.store(true, std::memory_order_relaxed);
+  reader.join();
+
+  size_t mismatches_count = reader_mismatches_count.load();
+  for (auto handle : handles) {
+    mismatches_count += !CheckBlockPattern(&memory_manager, handle);
+  }
+  for (auto handle : churn) {
+    mismatches_count += !CheckBlockPattern(&memory_manager, handle);
+  }
+  ostream << "incremental step_size " << step_size << " steps "
+          << step_latencies.Count() << " total_ns " << total_pause
+          << " moved " << memory_manager.MovedSize() << " free "
+          << memory_manager.FreeMemorySize() << " largest_free "
+          << memory_manager.LargestFreeSegmentSize() << " churn_operations "
+          << churn_operations_count << " reader_pins "
+          << reader_pins_count.load() << " mismatches " << mismatches_count
+          << endl;
+  ostream << "step pause:" << endl;
+  OutputLatencyHistogram(step_latencies, ostream);
+}
+
+
+namespace {
+
+class MallocResource : public std::pmr::memory_resource {
+ private:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    void* pointer = alignment <= alignof(std::max_align_t) ?
+        std::malloc(std::max<size_t>(bytes, 1)) :
+        std::aligned_alloc(alignment,
+                           (bytes + alignment - 1) / alignment * alignment);
+    if (pointer == nullptr) {
+      throw std::bad_alloc();
+    }
+    return pointer;
+  }
+
+  void do_deallocate(void* pointer, size_t, size_t) override {
+    std::free(pointer);
+  }
+
+  bool do_is_equal(
+      const std::pmr::memory_resource& other) const noexcept override {
+    return this == &other;
+  }
+};
+
+
+size_t ResidentSetSize() {
+#if defined(__linux__)
+  std::ifstream statm("/proc/self/statm");
+  size_t total_pages = 0;
+  size_t resident_pages = 0;
+  statm >> total_pages >> resident_pages;
+  return resident_pages * sysconf(_SC_PAGESIZE);
+#else
+  return 0;
+#endif
+}
+
+
+struct AllocatorBenchmarkResult {
+  double seconds = 0;
+  size_t operations_count = 0;
+  size_t failures_count = 0;
+  double failed_seconds = 0;
+  size_t failed_operations_count = 0;
+  LatencyHistogram latencies;
+  size_t peak_live_size = 0;
+  size_t peak_resident_growth = 0;
+};
+
+
+/*
+ * Выделение, после которого живых байт стало бы больше live_limit, а всего
+ * выделенных — больше total_limit, считается неудачным без обращения
+ * к resource: так у всех распределителей одинаковый бюджет памяти.
+ * seconds, operations_count и latencies — только об удачных операциях;
+ * выделения, в которых отказал сам resource, замеряются отдельно
+ * (failed_seconds, failed_operations_count), чтобы цена исключения
+ * не смешивалась с ценой работы. Выравнивание не запрашивается, как и при
+ * обычном прогоне трассы.
+ */
+AllocatorBenchmarkResult RunAllocatorWorkload(
+    std::pmr::memory_resource* resource,
+    const std::vector<MemoryManagerQuery>& queries,
+    size_t live_limit,
+    size_t total_limit) {
+  using Clock = std::chrono::steady_clock;
+  const size_t kAlignment = 1;
+  const size_t kPageSize = 4096;
+  const size_t kResidentSamplePeriod = 1024;
+
+  AllocatorBenchmarkResult result;
+  std::vector<std::pair<char*, size_t>> blocks(queries.size(),
+                                               {nullptr, 0});
+  size_t live_size = 0;
+  size_t total_size = 0;
+  const size_t initial_resident_size = ResidentSetSize();
+  auto sample_resident_size = [&]() {
+    const size_t resident_size = ResidentSetSize();
+    if (resident_size > initial_resident_size) {
+      result.peak_resident_growth = std::max(
+          result.peak_resident_growth, resident_size - initial_resident_size);
+    }
+  };
+  for (size_t query_n = 0; query_n < queries.size(); ++query_n) {
+    const auto& query = queries[query_n];
+    if (auto query_pointer = query.AsAllocationQuery()) {
+      const size_t size = query_pointer->allocation_size;
+      if (live_size + size > live_limit || total_size + size > total_limit) {
+        ++result.failures_count;
+        continue;
+      }
+      char* pointer = nullptr;
+      const auto start = Clock::now();
+      try {
+        pointer = static_cast<char*>(resource->allocate(size, kAlignment));
+      } catch (const std::bad_alloc&) {
+      }
+      const auto finish = Clock::now();
+      if (pointer == nullptr) {
+        result.failed_seconds +=
+            std::chrono::duration<double>(finish - start).count();
+        ++result.failed_operations_count;
+        ++result.failures_count;
+        continue;
+      }
+      result.seconds += std::chrono::duration<double>(finish - start).count();
+      result.latencies.Record(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              finish - start).count());
+      ++result.operations_count;
+      for (size_t byte_n = 0; byte_n < size; byte_n += kPageSize) {
+        pointer[byte_n] = 1;
+      }
+      blocks[query_n] = {pointer, size};
+      live_size += size;
+      total_size += size;
+      result.peak_live_size = std::max(result.peak_live_size, live_size);
+    } else if (auto query_pointer = query.AsFreeQuery()) {
+      auto& block = blocks[query_pointer->allocation_query_index];
+      if (block.first == nullptr) {
+        continue;
+      }
+      const auto start = Clock::now();
+      resource->deallocate(block.first, block.second, kAlignment);
+      const auto finish = Clock::now();
+      result.seconds += std::chrono::duration<double>(finish - start).count();
+      result.latencies.Record(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              finish - start).count());
+      ++result.operations_count;
+      live_size -= block.second;
+      block.first = nullptr;
+    }
+    if (query_n % kResidentSamplePeriod == 0) {
+      sample_resident_size();
+    }
+  }
+  sample_resident_size();
+  for (const auto& block : blocks) {
+    if (block.first != nullptr) {
+      resource->deallocate(block.first, block.second, kAlignment);
+    }
+  }
+  return result;
+}
+
+
+std::vector<MemoryManagerQuery> MakeSyntheticAllocatorWorkload() {
+  const size_t kOperationsCount = 1000000;
+  const size_t kTargetLiveBlocks = 20000;
+  uint64_t random_state = 88172645463325252ULL;
+  auto random = [&random_state]() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+  };
+  std::vector<MemoryManagerQuery> queries;
+  queries.reserve(kOperationsCount);
+  std::vector<int> live_blocks;
+  for (size_t query_n = 0; query_n < kOperationsCount; ++query_n) {
+    if (!live_blocks.empty() &&
+        random() % (2 * kTargetLiveBlocks) < live_blocks.size()) {
+      const size_t block_n = random() % live_blocks.size();
+      FreeQuery free_query = {live_blocks[block_n]};
+      live_blocks[block_n] = live_blocks.back();
+      live_blocks.pop_back();
+      queries.push_back(MemoryManagerQuery(free_query));
+    } else {
+      // Логарифмически равномерно от 8 байт до 8 КиБ.
+      const size_t size_class = 3 + random() % 10;
+      AllocationQuery allocation_query = {
+          (size_t(1) << size_class) + random() % (size_t(1) << size_class)};
+      live_blocks.push_back(query_n);
+      queries.push_back(MemoryManagerQuery(allocation_query));
+    }
+  }
+  return queries;
+}
+
+
+void BenchmarkAllocatorsOnWorkload(
+    const std::string& workload_name,
+    size_t memory_size,
+    const std::vector<MemoryManagerQuery>& queries,
+    std::ostream& ostream) {
+  // monotonic_buffer_resource ничего не освобождает, поэтому ему
+  // разрешено выделить всего не больше нескольких арен.
+  const size_t kMonotonicArenasCount = 4;
+  auto report = [&](const std::string& resource_name,
+                    std::pmr::memory_resource* resource,
+                    size_t total_limit) {
+#if defined(__GLIBC__)
+    malloc_trim(0);
+#endif
+    const AllocatorBenchmarkResult result =
+        RunAllocatorWorkload(resource, queries, memory_size, total_limit);
+    ostream << workload_name << ' ' << resource_name << ' '
+            << result.operations_count / result.seconds << ' '
+            << result.latencies.ValueAtPercentile(50) << ' '
+            << result.latencies.ValueAtPercentile(99) << ' '
+            << result.latencies.ValueAtPercentile(99.9) << ' '
+            << result.latencies.Max() << ' ' << result.failures_count << ' '
+            << result.failed_seconds * 1e9 /
+                   std::max<size_t>(result.failed_operations_count, 1)
+            << ' ' << result.peak_live_size << ' '
+            << result.peak_resident_growth << ' '
+            << static_cast<double>(result.peak_resident_growth) /
+                   std::max<size_t>(result.peak_live_size, 1)
+            << endl;
+  };
+  const size_t kNoLimit = static_cast<size_t>(-1);
+  {
+    MemoryManagerResource resource(memory_size);
+    report("memory-manager", &resource, kNoLimit);
+  }
+  {
+    MallocResource resource;
+    report("malloc", &resource, kNoLimit);
+  }
+  {
+    std::pmr::unsynchronized_pool_resource resource;
+    report("pmr-pool", &resource, kNoLimit);
+  }
+  {
+    std::pmr::monotonic_buffer_resource resource;
+    report("pmr-monotonic", &resource,
+           kMonotonicArenasCount * memory_size);
+  }
+}
+
+}  // namespace
+
+
+namespace {
+
+template <class Manager>
+void RunBoundedLatencyWorkload(const std::string& name,
+                               Manager* memory_manager,
+                               std::ostream& ostream) {
+  using Clock = std::chrono::steady_clock;
+  using Iterator = typename Manager::Iterator;
+  const size_t kRoundsCount = 8;
+  const size_t kAllocationsPerRound = 200000;
+  uint64_t random_state = 88172645463325252ULL;
+  LatencyHistogram latencies;
+  LatencyHistogram batch_latencies;
+  auto record = [](LatencyHistogram* histogram, Clock::time_point start) {
+    histogram->Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - start).count());
+  };
+  std::vector<Iterator> live_blocks;
+  size_t failures_count = 0;
+  for (size_t round_n = 0; round_n < kRoundsCount; ++round_n) {
+    for (size_t allocation_n = 0; allocation_n < kAllocationsPerRound;
+         ++allocation_n) {
+      const size_t size = 16 + NextRandom(&random_state) % 4096;
+      auto start = Clock::now();
+      const Iterator block = memory_manager->Allocate(size);
+      record(&latencies, start);
+      if (block == memory_manager->end()) {
+        ++failures_count;
+      } else {
+        live_blocks.push_back(block);
+      }
+      if (NextRandom(&random_state) % 4 == 0 && !live_blocks.empty()) {
+        const size_t block_n = NextRandom(&random_state) % live_blocks.size();
+        start = Clock::now();
+        memory_manager->Free(live_blocks[block_n]);
+        record(&latencies, start);
+        live_blocks[block_n] = live_blocks.back();
+        live_blocks.pop_back();
+      }
+    }
+    std::vector<Iterator> released;
+    if (round_n % 4 == 3) {
+      released.swap(live_blocks);
+    } else {
+      for (size_t block_n = 0; block_n < live_blocks.size();) {
+        if (NextRandom(&random_state) % 2 == 0) {
+          released.push_back(live_blocks[block_n]);
+          live_blocks[block_n] = live_blocks.back();
+          live_blocks.pop_back();
+        } else {
+          ++block_n;
+        }
+      }
+    }
+    const auto start = Clock::now();
+    FreeMemoryManagerBlocks(memory_manager, std::move(released));
+    record(&batch_latencies, start);
+  }
+  ostream << name << " calls: p50 " << latencies.ValueAtPercentile(50)
+          << " p99 " << latencies.ValueAtPercentile(99) << " p99.9 "
+          << latencies.ValueAtPercentile(99.9) << " p99.99 "
+          << latencies.ValueAtPercentile(99.99) << " max "
+          << latencies.Max() << " ns; batch frees: max "
+          << batch_latencies.Max() << " ns; failures " << failures_count
+          << endl;
+  OutputBoundedLatencyStatistics(*memory_manager, ostream);
+}
+
+}  // namespace
+
+
+void BenchmarkBoundedLatency(size_t work_budget, std::ostream& ostream) {
+  const size_t kMemorySize = size_t(1) << 31;
+  const size_t kReservedSegments = 1 << 20;
+  {
+    MemoryManager memory_manager(kMemorySize);
+    RunBoundedLatencyWorkload("plain", &memory_manager, ostream);
+  }
+  {
+    BoundedLatencyOptions options;
+    options.work_budget = work_budget;
+    BoundedLatencyMemoryManager<MemoryManager> memory_manager(
+        kMemorySize, 2, options);
+    RunBoundedLatencyWorkload("bounded", &memory_manager, ostream);
+  }
+  {
+    BoundedLatencyOptions options;
+    options.work_budget = work_budget;
+    options.reserved_segments = kReservedSegments;
+    BoundedLatencyMemoryManager<MemoryManager> memory_manager(
+        kMemorySize, 2, options);
+    RunBoundedLatencyWorkload("bounded+reserve", &memory_manager, ostream);
+  }
+}
+
+
+namespace {
+
+/*
+ * count операций случайной нагрузки: выделение от 16 байт до 64 КиБ
+ * или, с вероятностью 1/2 при живых блоках, освобождение случайного
+ * живого. Возвращает смещения выделенных блоков (-1 при неудаче).
+ */
+template <class Manager>
+std::vector<int> RunPersistentWorkload(Manager* memory_manager, size_t count,
+                                       uint64_t random_state) {
+  std::vector<typename Manager::Iterator> live_blocks;
+  std::vector<int> offsets;
+  for (size_t operation_n = 0; operation_n < count; ++operation_n) {
+    if (!live_blocks.empty() && NextRandom(&random_state) % 2 == 0) {
+      const size_t block_n = NextRandom(&random_state) % live_blocks.size();
+      memory_manager->Free(live_blocks[block_n]);
+      live_blocks[block_n] = live_blocks.back();
+      live_blocks.pop_back();
+      continue;
+    }
+    const auto block = memory_manager->Allocate(
+        16 + NextRandom(&random_state) % (64 << 10));
+    if (block == memory_manager->end()) {
+      offsets.push_back(-1);
+      continue;
+    }
+    offsets.push_back(memory_manager->Offset(block));
+    live_blocks.push_back(block);
+  }
+  return offsets;
+}
+
+}  // namespace
+
+
+void BenchmarkPersistentMemoryManager(const std::string& path,
+                                      std::ostream& ostream) {
+  using Clock = std::chrono::steady_clock;
+  const size_t kMemorySize = 1 << 30;
+  const size_t kMaxSegments = 1 << 18;
+  const size_t kOperationsCount = 1000000;
+  const size_t kSynchronousOperationsCount = 20000;
+  const size_t kKillsCount = 20;
+  const uint64_t kSeed = 88172645463325252ULL;
+  auto report = [&](const std::string& name, size_t count,
+                    Clock::time_point start) {
+    const double seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    ostream << name << " operations " << count << " ops/s "
+            << static_cast<uint64_t>(count / seconds) << endl;
+  };
+
+  std::vector<int> expected;
+  {
+    MemoryManager memory_manager(kMemorySize);
+    const auto start = Clock::now();
+    expected = RunPersistentWorkload(&memory_manager, kOperationsCount, kSeed);
+    report("in-memory", kOperationsCount, start);
+  }
+  for (bool synchronous : {false, true}) {
+    const size_t count =
+        synchronous ? kSynchronousOperationsCount : kOperationsCount;
+    std::remove(path.c_str());
+    std::vector<int> offsets;
+    size_t free_memory_size = 0;
+    {
+      PersistentMemoryManager memory_manager(path, kMemorySize, kMaxSegments,
+                                             synchronous);
+      const auto start = Clock::now();
+      offsets = RunPersistentWorkload(&memory_manager, count, kSeed);
+      report(synchronous ? "persistent+msync" : "persistent", count, start);
+      free_memory_size = memory_manager.FreeMemorySize();
+    }
+    PersistentMemoryManager reopened(path, kMemorySize, kMaxSegments);
+    ostream << "  answers "
+            << (std::equal(offsets.begin(), offsets.end(), expected.begin()) ?
+                "match" : "differ")
+            << ", reopened "
+            << (reopened.Verify() &&
+                reopened.FreeMemorySize() == free_memory_size ?
+                "consistent" : "INCONSISTENT")
+            << endl;
+  }
+
+#if defined(__unix__)
+  uint64_t random_state = kSeed;
+  size_t recovered_count = 0;
+  size_t inconsistent_count = 0;
+  std::remove(path.c_str());
+  for (size_t kill_n = 0; kill_n < kKillsCount; ++kill_n) {
+    const pid_t child = fork();
+    if (child < 0) {
+      throw std::runtime_error("fork failed");
+    }
+    if (child == 0) {
+      PersistentMemoryManager memory_manager(path, kMemorySize, kMaxSegments,
+                                             false);
+      RunPersistentWorkload(&memory_manager, static_cast<size_t>(-1),
+                            kSeed + kill_n);
+      _exit(0);
+    }
+    usleep(5000 + NextRandom(&random_state) % 50000);
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+    PersistentMemoryManager memory_manager(path, kMemorySize, kMaxSegments,
+                                           false);
+    recovered_count += memory_manager.Recovered();
+    inconsistent_count += !memory_manager.Verify();
+  }
+  std::remove(path.c_str());
+  ostream << "crash recovery: " << kKillsCount << " kills, "
+          << recovered_count << " journals replayed, " << inconsistent_count
+          << " inconsistent" << endl;
+#endif
+}
+
+
+void BenchmarkAllocators(
+    size_t memory_size,
+    const std::vector<MemoryManagerQuery>& queries,
+    std::ostream& ostream) {
+  const size_t kMaxMemorySize = 256 << 20;
+  ostream << "workload resource ops/s p50_ns p99_ns p99.9_ns max_ns "
+          << "failures failure_ns peak_live peak_rss_growth rss/live"
+          << endl;
+  BenchmarkAllocatorsOnWorkload("synthetic", kMaxMemorySize,
+                                MakeSyntheticAllocatorWorkload(), ostream);
+  if (queries.empty()) {
+    return;
+  }
+  if (memory_size <= kMaxMemorySize) {
+    BenchmarkAllocatorsOnWorkload("trace", memory_size, queries, ostream);
+    return;
+  }
+  // Все четыре распределителя держат живые данные трассы одновременно
+  // в памяти процесса, поэтому слишком большие трассы пропорционально
+  // уменьшаются.
+  const size_t scale = (memory_size + kMaxMemorySize - 1) / kMaxMemorySize;
+  std::vector<MemoryManagerQuery> scaled_queries;
+  scaled_queries.reserve(queries.size());
+  for (const auto& query : queries) {
+    if (auto query_pointer = query.AsAllocationQuery()) {
+      AllocationQuery allocation_query = {
+          query_pointer->allocation_size / scale};
+      scaled_queries.push_back(MemoryManagerQuery(allocation_query));
+    } else if (auto query_pointer = query.AsFreeQuery()) {
+      scaled_queries.push_back(MemoryManagerQuery(*query_pointer));
+    } else {
+      scaled_queries.push_back(MemoryManagerQuery(StatisticsQuery()));
+    }
+  }
+  ostream << "trace sizes scaled down " << scale << "x" << endl;
+  BenchmarkAllocatorsOnWorkload("trace", memory_size / scale, scaled_queries,
+                                ostream);
+}
+
+
+void OutputLatencyHistogram(const LatencyHistogram& histogram,
+                            std::ostream& ostream) {
+  static const double kPercentiles[] = {50.0, 90.0, 99.0, 99.9, 99.99};
+  ostream << "  count " << histogram.Count() << endl;
+  for (double percentile : kPercentiles) {
+    ostream << "  p" << percentile << " "
+            << histogram.ValueAtPercentile(percentile) << " ns" << endl;
+  }
+  ostream << "  max " << histogram.Max() << " ns" << endl;
+}
+
+
+/** MemoryManagerEngines: BEGIN **/
+template <class... Engines>
+template <class Function>
+void MemoryManagerEngineList<Engines...>::ForEach(Function function) {
+  (function(Engines()), ...);
+}
+
+
+/** MemoryManagerEngines: END **/
+
+
+/** EngineConfiguration: BEGIN **/
+namespace {
+
+PriorityWatermarks ParsePriorityWatermarks(const std::string& value) {
+  PriorityWatermarks watermarks;
+  std::istringstream stream(value);
+  std::string watermark;
+  while (std::getline(stream, watermark, ',')) {
+    const auto separator = watermark.find(':');
+    if (separator == std::string::npos) {
+      throw std::invalid_argument(
+          "watermarks expects FREE:LARGEST pairs separated by commas");
+    }
+    PriorityWatermark priority_watermark;
+    priority_watermark.free_size = std::stoul(watermark.substr(0, separator));
+    priority_watermark.largest_free_size =
+        std::stoul(watermark.substr(separator + 1));
+    watermarks.push_back(priority_watermark);
+  }
+  return watermarks;
+}
+
+}  // namespace
+
+
+void SetEngineConfigurationValue(const std::string& key,
+                                 const std::string& value,
+                                 EngineConfiguration* configuration) {
+  if (key == "engine") {
+    if (value != "list" && value != "compact") {
+      throw std::invalid_argument("engine expects list or compact");
+    }
+    configuration->engine = value;
+  } else if (key == "free_index") {
+    if (value != "heap" && value != "bucketed" && value != "handles") {
+      throw std::invalid_argument(
+          "free_index expects heap, bucketed or handles");
+    }
+    configuration->free_index = value;
+  } else if (key == "heap_arity") {
+    const size_t heap_arity = std::stoul(value);
+    if (heap_arity < 2 || (heap_arity & (heap_arity - 1)) != 0) {
+      throw std::invalid_argument("heap_arity must be a power of two");
+    }
+    configuration->heap_arity = heap_arity;
+  } else if (key == "page_size") {
+    configuration->allocation_options.page_size = std::stoul(value);
+  } else if (key == "precarve") {
+    if (value != "0" && value != "1") {
+      throw std::invalid_argument("precarve expects 0 or 1");
+    }
+    configuration->precarving = value == "1";
+  } else if (key == "work_budget") {
+    configuration->bounded_latency.work_budget = std::stoul(value);
+  } else if (key == "reserve_segments") {
+    configuration->bounded_latency.reserved_segments = std::stoul(value);
+  } else if (key == "watermarks") {
+    configuration->priority_watermarks = ParsePriorityWatermarks(value);
+  } else {
+    throw std::invalid_argument("Unknown configuration key: " + key);
+  }
+}
+
+
+void LoadEngineConfiguration(const std::string& path,
+                             EngineConfiguration* configuration) {
+  std::ifstream stream(path);
+  if (!stream) {
+    throw std::runtime_error("Cannot open " + path);
+  }
+  std::string line;
+  while (std::getline(stream, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    const auto separator = line.find('=');
+    if (separator == std::string::npos) {
+      throw std::invalid_argument("Malformed configuration line: " + line);
+    }
+    SetEngineConfigurationValue(line.substr(0, separator),
+                                line.substr(separator + 1), configuration);
+  }
+}
+
+
+void SaveEngineConfiguration(const EngineConfiguration& configuration,
+                             const std::string& path) {
+  std::ofstream stream(path);
+  if (!stream) {
+    throw std::runtime_error("Cannot open " + path);
+  }
+  stream << "# memory manager engine configuration" << endl
+         << "engine=" << configuration.engine << endl
+         << "free_index=" << configuration.free_index << endl
+         << "heap_arity=" << configuration.heap_arity << endl
+         << "page_size=" << configuration.allocation_options.page_size
+         << endl
+         << "precarve=" << configuration.precarving << endl
+         << "work_budget=" << configuration.bounded_latency.work_budget
+         << endl
+         << "reserve_segments="
+         << configuration.bounded_latency.reserved_segments << endl
+         << "watermarks=";
+  const PriorityWatermarks& watermarks = configuration.priority_watermarks;
+  for (size_t class_n = 0; class_n < watermarks.size(); ++class_n) {
+    stream << (class_n ? "," : "") << watermarks[class_n].free_size << ":"
+           << watermarks[class_n].largest_free_size;
+  }
+  stream << endl;
+}
+
+
+namespace {
+
+template <class Manager, class Function>
+void WithMemoryManager(const EngineConfiguration& configuration,
+                       size_t memory_size,
+                       Function function) {
+  if (configuration.precarving &&
+      configuration.bounded_latency.work_budget != 0) {
+    throw std::invalid_argument(
+        "precarve and work_budget cannot be combined");
+  }
+  if (configuration.precarving) {
+    PrecarvingMemoryManager<Manager> memory_manager(memory_size,
+                                                    configuration.heap_arity);
+    memory_manager.SetPriorityWatermarks(configuration.priority_watermarks);
+    function(&memory_manager);
+  } else if (configuration.bounded_latency.work_budget != 0) {
+    BoundedLatencyMemoryManager<Manager> memory_manager(
+        memory_size, configuration.heap_arity,
+        configuration.bounded_latency);
+    memory_manager.SetPriorityWatermarks(configuration.priority_watermarks);
+    function(&memory_manager);
+  } else {
+    Manager memory_manager(memory_size, configuration.heap_arity);
+    memory_manager.SetPriorityWatermarks(configuration.priority_watermarks);
+    function(&memory_manager);
+  }
+}
+
+/*
+ * Есть ли в queries выделение или изменение размера до нуля.
+ */
+bool HasZeroSizeAllocations(const std::vector<MemoryManagerQuery>& queries) {
+  for (const auto& query : queries) {
+    size_t allocation_size = 1;
+    if (const auto* allocation = query.AsAllocationQuery()) {
+      allocation_size = allocation->allocation_size;
+    } else if (const auto* reallocation = query.As<ReallocationQuery>()) {
+      allocation_size = reallocation->allocation_size;
+    } else if (const auto* aligned = query.As<AlignedAllocationQuery>()) {
+      allocation_size = aligned->allocation_size;
+    } else if (const auto* placed = query.As<PlacedAllocationQuery>()) {
+      allocation_size = placed->allocation_size;
+    } else if (const auto* prioritized =
+                   query.As<PrioritizedAllocationQuery>()) {
+      allocation_size = prioritized->allocation_size;
+    } else if (const auto* batch = query.As<BatchAllocationQuery>()) {
+      allocation_size = *std::min_element(batch->allocation_sizes.begin(),
+                                          batch->allocation_sizes.end());
+    } else if (const auto* gang = query.As<GangAllocationQuery>()) {
+      allocation_size = *std::min_element(gang->allocation_sizes.begin(),
+                                          gang->allocation_sizes.end());
+    }
+    if (allocation_size == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+
+template <class Function>
+void WithConfiguredMemoryManager(const EngineConfiguration& configuration,
+                                 size_t memory_size,
+                                 Function function) {
+  bool found = false;
+  MemoryManagerEngines::ForEach([&](auto engine) {
+    using Engine = decltype(engine);
+    if (!found && configuration.engine == Engine::kEngine &&
+        (Engine::kFreeIndex == nullptr ||
+         configuration.free_index == Engine::kFreeIndex)) {
+      found = true;
+      WithMemoryManager<typename Engine::Manager>(configuration, memory_size,
+                                                  function);
+    }
+  });
+  if (!found) {
+    throw std::invalid_argument("No engine " + configuration.engine + "/" +
+                                configuration.free_index);
+  }
+}
+
+
+bool RunMemoryManagerDifferential(
+    size_t memory_size,
+    const std::vector<MemoryManagerQuery>& queries,
+    const EngineConfiguration& configuration,
+    std::ostream& ostream) {
+  const AllocationOptions& allocation_options =
+      configuration.allocation_options;
+  std::vector<MemoryManagerAllocationResponse> reference_responses;
+  bool has_reference = false;
+  bool all_match = true;
+  const bool zero_sizes = HasZeroSizeAllocations(queries);
+  // Печатает "ok" или первое расхождение с эталоном; true, если его нет.
+  auto compare = [&](const std::vector<MemoryManagerAllocationResponse>&
+                         responses) {
+    size_t response_n = 0;
+    while (response_n < std::min(responses.size(),
+                                 reference_responses.size()) &&
+           MemoryManagerResponseValue(responses[response_n]) ==
+               MemoryManagerResponseValue(reference_responses[response_n])) {
+      ++response_n;
+    }
+    if (response_n == responses.size() &&
+        response_n == reference_responses.size()) {
+      ostream << " ok" << endl;
+      return true;
+    }
+    ostream << " differs at response " << response_n + 1;
+    if (response_n < responses.size() &&
+        response_n < reference_responses.size()) {
+      ostream << ": expected "
+              << MemoryManagerResponseValue(reference_responses[response_n])
+              << ", got " << MemoryManagerResponseValue(responses[response_n]);
+    } else {
+      ostream << ": " << responses.size() << " responses instead of "
+              << reference_responses.size();
+    }
+    ostream << endl;
+    return false;
+  };
+  MemoryManagerEngines::ForEach([&](auto engine) {
+    using Engine = decltype(engine);
+    if (!Engine::kEquivalent &&
+        (zero_sizes || !Engine::kEquivalentWithoutZeroSizes)) {
+      ostream << Engine::kName << " skipped, answers may differ";
+      if (Engine::kEquivalentWithoutZeroSizes) {
+        ostream << " on zero-size allocations";
+      }
+      ostream << endl;
+      return;
+    }
+    typename Engine::Manager memory_manager(memory_size,
+                                            configuration.heap_arity);
+    memory_manager.SetPriorityWatermarks(configuration.priority_watermarks);
+    const auto responses =
+        RunMemoryManager(&memory_manager, queries, allocation_options);
+    if (!has_reference) {
+      has_reference = true;
+      reference_responses = responses;
+      ostream << Engine::kName << " reference, " << responses.size()
+              << " responses" << endl;
+      return;
+    }
+    ostream << Engine::kName;
+    if (!compare(responses)) {
+      all_match = false;
+    }
+  });
+  if (configuration.precarving ||
+      configuration.bounded_latency.work_budget != 0) {
+    std::vector<MemoryManagerAllocationResponse> responses;
+    WithConfiguredMemoryManager(
+        configuration, memory_size, [&](auto* memory_manager) {
+      responses =
+          RunMemoryManager(memory_manager, queries, allocation_options);
+    });
+    ostream << configuration.engine << '/' << configuration.free_index;
+    if (configuration.precarving) {
+      ostream << " with precarve";
+    } else {
+      ostream << " with work_budget="
+              << configuration.bounded_latency.work_budget;
+    }
+    ostream << " (not equivalent, not counted)";
+    compare(responses);
+  }
+  return all_match;
+}
+
+
+size_t AutotunePrefixSize(const std::vector<MemoryManagerQuery>& queries,
+                          size_t prefix_size) {
+  prefix_size = std::min(prefix_size, queries.size());
+  while (prefix_size < queries.size() &&
+         queries[prefix_size].As<BatchContinuationQuery>()) {
+    ++prefix_size;
+  }
+  return prefix_size;
+}
+
+
+EngineConfiguration AutotuneEngineConfiguration(
+    size_t memory_size,
+    const std::vector<MemoryManagerQuery>& queries,
+    size_t prefix_size,
+    const EngineConfiguration& base_configuration,
+    std::ostream& report) {
+  const int kRepetitions = 3;
+  const size_t kHeapArities[] = {2, 4, 8};
+  prefix_size = AutotunePrefixSize(queries, prefix_size);
+
+  EngineConfiguration best_configuration = base_configuration;
+  double best_throughput = 0;
+  double best_failure_rate = 2;
+  report << "engine free_index heap_arity queries/s failure_rate" << endl;
+  MemoryManagerEngines::ForEach([&](auto engine) {
+    using Engine = decltype(engine);
+    if (!Engine::kEquivalent) {
+      return;
+    }
+    for (size_t heap_arity : kHeapArities) {
+      EngineConfiguration configuration = base_configuration;
+      configuration.engine = Engine::kEngine;
+      if (Engine::kFreeIndex != nullptr) {
+        configuration.free_index = Engine::kFreeIndex;
+      }
+      configuration.heap_arity = heap_arity;
+      double best_seconds = 0;
+      double failure_rate = 0;
+      for (int repetition = 0; repetition < kRepetitions; ++repetition) {
+        WithMemoryManager<typename Engine::Manager>(
+            configuration, memory_size, [&](auto* memory_manager) {
+          using Manager = std::remove_pointer_t<decltype(memory_manager)>;
+          std::vector<typename Manager::Iterator> results(
+              prefix_size, memory_manager->end());
+          std::vector<MemoryManagerAllocationResponse> responses;
+          const auto start = std::chrono::steady_clock::now();
+          for (size_t query_n = 0; query_n < prefix_size; ++query_n) {
+            ExecuteMemoryManagerQuery(queries[query_n], query_n,
+                                      configuration.allocation_options,
+                                      memory_manager, &results, &responses);
+          }
+          const std::chrono::duration<double> elapsed =
+              std::chrono::steady_clock::now() - start;
+          if (repetition == 0 || elapsed.count() < best_seconds) {
+            best_seconds = elapsed.count();
+          }
+          const auto failures_count = std::count_if(
+              responses.begin(), responses.end(),
+              [](const MemoryManagerAllocationResponse& response) {
+                return !response.success;
+              });
+          failure_rate = responses.empty() ?
+              0.0 :
+              static_cast<double>(failures_count) / responses.size();
+        });
+      }
+      const double throughput = prefix_size / best_seconds;
+      report << configuration.engine << ' ' << configuration.free_index << ' '
+             << heap_arity << ' ' << throughput << ' ' << failure_rate
+             << endl;
+      if (failure_rate < best_failure_rate ||
+          (failure_rate == best_failure_rate &&
+           throughput > best_throughput)) {
+        best_configuration = configuration;
+        best_throughput = throughput;
+        best_failure_rate = failure_rate;
+      }
+    }
+  });
+  report << "chosen: engine=" << best_configuration.engine
+         << " free_index=" << best_configuration.free_index
+         << " heap_arity=" << best_configuration.heap_arity << endl;
+  return best_configuration;
+}
+
+
+/** EngineConfiguration: END **/
+
+
+/** Replay cache: BEGIN **/
+namespace {
+
+const uint64_t kReplayCheckpointMagic = 0x32504b434c504552ULL;
+const uint64_t kReplayHashBase = 0x100000001b3ULL;
+
+uint64_t MixReplayHash(uint64_t hash, uint64_t value) {
+  hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+  return hash * 0xbf58476d1ce4e5b9ULL;
+}
+
+
+/*
+ * Контрольная точка: ответы и текст отчёта с предыдущей точки, раскладка
+ * менеджера и живые блоки — номер запроса и номер сегмента в layout.
+ */
+struct MemoryManagerReplayCheckpoint {
+  std::vector<MemoryManagerAllocationResponse> responses;
+  std::string report;
+  MemoryManagerSnapshot layout;
+  std::vector<std::pair<uint64_t, uint64_t>> live_blocks;
+};
+
+
+std::string ReplayCheckpointPath(const std::string& directory,
+                                 uint64_t prefix_hash) {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.checkpoint",
+                static_cast<unsigned long long>(prefix_hash));
+  return directory + "/" + name;
+}
+
+
+template <class T>
+void WriteReplayValue(std::string* buffer, const T& value) {
+  buffer->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+
+template <class T>
+bool ReadReplayValue(std::istream& stream, T* value) {
+  return static_cast<bool>(
+      stream.read(reinterpret_cast<char*>(value), sizeof(*value)));
+}
+
+
+/*
+ * Файл пишется рядом под временным именем и переименовывается, так что
+ * читатель видит либо целую точку, либо никакой.
+ */
+void SaveReplayCheckpoint(const std::string& directory, uint64_t prefix_hash,
+                          const MemoryManagerReplayCheckpoint& checkpoint) {
+#if defined(__unix__)
+  if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw std::runtime_error("Cannot create " + directory);
+  }
+#endif
+  const std::string path = ReplayCheckpointPath(directory, prefix_hash);
+  const std::string temporary_path = path + ".tmp";
+  std::string buffer;
+  buffer.reserve(
+      sizeof(uint64_t) * 6 +
+      checkpoint.responses.size() * (sizeof(uint8_t) + sizeof(uint64_t)) +
+      checkpoint.report.size() +
+      checkpoint.layout.size() * (sizeof(int32_t) * 2 + sizeof(uint8_t)) +
+      checkpoint.live_blocks.size() * sizeof(uint64_t) * 2);
+  WriteReplayValue(&buffer, kReplayCheckpointMagic);
+  WriteReplayValue(&buffer, prefix_hash);
+  WriteReplayValue(&buffer, static_cast<uint64_t>(checkpoint.responses.size()));
+  for (const auto& response : checkpoint.responses) {
+    WriteReplayValue(&buffer, static_cast<uint8_t>(response.success));
+    WriteReplayValue(&buffer, static_cast<uint64_t>(response.position));
+  }
+  WriteReplayValue(&buffer, static_cast<uint64_t>(checkpoint.report.size()));
+  buffer.append(checkpoint.report);
+  WriteReplayValue(&buffer, static_cast<uint64_t>(checkpoint.layout.size()));
+  for (const auto& segment : checkpoint.layout) {
+    WriteReplayValue(&buffer, static_cast<int32_t>(segment.left));
+    WriteReplayValue(&buffer, static_cast<int32_t>(segment.right));
+    WriteReplayValue(&buffer, static_cast<uint8_t>(segment.free));
+  }
+  WriteReplayValue(&buffer,
+                   static_cast<uint64_t>(checkpoint.live_blocks.size()));
+  for (const auto& live_block : checkpoint.live_blocks) {
+    WriteReplayValue(&buffer, live_block.first);
+    WriteReplayValue(&buffer, live_block.second);
+  }
+  {
+    std::ofstream stream(temporary_path, std::ios::binary);
+    if (!stream.write(buffer.data(), buffer.size()).flush()) {
+      throw std::runtime_error("Cannot write " + temporary_path);
+    }
+  }
+  if (std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+    throw std::runtime_error("Cannot rename " + temporary_path);
+  }
+}
+
+
+/*
+ * Читает точку prefix_hash; без with_state — только ответы и отчёт.
+ * false, если точки нет или файл не целый.
+ */
+bool LoadReplayCheckpoint(const std::string& directory, uint64_t prefix_hash,
+                          bool with_state,
+                          MemoryManagerReplayCheckpoint* checkpoint) {
+  std::ifstream stream(ReplayCheckpointPath(directory, prefix_hash),
+                       std::ios::binary);
+  uint64_t magic = 0;
+  uint64_t stored_prefix_hash = 0;
+  uint64_t count = 0;
+  if (!ReadReplayValue(stream, &magic) || magic != kReplayCheckpointMagic ||
+      !ReadReplayValue(stream, &stored_prefix_hash) ||
+      stored_prefix_hash != prefix_hash || !ReadReplayValue(stream, &count)) {
+    return false;
+  }
+  checkpoint->responses.clear();
+  for (uint64_t response_n = 0; response_n < count; ++response_n) {
+    uint8_t success = 0;
+    uint64_t position = 0;
+    if (!ReadReplayValue(stream, &success) ||
+        !ReadReplayValue(stream, &position)) {
+      return false;
+    }
+    checkpoint->responses.push_back(
+        success ? MakeSuccessfulAllocation(position) : MakeFailedAllocation());
+  }
+  if (!ReadReplayValue(stream, &count)) {
+    return false;
+  }
+  // Кусками, чтобы испорченная длина не заняла лишней памяти.
+  checkpoint->report.clear();
+  while (checkpoint->report.size() < count) {
+    char chunk[4096];
+    const size_t chunk_size = std::min<uint64_t>(
+        sizeof(chunk), count - checkpoint->report.size());
+    if (!stream.read(chunk, chunk_size)) {
+      return false;
+    }
+    checkpoint->report.append(chunk, chunk_size);
+  }
+  if (!with_state) {
+    return true;
+  }
+  checkpoint->layout.clear();
+  if (!ReadReplayValue(stream, &count)) {
+    return false;
+  }
+  for (uint64_t segment_n = 0; segment_n < count; ++segment_n) {
+    int32_t left = 0;
+    int32_t right = 0;
+    uint8_t free = 0;
+    if (!ReadReplayValue(stream, &left) || !ReadReplayValue(stream, &right) ||
+        !ReadReplayValue(stream, &free)) {
+      return false;
+    }
+    checkpoint->layout.push_back(
+        MemoryManagerSnapshotSegment{left, right, free != 0});
+  }
+  checkpoint->live_blocks.clear();
+  if (!ReadReplayValue(stream, &count)) {
+    return false;
+  }
+  for (uint64_t block_n = 0; block_n < count; ++block_n) {
+    std::pair<uint64_t, uint64_t> live_block;
+    if (!ReadReplayValue(stream, &live_block.first) ||
+        !ReadReplayValue(stream, &live_block.second) ||
+        live_block.second >= checkpoint->layout.size()) {
+      return false;
+    }
+    checkpoint->live_blocks.push_back(live_block);
+  }
+  return true;
+}
+
+
+template <class Manager>
+bool SupportsReplayCheckpoints(const Manager*) {
+  return false;
+}
+
+
+template <class FreeSegmentIndex>
+bool SupportsReplayCheckpoints(const BasicMemoryManager<FreeSegmentIndex>*) {
+  return true;
+}
+
+
+template <class Manager>
+void CaptureReplayCheckpoint(
+    Manager*, const LiveAllocationTable<typename Manager::Iterator>&,
+    MemoryManagerReplayCheckpoint*) {
+  throw std::invalid_argument("The replay cache needs a list engine");
+}
+
+
+template <class FreeSegmentIndex>
+void CaptureReplayCheckpoint(
+    BasicMemoryManager<FreeSegmentIndex>* memory_manager,
+    const LiveAllocationTable<MemorySegmentIterator>& live_blocks,
+    MemoryManagerReplayCheckpoint* checkpoint) {
+  checkpoint->layout = memory_manager->Snapshot();
+  std::unordered_map<const MemorySegment*, uint64_t> ordinals;
+  ordinals.reserve(checkpoint->layout.size());
+  uint64_t ordinal = 0;
+  for (auto segment = memory_manager->begin();
+       segment != memory_manager->end(); ++segment) {
+    ordinals.emplace(&*segment, ordinal++);
+  }
+  live_blocks.ForEach([&](size_t query_index, MemorySegmentIterator block) {
+    checkpoint->live_blocks.emplace_back(query_index, ordinals.at(&*block));
+  });
+}
+
+
+template <class Manager>
+void RestoreReplayCheckpoint(
+    Manager*, const MemoryManagerReplayCheckpoint&,
+    LiveAllocationTable<typename Manager::Iterator>*) {
+  throw std::invalid_argument("The replay cache needs a list engine");
+}
+
+
+template <class FreeSegmentIndex>
+void RestoreReplayCheckpoint(
+    BasicMemoryManager<FreeSegmentIndex>* memory_manager,
+    const MemoryManagerReplayCheckpoint& checkpoint,
+    LiveAllocationTable<MemorySegmentIterator>* live_blocks) {
+  const auto segments = memory_manager->Restore(checkpoint.layout);
+  for (const auto& live_block : checkpoint.live_blocks) {
+    live_blocks->Insert(live_block.first, segments[live_block.second]);
+  }
+}
+
+}  // namespace
+
+
+uint64_t MemoryManagerReplaySeed(size_t memory_size,
+                                 const EngineConfiguration& configuration) {
+  const AllocationOptions& allocation_options =
+      configuration.allocation_options;
+  uint64_t seed = MixReplayHash(0, memory_size);
+  seed = MixReplayHash(seed, allocation_options.page_size);
+  seed = MixReplayHash(seed, allocation_options.alignment);
+  seed = MixReplayHash(seed, allocation_options.priority);
+  for (const auto& watermark : configuration.priority_watermarks) {
+    seed = MixReplayHash(seed, watermark.free_size);
+    seed = MixReplayHash(seed, watermark.largest_free_size);
+  }
+  return seed;
+}
+
+
+uint64_t MemoryManagerQueryHash(const MemoryManagerQuery& query) {
+  if (auto query_pointer = query.AsAllocationQuery()) {
+    return MixReplayHash(1, query_pointer->allocation_size);
+  } else if (auto query_pointer = query.AsFreeQuery()) {
+    return MixReplayHash(2, query_pointer->allocation_query_index);
+  } else if (auto query_pointer = query.As<ReallocationQuery>()) {
+    return MixReplayHash(MixReplayHash(3, query_pointer->allocation_size),
+                         query_pointer->allocation_query_index);
+  } else if (auto query_pointer = query.As<AlignedAllocationQuery>()) {
+    return MixReplayHash(MixReplayHash(4, query_pointer->allocation_size),
+                         query_pointer->alignment);
+  } else if (auto query_pointer = query.As<PlacedAllocationQuery>()) {
+    return MixReplayHash(MixReplayHash(5, query_pointer->allocation_size),
+                         query_pointer->offset);
+  } else if (auto query_pointer = query.As<PrioritizedAllocationQuery>()) {
+    return MixReplayHash(MixReplayHash(6, query_pointer->allocation_size),
+                         query_pointer->priority);
+  } else if (auto query_pointer = query.As<BatchAllocationQuery>()) {
+    uint64_t hash = MixReplayHash(7, query_pointer->allocation_sizes.size());
+    for (auto allocation_size : query_pointer->allocation_sizes) {
+      hash = MixReplayHash(hash, allocation_size);
+    }
+    return hash;
+  } else if (query.As<BatchContinuationQuery>()) {
+    return MixReplayHash(8, 0);
+  } else if (auto query_pointer = query.As<BatchFreeQuery>()) {
+    return MixReplayHash(MixReplayHash(9, query_pointer->count),
+                         query_pointer->allocation_query_index);
+  } else if (query.As<StatisticsQuery>()) {
+    return MixReplayHash(10, 0);
+  } else if (query.As<ResetQuery>()) {
+    return MixReplayHash(11, 0);
+  } else if (auto query_pointer = query.As<GangAllocationQuery>()) {
+    uint64_t hash = MixReplayHash(12, query_pointer->alignment);
+    hash = MixReplayHash(hash, query_pointer->allocation_sizes.size());
+    for (auto allocation_size : query_pointer->allocation_sizes) {
+      hash = MixReplayHash(hash, allocation_size);
+    }
+    return hash;
+  }
+  throw std::logic_error("Unknown Memory Manager query!");
+}
+
+
+template <class Manager>
+std::vector<MemoryManagerAllocationResponse> RunMemoryManagerWithReplayCache(
+    Manager* memory_manager,
+    const std::vector<MemoryManagerQuery>& queries,
+    const AllocationOptions& allocation_options,
+    const MemoryManagerReplayCacheOptions& options,
+    std::ostream& report) {
+  if (!SupportsReplayCheckpoints(memory_manager)) {
+    throw std::invalid_argument("The replay cache needs a list engine");
+  }
+  const size_t interval = std::max<size_t>(options.checkpoint_interval, 1);
+  // prefix_hashes[k] — хеш первых (k + 1) * interval запросов.
+  std::vector<uint64_t> prefix_hashes;
+  uint64_t prefix_hash = options.seed;
+  for (size_t query_n = 0; query_n < queries.size(); ++query_n) {
+    prefix_hash = prefix_hash * kReplayHashBase +
+                  MemoryManagerQueryHash(queries[query_n]);
+    if ((query_n + 1) % interval == 0) {
+      prefix_hashes.push_back(prefix_hash);
+    }
+  }
+
+  LiveAllocationTable<typename Manager::Iterator> live_blocks;
+  std::vector<MemoryManagerAllocationResponse> responses;
+  MemoryManagerReplayCheckpoint checkpoint;
+  size_t restored_count = 0;
+  while (restored_count < prefix_hashes.size() &&
+         LoadReplayCheckpoint(options.directory,
+                              prefix_hashes[restored_count], false,
+                              &checkpoint)) {
+    responses.insert(responses.end(), checkpoint.responses.begin(),
+                     checkpoint.responses.end());
+    report << checkpoint.report;
+    ++restored_count;
+  }
+  if (restored_count != 0) {
+    if (!LoadReplayCheckpoint(options.directory,
+                              prefix_hashes[restored_count - 1], true,
+                              &checkpoint)) {
+      throw std::runtime_error("Replay checkpoint is unreadable");
+    }
+    RestoreReplayCheckpoint(memory_manager, checkpoint, &live_blocks);
+  }
+
+  size_t saved_count = 0;
+  size_t checkpoint_responses_begin = responses.size();
+  // Отчёт текущего интервала: печатается и сохраняется в его точку.
+  std::ostringstream interval_report;
+  for (size_t query_n = restored_count * interval;; ++query_n) {
+    if (query_n % interval == 0 && query_n / interval > restored_count) {
+      MemoryManagerReplayCheckpoint new_checkpoint;
+      new_checkpoint.responses.assign(
+          responses.begin() + checkpoint_responses_begin, responses.end());
+      new_checkpoint.report = interval_report.str();
+      report << new_checkpoint.report;
+      interval_report.str(std::string());
+      CaptureReplayCheckpoint(memory_manager, live_blocks, &new_checkpoint);
+      SaveReplayCheckpoint(options.directory,
+                           prefix_hashes[query_n / interval - 1],
+                           new_checkpoint);
+      checkpoint_responses_begin = responses.size();
+      ++saved_count;
+    }
+    if (query_n == queries.size()) {
+      break;
+    }
+    ExecuteMemoryManagerQuery(queries[query_n], query_n, allocation_options,
+                              memory_manager, &live_blocks, &responses,
+                              &interval_report);
+  }
+  report << interval_report.str();
+  report << "replay cache: restored " << restored_count * interval << " of "
+         << queries.size() << " queries, saved " << saved_count
+         << " checkpoints" << endl;
+  return responses;
+}
+
+
+/** Replay cache: END **/
+
+
+DriverOptions ParseDriverOptions(int argc, char* argv[]) {
+  DriverOptions options;
+  for (int argument_n = 1; argument_n < argc; ++argument_n) {
+    const std::string argument = argv[argument_n];
+    const auto separator = argument.find('=');
+    const std::string name = argument.substr(0, separator);
+    const std::string value = separator == std::string::npos ?
+        std::string() :
+        argument.substr(separator + 1);
+    if (name == "--open-loop") {
+      options.open_loop = true;
+    } else if (name == "--output-format") {
+      if (value != "text" && value != "binary") {
+        throw std::invalid_argument("--output-format expects text or binary");
+      }
+      options.binary_output = value == "binary";
+    } else if (name == "--output-backend") {
+      if (value != "stream" && value != "splice") {
+        throw std::invalid_argument(
+            "--output-backend expects stream or splice");
+      }
+      options.splice_output = value == "splice";
+    } else if (name == "--convert") {
+      if (value != "text-to-binary" && value != "binary-to-text") {
+        throw std::invalid_argument(
+            "--convert expects text-to-binary or binary-to-text");
+      }
+      options.convert = value;
+    } else if (name == "--input") {
+      options.input_path = value;
+    } else if (name == "--decompress-threads") {
+      options.decompression_threads_count = std::stoul(value);
+    } else if (name == "--engine") {
+      SetEngineConfigurationValue("engine", value, &options.configuration);
+    } else if (name == "--free-index") {
+      SetEngineConfigurationValue("free_index", value,
+                                  &options.configuration);
+    } else if (name == "--heap-arity") {
+      SetEngineConfigurationValue("heap_arity", value,
+                                  &options.configuration);
+    } else if (name == "--page-size") {
+      SetEngineConfigurationValue("page_size", value, &options.configuration);
+    } else if (name == "--precarve") {
+      options.configuration.precarving = true;
+    } else if (name == "--work-budget") {
+      SetEngineConfigurationValue("work_budget", value,
+                                  &options.configuration);
+    } else if (name == "--reserve-segments") {
+      SetEngineConfigurationValue("reserve_segments", value,
+                                  &options.configuration);
+    } else if (name == "--watermarks") {
+      SetEngineConfigurationValue("watermarks", value,
+                                  &options.configuration);
+    } else if (name == "--config") {
+      LoadEngineConfiguration(value, &options.configuration);
+    } else if (name == "--autotune") {
+      options.autotune_path = value;
+    } else if (name == "--autotune-prefix") {
+      options.autotune_prefix_size = std::stoul(value);
+    } else if (name == "--footprint") {
+      options.footprint = true;
+    } else if (name == "--digest") {
+      options.layout_digest = true;
+    } else if (name == "--differential") {
+      options.differential = true;
+    } else if (name == "--self-check") {
+      options.self_check = true;
+    } else if (name == "--results") {
+      if (value != "full" && value != "live") {
+        throw std::invalid_argument("--results expects full or live");
+      }
+      options.live_results = value == "live";
+    } else if (name == "--streaming") {
+      options.streaming = true;
+      options.live_results = true;
+    } else if (name == "--benchmark") {
+      if (value != "free-index" && value != "bank" &&
+          value != "allocators" && value != "compaction" &&
+          value != "latency" && value != "persistent") {
+        throw std::invalid_argument(
+            "--benchmark expects free-index, bank, allocators, compaction, "
+            "latency or persistent");
+      }
+      options.benchmark = value;
+    } else if (name == "--bank-tenants") {
+      options.bank_tenants_count = std::stoul(value);
+    } else if (name == "--bank-steps") {
+      options.bank_steps_count = std::stoul(value);
+    } else if (name == "--compaction-step") {
+      options.compaction_step_size = std::stoul(value);
+    } else if (name == "--persistent-file") {
+      options.persistent_path = value;
+    } else if (name == "--replay-cache") {
+      options.replay_cache_directory = value;
+    } else if (name == "--replay-checkpoint") {
+      options.replay_checkpoint_interval = std::stoul(value);
+    } else if (name == "--annotate") {
+      options.annotate_path = value;
+    } else if (name == "--annotate-top") {
+      options.annotate_top_count = std::stoul(value);
+    } else if (name == "--rate") {
+      options.rate_multipliers.clear();
+      std::istringstream rates(value);
+      std::string rate;
+      while (std::getline(rates, rate, ',')) {
+        const double rate_multiplier = std::stod(rate);
+        if (!std::isfinite(rate_multiplier) || rate_multiplier <= 0) {
+          throw std::invalid_argument("--rate expects positive multipliers");
+        }
+        options.rate_multipliers.push_back(rate_multiplier);
+      }
+      if (options.rate_multipliers.empty()) {
+        throw std::invalid_argument("--rate expects a list of multipliers");
+      }
+    } else {
+      throw std::invalid_argument("Unknown option: " + argument);
+    }
+  }
+  return options;
+}
+
+
+MemoryManagerAllocationResponse MakeSuccessfulAllocation(size_t position) {
+  MemoryManagerAllocationResponse response = {true, position};
+  return response;
+}
+
+
+MemoryManagerAllocationResponse MakeFailedAllocation() {
+  MemoryManagerAllocationResponse response = {false, 0};
+  return response;
+}
+
+
+void OutputMemoryManagerResponses(
+    const std::vector<MemoryManagerAllocationResponse>& responses,
+    std::ostream& ostream) {
+  for (auto& response : responses) {
+    if (response.success) {
+      ostream << response.position + 1 << endl;
+    } else {
+      ostream << -1 << endl;
+    }
+  }
+}
+
+
+/** MemoryLayoutDigest: BEGIN **/
+MemoryLayoutDigest::MemoryLayoutDigest(size_t memory_size,
+                                       size_t leaves_count)
+  : memory_size_(memory_size)
+  , leaves_count_(1)
+  , leaf_size_(0)
+  , nodes_(std::vector<uint64_t>())
+{
+  while (leaves_count_ < std::min(leaves_count, memory_size)) {
+    leaves_count_ <<= 1;
+  }
+  leaf_size_ = std::max<size_t>(
+      (memory_size + leaves_count_ - 1) / leaves_count_, 1);
+  nodes_.assign(2 * leaves_count_, 0);
+}
+
+
+void MemoryLayoutDigest::Add(int left, int right, bool free) {
+  Update(left, SegmentHash(left, right, free));
+}
+
+
+void MemoryLayoutDigest::Remove(int left, int right, bool free) {
+  Update(left, -SegmentHash(left, right, free));
+}
+
+
+uint64_t MemoryLayoutDigest::Root() const {
+  return nodes_[1];
+}
+
+
+uint64_t MemoryLayoutDigest::SegmentHash(int left, int right, bool free) {
+  // splitmix64 от границ и метки свободности.
+  uint64_t hash = (static_cast<uint64_t>(static_cast<uint32_t>(left)) << 32 |
+                   static_cast<uint32_t>(right)) +
+                  (free ? 0x9E3779B97F4A7C15ULL : 0);
+  hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+  return hash ^ (hash >> 31);
+}
+
+
+void MemoryLayoutDigest::Update(int left, uint64_t delta) {
+  size_t node = leaves_count_ + left / leaf_size_;
+  for (; node != 0; node >>= 1) {
+    nodes_[node] += delta;
+  }
+}
+
+
+bool FindLayoutDivergence(const MemoryLayoutDigest& first,
+                          const MemoryLayoutDigest& second,
+                          size_t* left, size_t* right) {
+  if (first.memory_size_ != second.memory_size_ ||
+      first.leaves_count_ != second.leaves_count_) {
+    throw std::invalid_argument("Layout digests have different shapes");
+  }
+  if (first.Root() == second.Root()) {
+    return false;
+  }
+  size_t node = 1;
+  while (node < first.leaves_count_) {
+    node <<= 1;
+    if (first.nodes_[node] == second.nodes_[node]) {
+      ++node;
+    }
+  }
+  *left = (node - first.leaves_count_) * first.leaf_size_;
+  *right = std::min(*left + first.leaf_size_, first.memory_size_);
+  return true;
+}
+
+
+/** MemoryLayoutDigest: END **/
+
+
+/** MemoryManager: BEGIN **/
+template <class FreeSegmentIndex>
+BasicMemoryManager<FreeSegmentIndex>::BasicMemoryManager(
+    size_t memory_size, size_t heap_arity)
+  : free_memory_segments_(FreeSegmentIndex(heap_arity))
+  , memory_segments_(std::list<MemorySegment>())
+  , memory_size_(memory_size)
+  , free_memory_size_(memory_size)
+  , placement_statistics_(MemoryManagerPlacementStatistics())
+  , splits_count_(0)
+  , merges_count_(0)
+  , layout_digest_(nullptr)
+  , priority_watermarks_(PriorityWatermarks())
+{
+  MemorySegment initial_memory(0, memory_size);
+  auto memory_segment_iterator =
+      memory_segments_.insert(memory_segments_.end(), initial_memory);
+  free_memory_segments_.push(memory_segment_iterator);
+}
+
+
+template <class FreeSegmentIndex>
+MemorySegmentIterator BasicMemoryManager<FreeSegmentIndex>::Allocate(
+    size_t size) {
+  return Allocate(size, AllocationOptions());
+}
+
+
+template <class FreeSegmentIndex>
+MemorySegmentIterator BasicMemoryManager<FreeSegmentIndex>::Allocate(
+    size_t size, const AllocationOptions& options) {
+  MEMORY_MANAGER_PROBE1(allocate_entry, size);
+  if (free_memory_segments_.empty() ||
+      size > free_memory_segments_.top()->Size()) {
+    MEMORY_MANAGER_PROBE2(allocate_exit, size, -1);
+    return end();
+  }
+  auto max_free_memory_segment_iterator = free_memory_segments_.top();
+  const int left = max_free_memory_segment_iterator->left;
+  const int right = max_free_memory_segment_iterator->right;
+  const int offset = PlacementOffset(left, right, size, options);
+  if (offset < 0 ||
+      !AdmitsPriority(options.priority, size,
+                      max_free_memory_segment_iterator, offset - left,
+                      right - offset - size)) {
+    MEMORY_MANAGER_PROBE2(allocate_exit, size, -1);
+    return end();
+  }
+  if (offset != left) {
+    ++placement_statistics_.shifted_allocations;
+    placement_statistics_.padding_size += offset - left;
+  }
+  auto allocated_memory_iterator =
+      Carve(max_free_memory_segment_iterator, offset, size);
+  MEMORY_MANAGER_PROBE2(allocate_exit, size, allocated_memory_iterator->left);
+  return allocated_memory_iterator;
+}
+
+
+template <class FreeSegmentIndex>
+MemorySegmentIterator BasicMemoryManager<FreeSegmentIndex>::AllocateAt(
+    size_t offset, size_t size) {
+  for (auto segment = memory_segments_.begin();
+       segment != memory_segments_.end(); ++segment) {
+    if (static_cast<size_t>(segment->right) <= offset) {
+      continue;
+    }
+    if (segment->heap_index == MemorySegmentHeap::kNullIndex ||
+        offset + size > static_cast<size_t>(segment->right)) {
+      return end();
+    }
+    return Carve(segment, offset, size);
+  }
+  return end();
+}
+
+
+template <class FreeSegmentIndex>
+MemorySegmentIterator BasicMemoryManager<FreeSegmentIndex>::Reallocate(
+    Iterator position, size_t size, const AllocationOptions& options) {
+  const size_t old_size = position->Size();
+  if (size <= old_size) {
+    if (size < old_size) {
+      ++splits_count_;
+      auto tail = memory_segments_.insert(
+          std::next(position),
+          MemorySegment(position->left + size, position->right));
+      DigestRemove(*position, false);
+      position->right = tail->left;
+      DigestAdd(*position, false);
+      DigestAdd(*tail, false);
+      Free(tail);
+    }
+    return position;
+  }
+  auto right_iterator = std::next(position);
+  if (right_iterator != memory_segments_.end() &&
+      right_iterator->heap_index != MemorySegmentHeap::kNullIndex &&
+      position->left + size <= static_cast<size_t>(right_iterator->right)) {
+    if (!AdmitsPriority(options.priority, size - old_size, right_iterator, 0,
+                        right_iterator->right - position->left - size)) {
+      return end();
+    }
+    auto grown = Carve(right_iterator, right_iterator->left, size - old_size);
+    DigestRemove(*grown, false);
+    DigestRemove(*position, false);
+    position->right = grown->right;
+    DigestAdd(*position, false);
+    memory_segments_.erase(grown);
+    return position;
+  }
+  auto moved = Allocate(size, options);
+  if (moved != end()) {
+    Free(position);
+  }
+  return moved;
+}
+
+
+template <class FreeSegmentIndex>
+void BasicMemoryManager<FreeSegmentIndex>::Free(Iterator position) {
+  MEMORY_MANAGER_PROBE2(free, position->left, position->Size());
+  free_memory_size_ += position->Size();
+  DigestRemove(*position, false);
+  auto left_iterator = std::prev(position);
+  auto right_iterator = std::next(position);
+  if (position != memory_segments_.begin()) {
+    AppendIfFree(position, left_iterator);
+  }
+  if (right_iterator != memory_segments_.end()) {
+    AppendIfFree(position, right_iterator);
+  }
+  DigestAdd(*position, true);
+  free_memory_segments_.push(position);
+}
+
+
+template <class FreeSegmentIndex>
+MemorySegmentIterator BasicMemoryManager<FreeSegmentIndex>::SlideLeft(
+    Iterator position) {
+  if (position == memory_segments_.begin()) {
+    return position;
+  }
+  auto gap = std::prev(position);
+  if (gap->heap_index == MemorySegmentHeap::kNullIndex) {
+    return position;
+  }
+  free_memory_segments_.erase(gap);
+  DigestRemove(*gap, true);
+  DigestRemove(*position, false);
+  const int right = position->right;
+  position->right = gap->left + position->Size();
+  position->left = gap->left;
+  gap->left = position->right;
+  gap->right = right;
+  DigestAdd(*position, false);
+  memory_segments_.splice(std::next(position), memory_segments_, gap);
+  auto right_iterator = std::next(gap);
+  if (right_iterator != memory_segments_.end()) {
+    AppendIfFree(gap, right_iterator);
+  }
+  DigestAdd(*gap, true);
+  free_memory_segments_.push(gap);
+  return position;
+}
+
+
+template <class FreeSegmentIndex>
+MemorySegmentIterator BasicMemoryManager<FreeSegmentIndex>::begin() {
+  return memory_segments_.begin();
+}
+
+
+template <class FreeSegmentIndex>
+MemorySegmentIterator BasicMemoryManager<FreeSegmentIndex>::end() {
+  return memory_segments_.end();
+}
+
+
+template <class FreeSegmentIndex>
+MemorySegmentConstIterator BasicMemoryManager<FreeSegmentIndex>::end() const {
+  return memory_segments_.cend();
+}
+
+
+template <class FreeSegmentIndex>
+size_t BasicMemoryManager<FreeSegmentIndex>::FreeMemorySize() const {
+  return free_memory_size_;
+}
+
+
+template <class FreeSegmentIndex>
+size_t BasicMemoryManager<FreeSegmentIndex>::FreeSegmentsCount() const {
+  return free_memory_segments_.size();
+}
+
+
+template <class FreeSegmentIndex>
+size_t BasicMemoryManager<FreeSegmentIndex>::LargestFreeSegmentSize() const {
+  return free_memory_segments_.empty() ?
+        0 :
+        free_memory_segments_.top()->Size();
+}
+
+
+template <class FreeSegmentIndex>
+const MemoryManagerPlacementStatistics&
+BasicMemoryManager<FreeSegmentIndex>::PlacementStatistics() const {
+  return placement_statistics_;
+}
+
+
+template <class FreeSegmentIndex>
+int BasicMemoryManager<FreeSegmentIndex>::Offset(
+    ConstIterator position) const {
+  return position->left;
+}
+
+
+template <class FreeSegmentIndex>
+size_t BasicMemoryManager<FreeSegmentIndex>::AllocatedBlocksCount() const {
+  return memory_segments_.size() - free_memory_segments_.size();
+}
+
+
+/*
+ * Оценка памяти под метаданные: узел списка (сегмент и два указателя)
+ * на каждый сегмент, свободный или занятый, плюс запись в индексе
+ * свободных сегментов. Накладные расходы malloc не учитываются.
+ */
+template <class FreeSegmentIndex>
+size_t BasicMemoryManager<FreeSegmentIndex>::MetadataSize() const {
+  return memory_segments_.size() * (sizeof(MemorySegment) + 2 * sizeof(void*))
+         + free_memory_segments_.size() * sizeof(MemorySegmentIterator);
+}
+
+
+template <class FreeSegmentIndex>
+void BasicMemoryManager<FreeSegmentIndex>::Reserve(size_t segments_count) {
+  free_memory_segments_.reserve(segments_count);
+}
+
+
+template <class FreeSegmentIndex>
+void BasicMemoryManager<FreeSegmentIndex>::SetPriorityWatermarks(
+    const PriorityWatermarks& watermarks) {
+  priority_watermarks_ = watermarks;
+}
+
+
+template <class FreeSegmentIndex>
+MemoryManagerSnapshot BasicMemoryManager<FreeSegmentIndex>::Snapshot() const {
+  MemoryManagerSnapshot snapshot;
+  snapshot.reserve(memory_segments_.size());
+  for (const auto& segment : memory_segments_) {
+    snapshot.push_back(MemoryManagerSnapshotSegment{
+        segment.left, segment.right,
+        segment.heap_index != MemorySegmentHeap::kNullIndex});
+  }
+  return snapshot;
+}
+
+
+template <class FreeSegmentIndex>
+std::vector<MemorySegmentIterator>
+BasicMemoryManager<FreeSegmentIndex>::Restore(
+    const MemoryManagerSnapshot& snapshot) {
+  size_t expected_left = 0;
+  for (const auto& segment : snapshot) {
+    if (static_cast<size_t>(segment.left) != expected_left ||
+        segment.right < segment.left) {
+      throw std::invalid_argument("Snapshot has a gap at " +
+                                  std::to_string(expected_left));
+    }
+    expected_left = segment.right;
+  }
+  if (expected_left != memory_size_ || snapshot.empty()) {
+    throw std::invalid_argument("Snapshot does not cover the memory");
+  }
+  for (auto segment = memory_segments_.begin();
+       segment != memory_segments_.end(); ++segment) {
+    const bool free = segment->heap_index != MemorySegmentHeap::kNullIndex;
+    DigestRemove(*segment, free);
+    if (free) {
+      free_memory_segments_.erase(segment);
+    }
+  }
+  memory_segments_.clear();
+  free_memory_size_ = 0;
+  std::vector<Iterator> segments;
+  segments.reserve(snapshot.size());
+  for (const auto& snapshot_segment : snapshot) {
+    auto segment = memory_segments_.insert(
+        memory_segments_.end(),
+        MemorySegment(snapshot_segment.left, snapshot_segment.right));
+    DigestAdd(*segment, snapshot_segment.free);
+    if (snapshot_segment.free) {
+      free_memory_size_ += segment->Size();
+      free_memory_segments_.push(segment);
+    }
+    segments.push_back(segment);
+  }
+  return segments;
+}
+
+
+template <class FreeSegmentIndex>
+std::vector<MemorySegmentIterator>
+BasicMemoryManager<FreeSegmentIndex>::AllocateGang(
+    const std::vector<size_t>& sizes) {
+  return AllocateGang(sizes, AllocationOptions());
+}
+
+
+/*
+ * Раскладка группы считается заранее, до изменений; блоки и промежутки
+ * выравнивания вставляются в список перед сегментом, а сам его узел
+ * остаётся свободным хвостом или удаляется, если группа заняла сегмент
+ * до конца.
+ */
+template <class FreeSegmentIndex>
+std::vector<MemorySegmentIterator>
+BasicMemoryManager<FreeSegmentIndex>::AllocateGang(
+    const std::vector<size_t>& sizes, const AllocationOptions& options) {
+  std::vector<Iterator> blocks;
+  if (sizes.empty() || free_memory_segments_.empty()) {
+    return blocks;
+  }
+  const Iterator free_segment = free_memory_segments_.top();
+  const int right = free_segment->right;
+  std::vector<int> offsets;
+  offsets.reserve(sizes.size());
+  int cursor = free_segment->left;
+  size_t total_size = 0;
+  size_t largest_padding = 0;
+  for (size_t size : sizes) {
+    if (size > static_cast<size_t>(right - cursor)) {
+      return blocks;
+    }
+    const int offset = PlacementOffset(cursor, right, size, options);
+    if (offset < 0) {
+      return blocks;
+    }
+    largest_padding = std::max<size_t>(largest_padding, offset - cursor);
+    offsets.push_back(offset);
+    cursor = offset + size;
+    total_size += size;
+  }
+  if (!AdmitsPriority(options.priority, total_size, free_segment,
+                      largest_padding, right - cursor)) {
+    return blocks;
+  }
+
+  free_memory_size_ -= total_size;
+  free_memory_segments_.erase(free_segment);
+  DigestRemove(*free_segment, true);
+  blocks.reserve(sizes.size());
+  int left = free_segment->left;
+  for (size_t block_n = 0; block_n < sizes.size(); ++block_n) {
+    const int offset = offsets[block_n];
+    if (offset != left) {
+      ++splits_count_;
+      ++placement_statistics_.shifted_allocations;
+      placement_statistics_.padding_size += offset - left;
+      auto padding_iterator = memory_segments_.insert(
+          free_segment, MemorySegment(left, offset));
+      DigestAdd(*padding_iterator, true);
+      free_memory_segments_.push(padding_iterator);
+    }
+    left = offset + sizes[block_n];
+    blocks.push_back(memory_segments_.insert(
+        free_segment, MemorySegment(offset, left)));
+    DigestAdd(*blocks.back(), false);
+    ++splits_count_;
+  }
+  free_segment->left = left;
+  if (left == right) {
+    --splits_count_;
+    memory_segments_.erase(free_segment);
+  } else {
+    DigestAdd(*free_segment, true);
+    free_memory_segments_.push(free_segment);
+  }
+  return blocks;
+}
+
+
+/*
+ * Наибольший свободный сегмент после выделения — наибольший из остатков
+ * segment и сегмента, который без него окажется на вершине индекса.
+ */
+template <class FreeSegmentIndex>
+bool BasicMemoryManager<FreeSegmentIndex>::AdmitsPriority(
+    size_t priority, size_t size, Iterator segment, size_t left_rest,
+    size_t right_rest) {
+  if (priority >= priority_watermarks_.size()) {
+    return true;
+  }
+  size_t largest_free_size = std::max(left_rest, right_rest);
+  const Iterator top = free_memory_segments_.top();
+  if (top != segment) {
+    largest_free_size = std::max(largest_free_size, top->Size());
+  } else if (free_memory_segments_.size() > 1) {
+    largest_free_size = std::max(largest_free_size,
+                                 free_memory_segments_.second()->Size());
+  }
+  if (WithinPriorityWatermarks(priority_watermarks_, priority,
+                               free_memory_size_ - size,
+                               largest_free_size)) {
+    return true;
+  }
+  ++placement_statistics_.watermark_rejections;
+  return false;
+}
+
+
+template <class FreeSegmentIndex>
+void BasicMemoryManager<FreeSegmentIndex>::EnableLayoutDigest(
+    size_t leaves_count) {
+  layout_digest_.reset(new MemoryLayoutDigest(memory_size_, leaves_count));
+  for (const auto& segment : memory_segments_) {
+    DigestAdd(segment, segment.heap_index != MemorySegmentHeap::kNullIndex);
+  }
+}
+
+
+template <class FreeSegmentIndex>
+const MemoryLayoutDigest*
+BasicMemoryManager<FreeSegmentIndex>::LayoutDigest() const {
+  return layout_digest_.get();
+}
+
+
+template <class FreeSegmentIndex>
+void BasicMemoryManager<FreeSegmentIndex>::DigestAdd(
+    const MemorySegment& segment, bool free) {
+  if (layout_digest_) {
+    layout_digest_->Add(segment.left, segment.right, free);
+  }
+}
+
+
+template <class FreeSegmentIndex>
+void BasicMemoryManager<FreeSegmentIndex>::DigestRemove(
+    const MemorySegment& segment, bool free) {
+  if (layout_digest_) {
+    layout_digest_->Remove(segment.left, segment.right, free);
+  }
+}
+
+
+template <class FreeSegmentIndex>
+MemoryManagerCounters BasicMemoryManager<FreeSegmentIndex>::Counters() const {
+  const HeapStatistics heap_statistics = free_memory_segments_.Statistics();
+  MemoryManagerCounters counters;
+  counters.heap_operations = heap_statistics.operations;
+  counters.sift_steps = heap_statistics.sift_steps;
+  counters.splits = splits_count_;
+  counters.merges = merges_count_;
+  return counters;
+}
+
+
+int PlacementOffset(int left, int right, size_t size,
+                    const AllocationOptions& options) {
+  const size_t page_size = options.page_size;
+  const size_t unsigned_left = left;
+  const size_t unsigned_right = right;
+  if (size > unsigned_right - unsigned_left) {
+    return -1;
+  }
+  if (options.alignment > 1) {
+    // Граница выравнивания ищется без переполнения: сначала остаток.
+    const size_t padding =
+        (options.alignment - unsigned_left % options.alignment) %
+        options.alignment;
+    if (padding > unsigned_right - unsigned_left - size) {
+      return -1;
+    }
+    return left + static_cast<int>(padding);
+  }
+  if (page_size == 0 || size == 0 || size > page_size ||
+      unsigned_left / page_size == (unsigned_left + size - 1) / page_size) {
+    return left;
+  }
+  const size_t page_boundary = (unsigned_left / page_size + 1) * page_size;
+  if (page_boundary + size > static_cast<size_t>(right)) {
+    return left;
+  }
+  return page_boundary;
+}
+
+
+bool WithinPriorityWatermarks(const PriorityWatermarks& watermarks,
+                              size_t priority, size_t free_size,
+                              size_t largest_free_size) {
+  if (priority >= watermarks.size()) {
+    return true;
+  }
+  const PriorityWatermark& watermark = watermarks[priority];
+  return free_size >= watermark.free_size &&
+         largest_free_size >= watermark.largest_free_size;
+}
+
+
+/*
+ * Вырезает из свободного сегмента блок [offset, offset + size). Кусок левее
+ * offset остаётся свободным отдельным сегментом, правый остаток — прежним
+ * узлом списка.
+ */
+template <class FreeSegmentIndex>
+MemorySegmentIterator BasicMemoryManager<FreeSegmentIndex>::Carve(
+    Iterator free_segment, int offset, size_t size) {
+  free_memory_size_ -= size;
+  DigestRemove(*free_segment, true);
+  if (offset != free_segment->left) {
+    ++splits_count_;
+    MEMORY_MANAGER_PROBE4(split, free_segment->left, free_segment->right,
+                          offset, offset - free_segment->left);
+    auto padding_iterator = memory_segments_.insert(
+        free_segment, MemorySegment(free_segment->left, offset));
+    free_memory_segments_.erase(free_segment);
+    free_segment->left = offset;
+    DigestAdd(*padding_iterator, true);
+    free_memory_segments_.push(padding_iterator);
+    free_memory_segments_.push(free_segment);
+  }
+  if (size == free_segment->Size()) {
+    free_memory_segments_.erase(free_segment);
+    DigestAdd(*free_segment, false);
+    return free_segment;
+  }
+  ++splits_count_;
+  MEMORY_MANAGER_PROBE4(split, free_segment->left, free_segment->right,
+                        free_segment->left, size);
+  auto allocated_memory_iterator =
+      memory_segments_.insert(
+        free_segment,
+        MemorySegment(free_segment->left, free_segment->left + size));
+  free_memory_segments_.erase(free_segment);
+  free_segment->left = allocated_memory_iterator->right;
+  DigestAdd(*allocated_memory_iterator, false);
+  DigestAdd(*free_segment, true);
+  free_memory_segments_.push(free_segment);
+  return allocated_memory_iterator;
+}
+
+
+template <class FreeSegmentIndex>
+void BasicMemoryManager<FreeSegmentIndex>::AppendIfFree(
+    Iterator remaining, Iterator appending) {
+  if (appending->heap_index != MemorySegmentHeap::kNullIndex) {
+    ++merges_count_;
+    DigestRemove(*appending, true);
+    *remaining = remaining->Unite(*appending);
+    MEMORY_MANAGER_PROBE3(merge, remaining->left, remaining->right,
+                          appending->Size());
+    free_memory_segments_.erase(appending);
+    memory_segments_.erase(appending);
+  }
+}
+
+
+/** MemoryManager: END **/
+
+
+/** CompactMemoryManager: BEGIN **/
+CompactMemoryManager::CompactMemoryManager(
+    size_t memory_size, size_t heap_arity)
+  : free_segments_(FreeMemorySegmentMap())
+  , free_segments_heap_(FreeMemorySegmentHeap(
+        FreeMemorySegmentSizeCompare(), FreeMemorySegmentsHeapObserver(),
+        heap_arity))
+  , blocks_(std::vector<AllocatedBlock>())
+  , free_handles_head_(kNullHandle)
+  , allocated_blocks_count_(0)
+  , free_memory_size_(memory_size)
+  , placement_statistics_(MemoryManagerPlacementStatistics())
+  , splits_count_(0)
+  , merges_count_(0)
+  , priority_watermarks_(PriorityWatermarks())
+{
+  InsertFreeSegment(0, memory_size);
+}
+
+
+CompactMemoryManager::Iterator CompactMemoryManager::Allocate(size_t size) {
+  return Allocate(size, AllocationOptions());
+}
+
+
+CompactMemoryManager::Iterator CompactMemoryManager::Allocate(
+    size_t size, const AllocationOptions& options) {
+  MEMORY_MANAGER_PROBE1(allocate_entry, size);
+  if (free_segments_heap_.empty() ||
+      size > LargestFreeSegmentSize()) {
+    MEMORY_MANAGER_PROBE2(allocate_exit, size, -1);
+    return end();
+  }
+  auto free_segment = free_segments_heap_.top();
+  const int left = free_segment->first;
+  const int right = free_segment->second.right;
+  if (size == 0) {
+    if (!AdmitsPriority(options.priority, 0, free_segment, 0, right - left)) {
+      MEMORY_MANAGER_PROBE2(allocate_exit, size, -1);
+      return end();
+    }
+    MEMORY_MANAGER_PROBE2(allocate_exit, size, left);
+    return MakeHandle(left, 0);
+  }
+  const int offset = PlacementOffset(left, right, size, options);
+  if (offset < 0 ||
+      !AdmitsPriority(options.priority, size, free_segment, offset - left,
+                      right - offset - size)) {
+    MEMORY_MANAGER_PROBE2(allocate_exit, size, -1);
+    return end();
+  }
+  if (offset != left) {
+    ++placement_statistics_.shifted_allocations;
+    placement_statistics_.padding_size += offset - left;
+  }
+  Carve(free_segment, offset, size);
+  MEMORY_MANAGER_PROBE2(allocate_exit, size, offset);
+  return MakeHandle(offset, size);
+}
+
+
+CompactMemoryManager::Iterator CompactMemoryManager::AllocateAt(
+    size_t offset, size_t size) {
+  auto free_segment = free_segments_.upper_bound(offset);
+  if (free_segment == free_segments_.begin()) {
+    return end();
+  }
+  --free_segment;
+  const size_t right = free_segment->second.right;
+  if (offset >= right || offset + size > right) {
+    return end();
+  }
+  if (size != 0) {
+    Carve(free_segment, offset, size);
+  }
+  return MakeHandle(offset, size);
+}
+
+
+CompactMemoryManager::Iterator CompactMemoryManager::Reallocate(
+    Iterator position, size_t size, const AllocationOptions& options) {
+  const int left = blocks_[position].offset;
+  const size_t old_size = blocks_[position].size;
+  const int right = left + old_size;
+  if (size <= old_size) {
+    blocks_[position].size = size;
+    if (size < old_size) {
+      ++splits_count_;
+      ReleaseSegment(left + size, right);
+    }
+    return position;
+  }
+  auto right_neighbour = free_segments_.find(right);
+  if (right_neighbour != free_segments_.end() &&
+      left + size <= static_cast<size_t>(right_neighbour->second.right)) {
+    if (!AdmitsPriority(options.priority, size - old_size, right_neighbour,
+                        0, right_neighbour->second.right - left - size)) {
+      return end();
+    }
+    Carve(right_neighbour, right, size - old_size);
+    blocks_[position].size = size;
+    return position;
+  }
+  auto moved = Allocate(size, options);
+  if (moved != end()) {
+    Free(position);
+  }
+  return moved;
+}
+
+
+/*
+ * Вырезает блок [offset, offset + size) из свободного сегмента; куски
+ * слева и справа от блока остаются свободными.
+ */
+void CompactMemoryManager::Carve(FreeMemorySegmentMapIterator free_segment,
+                                 int offset, size_t size) {
+  const int left = free_segment->first;
+  const int right = free_segment->second.right;
+  const int remaining_left = offset + size;
+  free_memory_size_ -= size;
+  free_segments_heap_.erase(free_segment->second.heap_index);
+  if (offset != left) {
+    ++splits_count_;
+    MEMORY_MANAGER_PROBE4(split, left, right, offset, offset - left);
+    free_segment->second.right = offset;
+    free_segments_heap_.push(free_segment);
+    if (remaining_left != right) {
+      InsertFreeSegment(remaining_left, right);
+    }
+  } else if (remaining_left != right) {
+    ++splits_count_;
+    MEMORY_MANAGER_PROBE4(split, left, right, left, size);
+    auto node = free_segments_.extract(free_segment);
+    node.key() = remaining_left;
+    free_segments_heap_.push(free_segments_.insert(std::move(node)).position);
+  } else {
+    free_segments_.erase(free_segment);
+  }
+}
+
+
+void CompactMemoryManager::Free(Iterator position) {
+  const int left = blocks_[position].offset;
+  const int right = left + blocks_[position].size;
+  MEMORY_MANAGER_PROBE2(free, left, right - left);
+  blocks_[position].offset = free_handles_head_;
+  blocks_[position].size = -1;
+  free_handles_head_ = position;
+  --allocated_blocks_count_;
+  ReleaseSegment(left, right);
+}
+
+
+/*
+ * Возвращает [left, right) в свободные, сливая его с соседями.
+ */
+void CompactMemoryManager::ReleaseSegment(int left, int right) {
+  if (left == right) {
+    return;
+  }
+  free_memory_size_ += right - left;
+
+  auto right_neighbour = free_segments_.lower_bound(left);
+  const bool merge_right = right_neighbour != free_segments_.end() &&
+                           right_neighbour->first == right;
+  const bool merge_left = right_neighbour != free_segments_.begin() &&
+                          std::prev(right_neighbour)->second.right == left;
+  if (!merge_left && !merge_right) {
+    InsertFreeSegment(left, right);
+    return;
+  }
+  auto merged = merge_left ? std::prev(right_neighbour) : right_neighbour;
+  free_segments_heap_.erase(merged->second.heap_index);
+  if (merge_left) {
+    ++merges_count_;
+    merged->second.right = right;
+    MEMORY_MANAGER_PROBE3(merge, merged->first, right, right - left);
+  }
+  if (merge_right) {
+    ++merges_count_;
+    if (merge_left) {
+      free_segments_heap_.erase(right_neighbour->second.heap_index);
+      merged->second.right = right_neighbour->second.right;
+      free_segments_.erase(right_neighbour);
+    } else {
+      auto node = free_segments_.extract(right_neighbour);
+      node.key() = left;
+      merged = free_segments_.insert(std::move(node)).position;
+    }
+    MEMORY_MANAGER_PROBE3(merge, merged->first, merged->second.right,
+                          right - left);
+  }
+  free_segments_heap_.push(merged);
+}
+
+
+CompactMemoryManager::Iterator CompactMemoryManager::end() const {
+  return kNullHandle;
+}
+
+
+size_t CompactMemoryManager::FreeMemorySize() const {
+  return free_memory_size_;
+}
+
+
+size_t CompactMemoryManager::FreeSegmentsCount() const {
+  return free_segments_.size();
+}
+
+
+size_t CompactMemoryManager::LargestFreeSegmentSize() const {
+  if (free_segments_heap_.empty()) {
+    return 0;
+  }
+  auto largest = free_segments_heap_.top();
+  return largest->second.right - largest->first;
+}
+
+
+const MemoryManagerPlacementStatistics&
+CompactMemoryManager::PlacementStatistics() const {
+  return placement_statistics_;
+}
+
+
+MemoryManagerCounters CompactMemoryManager::Counters() const {
+  MemoryManagerCounters counters;
+  counters.heap_operations = free_segments_heap_.Statistics().operations;
+  counters.sift_steps = free_segments_heap_.Statistics().sift_steps;
+  counters.splits = splits_count_;
+  counters.merges = merges_count_;
+  return counters;
+}
+
+
+int CompactMemoryManager::Offset(ConstIterator position) const {
+  return blocks_[position].offset;
+}
+
+
+size_t CompactMemoryManager::AllocatedBlocksCount() const {
+  return allocated_blocks_count_;
+}
+
+
+/*
+ * Оценка памяти под метаданные: таблица ручек целиком (включая
+ * освободившиеся записи), узел std::map (значение и три указателя
+ * с цветом) и запись в куче на каждый свободный сегмент.
+ */
+size_t CompactMemoryManager::MetadataSize() const {
+  return blocks_.capacity() * sizeof(AllocatedBlock) +
+         free_segments_.size() *
+             (sizeof(FreeMemorySegmentMap::value_type) + 4 * sizeof(void*) +
+              sizeof(FreeMemorySegmentMapIterator));
+}
+
+
+void CompactMemoryManager::Reserve(size_t segments_count) {
+  blocks_.reserve(segments_count);
+  free_segments_heap_.reserve(segments_count);
+}
+
+
+void CompactMemoryManager::SetPriorityWatermarks(
+    const PriorityWatermarks& watermarks) {
+  priority_watermarks_ = watermarks;
+}
+
+
+bool CompactMemoryManager::AdmitsPriority(
+    size_t priority, size_t size, FreeMemorySegmentMapIterator free_segment,
+    size_t left_rest, size_t right_rest) {
+  if (priority >= priority_watermarks_.size()) {
+    return true;
+  }
+  size_t largest_free_size = std::max(left_rest, right_rest);
+  FreeMemorySegmentMapIterator largest = free_segments_heap_.top();
+  if (largest == free_segment && free_segments_heap_.size() > 1) {
+    largest = free_segments_heap_.second();
+  }
+  if (largest != free_segment) {
+    largest_free_size = std::max<size_t>(
+        largest_free_size, largest->second.right - largest->first);
+  }
+  if (WithinPriorityWatermarks(priority_watermarks_, priority,
+                               free_memory_size_ - size,
+                               largest_free_size)) {
+    return true;
+  }
+  ++placement_statistics_.watermark_rejections;
+  return false;
+}
+
+
+std::vector<CompactMemoryManager::Iterator> CompactMemoryManager::AllocateGang(
+    const std::vector<size_t>& sizes) {
+  return AllocateGang(sizes, AllocationOptions());
+}
+
+
+/*
+ * Узел std::map свободного сегмента достаётся промежутку, который
+ * начинается там же, где сегмент, а если такого нет — хвосту; остальные
+ * промежутки вставляются заново.
+ */
+std::vector<CompactMemoryManager::Iterator> CompactMemoryManager::AllocateGang(
+    const std::vector<size_t>& sizes, const AllocationOptions& options) {
+  std::vector<Iterator> blocks;
+  if (sizes.empty() || free_segments_heap_.empty()) {
+    return blocks;
+  }
+  auto free_segment = free_segments_heap_.top();
+  const int right = free_segment->second.right;
+  std::vector<int> offsets;
+  offsets.reserve(sizes.size());
+  int cursor = free_segment->first;
+  size_t total_size = 0;
+  size_t largest_padding = 0;
+  for (size_t size : sizes) {
+    if (size > static_cast<size_t>(right - cursor)) {
+      return blocks;
+    }
+    const int offset =
+        size == 0 ? cursor : PlacementOffset(cursor, right, size, options);
+    if (offset < 0) {
+      return blocks;
+    }
+    largest_padding = std::max<size_t>(largest_padding, offset - cursor);
+    offsets.push_back(offset);
+    cursor = offset + size;
+    total_size += size;
+  }
+  if (!AdmitsPriority(options.priority, total_size, free_segment,
+                      largest_padding, right - cursor)) {
+    return blocks;
+  }
+
+  free_memory_size_ -= total_size;
+  free_segments_heap_.erase(free_segment->second.heap_index);
+  bool node_reused = false;
+  size_t pieces_count = 0;
+  const int segment_left = free_segment->first;
+  int left = segment_left;
+  blocks.reserve(sizes.size());
+  for (size_t block_n = 0; block_n < sizes.size(); ++block_n) {
+    const int offset = offsets[block_n];
+    if (offset != left) {
+      ++pieces_count;
+      ++placement_statistics_.shifted_allocations;
+      placement_statistics_.padding_size += offset - left;
+      if (left == segment_left) {
+        free_segment->second.right = offset;
+        free_segments_heap_.push(free_segment);
+        node_reused = true;
+      } else {
+        InsertFreeSegment(left, offset);
+      }
+    }
+    left = offset + sizes[block_n];
+    if (sizes[block_n] != 0) {
+      ++pieces_count;
+    }
+    blocks.push_back(MakeHandle(offset, sizes[block_n]));
+  }
+  if (left != right) {
+    ++pieces_count;
+    if (node_reused) {
+      InsertFreeSegment(left, right);
+    } else {
+      auto node = free_segments_.extract(free_segment);
+      node.key() = left;
+      free_segments_heap_.push(
+          free_segments_.insert(std::move(node)).position);
+    }
+  } else if (!node_reused) {
+    free_segments_.erase(free_segment);
+  }
+  if (pieces_count > 1) {
+    splits_count_ += pieces_count - 1;
+  }
+  return blocks;
+}
+
+
+CompactMemoryManager::Iterator CompactMemoryManager::MakeHandle(
+    int offset, size_t size) {
+  ++allocated_blocks_count_;
+  AllocatedBlock block = {offset, static_cast<int32_t>(size)};
+  if (free_handles_head_ == kNullHandle) {
+    blocks_.push_back(block);
+    return blocks_.size() - 1;
+  }
+  const Iterator handle = free_handles_head_;
+  free_handles_head_ = blocks_[handle].offset;
+  blocks_[handle] = block;
+  return handle;
+}
+
+
+void CompactMemoryManager::InsertFreeSegment(int left, int right) {
+  FreeMemorySegment segment = {right, MemorySegmentHeap::kNullIndex};
+  free_segments_heap_.push(free_segments_.emplace(left, segment).first);
+}
+
+
+bool FreeMemorySegmentSizeCompare::operator() (
+    FreeMemorySegmentMapIterator first,
+    FreeMemorySegmentMapIterator second) const {
+  const int first_size = first->second.right - first->first;
+  const int second_size = second->second.right - second->first;
+  if (first_size == second_size) {
+    return first->first < second->first;
+  }
+  return first_size > second_size;
+}
+
+
+void FreeMemorySegmentsHeapObserver::operator() (
+    FreeMemorySegmentMapIterator segment, size_t new_index) const {
+  segment->second.heap_index = new_index;
+}
+
+
+/** CompactMemoryManager: END **/
+
+
+/** PrecarvingMemoryManager: BEGIN **/
+template <class Manager>
+PrecarvingMemoryManager<Manager>::PrecarvingMemoryManager(
+    size_t memory_size, size_t heap_arity, const PrecarvingOptions& options)
+  : memory_manager_(Manager(memory_size, heap_arity))
+  , options_(options)
+  , recent_sizes_(std::vector<size_t>())
+  , recent_sizes_position_(0)
+  , recent_counts_(std::unordered_map<size_t, size_t>())
+  , hot_sizes_(std::vector<HotSize>())
+  , hot_sizes_stale_(false)
+  , reserves_(std::unordered_map<size_t, std::vector<Iterator>>())
+  , reserved_size_(0)
+  , reserved_blocks_count_(0)
+  , statistics_(PrecarvingStatistics())
+  , priority_watermarks_(PriorityWatermarks())
+{
+  recent_sizes_.reserve(options_.window_size);
+}
+
+
+template <class Manager>
+typename PrecarvingMemoryManager<Manager>::Iterator
+PrecarvingMemoryManager<Manager>::Allocate(size_t size) {
+  return Allocate(size, AllocationOptions());
+}
+
+
+template <class Manager>
+typename PrecarvingMemoryManager<Manager>::Iterator
+PrecarvingMemoryManager<Manager>::Allocate(
+    size_t size, const AllocationOptions& options) {
+  Learn(size);
+  if (options.page_size == 0 && options.alignment == 0) {
+    auto reserve = reserves_.find(size);
+    if (reserve != reserves_.end() && !reserve->second.empty() &&
+        WithinPriorityWatermarks(priority_watermarks_, options.priority,
+                                 FreeMemorySize() - size,
+                                 LargestFreeSegmentSize())) {
+      ++statistics_.hits;
+      const Iterator block = reserve->second.back();
+      reserve->second.pop_back();
+      reserved_size_ -= size;
+      --reserved_blocks_count_;
+      return block;
+    }
+  }
+  ++statistics_.misses;
+  Iterator block = memory_manager_.Allocate(size, options);
+  if (block == memory_manager_.end() && reserved_blocks_count_ != 0) {
+    ReturnAllReserves();
+    block = memory_manager_.Allocate(size, options);
+  }
+  return block;
+}
+
+
+template <class Manager>
+typename PrecarvingMemoryManager<Manager>::Iterator
+PrecarvingMemoryManager<Manager>::AllocateAt(size_t offset, size_t size) {
+  return memory_manager_.AllocateAt(offset, size);
+}
+
+
+template <class Manager>
+typename PrecarvingMemoryManager<Manager>::Iterator
+PrecarvingMemoryManager<Manager>::Reallocate(
+    Iterator position, size_t size, const AllocationOptions& options) {
+  return memory_manager_.Reallocate(position, size, options);
+}
+
+
+template <class Manager>
+void PrecarvingMemoryManager<Manager>::Free(Iterator position) {
+  memory_manager_.Free(position);
+}
+
+
+template <class Manager>
+typename PrecarvingMemoryManager<Manager>::Iterator
+PrecarvingMemoryManager<Manager>::end() {
+  return memory_manager_.end();
+}
+
+
+template <class Manager>
+typename PrecarvingMemoryManager<Manager>::ConstIterator
+PrecarvingMemoryManager<Manager>::end() const {
+  return memory_manager_.end();
+}
+
+
+template <class Manager>
+size_t PrecarvingMemoryManager<Manager>::Idle(size_t max_steps) {
+  if (hot_sizes_stale_) {
+    UpdateHotSizes();
+  }
+  size_t steps_count = 0;
+  for (auto reserve = reserves_.begin();
+       reserve != reserves_.end() && steps_count < max_steps;) {
+    if (IsHot(reserve->first)) {
+      ++reserve;
+      continue;
+    }
+    while (steps_count < max_steps && ReturnReserve(reserve->first)) {
+      ++steps_count;
+    }
+    if (reserve->second.empty()) {
+      reserve = reserves_.erase(reserve);
+    } else {
+      ++reserve;
+    }
+  }
+  const double reserved_limit =
+      options_.max_reserved_share * memory_manager_.FreeMemorySize();
+  for (const HotSize& hot_size : hot_sizes_) {
+    auto& reserve = reserves_[hot_size.size];
+    while (steps_count < max_steps &&
+           reserve.size() < hot_size.target_blocks_count &&
+           reserved_size_ + hot_size.size <= reserved_limit) {
+      const Iterator block = memory_manager_.Allocate(hot_size.size);
+      if (block == memory_manager_.end()) {
+        break;
+      }
+      reserve.push_back(block);
+      reserved_size_ += hot_size.size;
+      ++reserved_blocks_count_;
+      ++statistics_.carved_blocks;
+      ++steps_count;
+    }
+  }
+  return steps_count;
+}
+
+
+template <class Manager>
+size_t PrecarvingMemoryManager<Manager>::FreeMemorySize() const {
+  return memory_manager_.FreeMemorySize() + reserved_size_;
+}
+
+
+template <class Manager>
+size_t PrecarvingMemoryManager<Manager>::FreeSegmentsCount() const {
+  return memory_manager_.FreeSegmentsCount();
+}
+
+
+template <class Manager>
+size_t PrecarvingMemoryManager<Manager>::LargestFreeSegmentSize() const {
+  return memory_manager_.LargestFreeSegmentSize();
+}
+
+
+template <class Manager>
+const MemoryManagerPlacementStatistics&
+PrecarvingMemoryManager<Manager>::PlacementStatistics() const {
+  return memory_manager_.PlacementStatistics();
+}
+
+
+template <class Manager>
+MemoryManagerCounters PrecarvingMemoryManager<Manager>::Counters() const {
+  return memory_manager_.Counters();
+}
+
+
+template <class Manager>
+int PrecarvingMemoryManager<Manager>::Offset(ConstIterator position) const {
+  return memory_manager_.Offset(position);
+}
+
+
+template <class Manager>
+size_t PrecarvingMemoryManager<Manager>::AllocatedBlocksCount() const {
+  return memory_manager_.AllocatedBlocksCount() - reserved_blocks_count_;
+}
+
+
+/*
+ * К метаданным нижележащего менеджера добавляются окно последних размеров
+ * и ручки блоков в запасе.
+ */
+template <class Manager>
+size_t PrecarvingMemoryManager<Manager>::MetadataSize() const {
+  return memory_manager_.MetadataSize() +
+         recent_sizes_.capacity() * sizeof(size_t) +
+         reserved_blocks_count_ * sizeof(Iterator);
+}
+
+
+template <class Manager>
+void PrecarvingMemoryManager<Manager>::SetPriorityWatermarks(
+    const PriorityWatermarks& watermarks) {
+  priority_watermarks_ = watermarks;
+  memory_manager_.SetPriorityWatermarks(watermarks);
+}
+
+
+template <class Manager>
+const PrecarvingStatistics&
+PrecarvingMemoryManager<Manager>::Precarving() const {
+  return statistics_;
+}
+
+
+template <class Manager>
+void PrecarvingMemoryManager<Manager>::Learn(size_t size) {
+  if (options_.window_size == 0) {
+    return;
+  }
+  if (recent_sizes_.size() < options_.window_size) {
+    recent_sizes_.push_back(size);
+  } else {
+    size_t& evicted = recent_sizes_[recent_sizes_position_];
+    auto evicted_count = recent_counts_.find(evicted);
+    if (--evicted_count->second == 0) {
+      recent_counts_.erase(evicted_count);
+    }
+    evicted = size;
+    recent_sizes_position_ =
+        (recent_sizes_position_ + 1) % options_.window_size;
+  }
+  ++recent_counts_[size];
+  hot_sizes_stale_ = true;
+}
+
+
+template <class Manager>
+void PrecarvingMemoryManager<Manager>::UpdateHotSizes() {
+  hot_sizes_stale_ = false;
+  hot_sizes_.clear();
+  const double hot_count = options_.hot_share * recent_sizes_.size();
+  for (const auto& size_count : recent_counts_) {
+    if (size_count.second >= hot_count && size_count.first != 0) {
+      const size_t target_blocks_count = std::min(
+          options_.max_blocks_per_size,
+          static_cast<size_t>(options_.reserve_share * size_count.second));
+      hot_sizes_.push_back({size_count.first, target_blocks_count});
+    }
+  }
+  std::sort(hot_sizes_.begin(), hot_sizes_.end(),
+            [](const HotSize& first, const HotSize& second) {
+              return first.target_blocks_count > second.target_blocks_count;
+            });
+  if (hot_sizes_.size() > options_.max_hot_sizes) {
+    hot_sizes_.resize(options_.max_hot_sizes);
+  }
+}
+
+
+template <class Manager>
+bool PrecarvingMemoryManager<Manager>::IsHot(size_t size) const {
+  for (const HotSize& hot_size : hot_sizes_) {
+    if (hot_size.size == size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+template <class Manager>
+bool PrecarvingMemoryManager<Manager>::ReturnReserve(size_t size) {
+  auto reserve = reserves_.find(size);
+  if (reserve == reserves_.end() || reserve->second.empty()) {
+    return false;
+  }
+  memory_manager_.Free(reserve->second.back());
+  reserve->second.pop_back();
+  reserved_size_ -= size;
+  --reserved_blocks_count_;
+  ++statistics_.returned_blocks;
+  return true;
+}
+
+
+template <class Manager>
+void PrecarvingMemoryManager<Manager>::ReturnAllReserves() {
+  for (auto& reserve : reserves_) {
+    while (ReturnReserve(reserve.first)) {
+    }
+  }
+}
+
+
+template <class Manager>
+bool MemoryManagerIdleStep(Manager*) {
+  return false;
+}
+
+
+template <class Manager>
+bool MemoryManagerIdleStep(PrecarvingMemoryManager<Manager>* memory_manager) {
+  return memory_manager->Idle(1) != 0;
+}
+
+
+template <class Manager>
+void OutputPrecarvingStatistics(const Manager&, std::ostream&) {
+}
+
+
+template <class Manager>
+void OutputPrecarvingStatistics(
+    const PrecarvingMemoryManager<Manager>& memory_manager,
+    std::ostream& ostream) {
+  const PrecarvingStatistics& statistics = memory_manager.Precarving();
+  ostream << "precarving: " << statistics.hits << " hits, "
+          << statistics.misses << " misses, " << statistics.carved_blocks
+          << " carved, " << statistics.returned_blocks << " returned"
+          << endl;
+}
+
+
+/** PrecarvingMemoryManager: END **/
+
+
+/** BoundedLatencyMemoryManager: BEGIN **/
+template <class Manager>
+BoundedLatencyMemoryManager<Manager>::BoundedLatencyMemoryManager(
+    size_t memory_size, size_t heap_arity,
+    const BoundedLatencyOptions& options)
+  : memory_manager_(Manager(memory_size, heap_arity))
+  , options_(options)
+  , pending_batches_(std::deque<std::vector<Iterator>>())
+  , pending_position_(0)
+  , backlog_(0)
+  , statistics_(BoundedLatencyStatistics())
+{
+  if (options_.reserved_segments != 0) {
+    memory_manager_.Reserve(options_.reserved_segments);
+  }
+}
+
+
+template <class Manager>
+typename BoundedLatencyMemoryManager<Manager>::Iterator
+BoundedLatencyMemoryManager<Manager>::Allocate(size_t size) {
+  return Allocate(size, AllocationOptions());
+}
+
+
+template <class Manager>
+typename BoundedLatencyMemoryManager<Manager>::Iterator
+BoundedLatencyMemoryManager<Manager>::Allocate(
+    size_t size, const AllocationOptions& options) {
+  RecordWork(Maintain(options_.work_budget));
+  return CountBacklogFailure(memory_manager_.Allocate(size, options));
+}
+
+
+template <class Manager>
+typename BoundedLatencyMemoryManager<Manager>::Iterator
+BoundedLatencyMemoryManager<Manager>::AllocateAt(size_t offset, size_t size) {
+  RecordWork(Maintain(options_.work_budget));
+  return CountBacklogFailure(memory_manager_.AllocateAt(offset, size));
+}
+
+
+template <class Manager>
+typename BoundedLatencyMemoryManager<Manager>::Iterator
+BoundedLatencyMemoryManager<Manager>::Reallocate(
+    Iterator position, size_t size, const AllocationOptions& options) {
+  RecordWork(Maintain(options_.work_budget));
+  return CountBacklogFailure(
+      memory_manager_.Reallocate(position, size, options));
+}
+
+
+template <class Manager>
+void BoundedLatencyMemoryManager<Manager>::Free(Iterator position) {
+  if (backlog_ == 0) {
+    memory_manager_.Free(position);
+    return;
+  }
+  FreeBatch(std::vector<Iterator>(1, position));
+}
+
+
+template <class Manager>
+void BoundedLatencyMemoryManager<Manager>::FreeBatch(
+    std::vector<Iterator> positions) {
+  if (!positions.empty()) {
+    backlog_ += positions.size();
+    statistics_.deferred_frees += positions.size();
+    statistics_.max_backlog = std::max(statistics_.max_backlog, backlog_);
+    pending_batches_.push_back(std::move(positions));
+  }
+  RecordWork(Maintain(options_.work_budget));
+}
+
+
+template <class Manager>
+typename BoundedLatencyMemoryManager<Manager>::Iterator
+BoundedLatencyMemoryManager<Manager>::end() {
+  return memory_manager_.end();
+}
+
+
+template <class Manager>
+typename BoundedLatencyMemoryManager<Manager>::ConstIterator
+BoundedLatencyMemoryManager<Manager>::end() const {
+  return memory_manager_.end();
+}
+
+
+template <class Manager>
+size_t BoundedLatencyMemoryManager<Manager>::Idle(size_t max_steps) {
+  return Maintain(max_steps);
+}
+
+
+template <class Manager>
+size_t BoundedLatencyMemoryManager<Manager>::FreeMemorySize() const {
+  return memory_manager_.FreeMemorySize();
+}
+
+
+template <class Manager>
+size_t BoundedLatencyMemoryManager<Manager>::FreeSegmentsCount() const {
+  return memory_manager_.FreeSegmentsCount();
+}
+
+
+template <class Manager>
+size_t BoundedLatencyMemoryManager<Manager>::LargestFreeSegmentSize() const {
+  return memory_manager_.LargestFreeSegmentSize();
+}
+
+
+template <class Manager>
+const MemoryManagerPlacementStatistics&
+BoundedLatencyMemoryManager<Manager>::PlacementStatistics() const {
+  return memory_manager_.PlacementStatistics();
+}
+
+
+template <class Manager>
+MemoryManagerCounters BoundedLatencyMemoryManager<Manager>::Counters() const {
+  return memory_manager_.Counters();
+}
+
+
+template <class Manager>
+int BoundedLatencyMemoryManager<Manager>::Offset(
+    ConstIterator position) const {
+  return memory_manager_.Offset(position);
+}
+
+
+template <class Manager>
+size_t BoundedLatencyMemoryManager<Manager>::AllocatedBlocksCount() const {
+  return memory_manager_.AllocatedBlocksCount();
+}
+
+
+template <class Manager>
+size_t BoundedLatencyMemoryManager<Manager>::MetadataSize() const {
+  return memory_manager_.MetadataSize() + backlog_ * sizeof(Iterator);
+}
+
+
+template <class Manager>
+void BoundedLatencyMemoryManager<Manager>::SetPriorityWatermarks(
+    const PriorityWatermarks& watermarks) {
+  memory_manager_.SetPriorityWatermarks(watermarks);
+}
+
+
+template <class Manager>
+size_t BoundedLatencyMemoryManager<Manager>::Backlog() const {
+  return backlog_;
+}
+
+
+template <class Manager>
+const BoundedLatencyStatistics&
+BoundedLatencyMemoryManager<Manager>::BoundedLatency() const {
+  return statistics_;
+}
+
+
+template <class Manager>
+size_t BoundedLatencyMemoryManager<Manager>::Maintain(size_t max_steps) {
+  size_t steps_count = 0;
+  while (steps_count < max_steps && backlog_ != 0) {
+    const std::vector<Iterator>& batch = pending_batches_.front();
+    memory_manager_.Free(batch[pending_position_]);
+    ++steps_count;
+    --backlog_;
+    if (++pending_position_ == batch.size()) {
+      pending_batches_.pop_front();
+      pending_position_ = 0;
+    }
+  }
+  return steps_count;
+}
+
+
+template <class Manager>
+typename BoundedLatencyMemoryManager<Manager>::Iterator
+BoundedLatencyMemoryManager<Manager>::CountBacklogFailure(Iterator block) {
+  if (block == memory_manager_.end() && backlog_ != 0) {
+    ++statistics_.backlog_failures;
+  }
+  return block;
+}
+
+
+template <class Manager>
+void BoundedLatencyMemoryManager<Manager>::RecordWork(size_t work_count) {
+  statistics_.max_work_per_call =
+      std::max(statistics_.max_work_per_call, work_count);
+}
+
+
+template <class Manager>
+bool MemoryManagerIdleStep(
+    BoundedLatencyMemoryManager<Manager>* memory_manager) {
+  return memory_manager->Idle(1) != 0;
+}
+
+
+template <class Manager>
+void FreeMemoryManagerBlocks(
+    Manager* memory_manager,
+    std::vector<typename Manager::Iterator> positions) {
+  for (const auto& position : positions) {
+    memory_manager->Free(position);
+  }
+}
+
+
+template <class Manager>
+void FreeMemoryManagerBlocks(
+    BoundedLatencyMemoryManager<Manager>* memory_manager,
+    std::vector<typename Manager::Iterator> positions) {
+  memory_manager->FreeBatch(std::move(positions));
+}
+
+
+template <class Manager>
+std::vector<typename Manager::Iterator> AllocateMemoryManagerGang(
+    Manager* memory_manager, const std::vector<size_t>& sizes,
+    const AllocationOptions& options) {
+  std::vector<typename Manager::Iterator> blocks;
+  blocks.reserve(sizes.size());
+  for (size_t size : sizes) {
+    auto block = memory_manager->Allocate(size, options);
+    if (block == memory_manager->end()) {
+      FreeMemoryManagerBlocks(memory_manager, std::move(blocks));
+      return std::vector<typename Manager::Iterator>();
+    }
+    blocks.push_back(block);
+  }
+  return blocks;
+}
+
+
+template <class FreeSegmentIndex>
+std::vector<MemorySegmentIterator> AllocateMemoryManagerGang(
+    BasicMemoryManager<FreeSegmentIndex>* memory_manager,
+    const std::vector<size_t>& sizes, const AllocationOptions& options) {
+  return memory_manager->AllocateGang(sizes, options);
+}
+
+
+std::vector<CompactMemoryManager::Iterator> AllocateMemoryManagerGang(
+    CompactMemoryManager* memory_manager, const std::vector<size_t>& sizes,
+    const AllocationOptions& options) {
+  return memory_manager->AllocateGang(sizes, options);
+}
+
+
+template <class Manager>
+void OutputBoundedLatencyStatistics(const Manager&, std::ostream&) {
+}
+
+
+template <class Manager>
+void OutputBoundedLatencyStatistics(
+    const BoundedLatencyMemoryManager<Manager>& memory_manager,
+    std::ostream& ostream) {
+  const BoundedLatencyStatistics& statistics =
+      memory_manager.BoundedLatency();
+  ostream << "bounded latency: " << statistics.deferred_frees
+          << " deferred frees, max backlog " << statistics.max_backlog
+          << ", max work per call " << statistics.max_work_per_call << ", "
+          << statistics.backlog_failures << " backlog failures" << endl;
+}
+
+
+/** BoundedLatencyMemoryManager: END **/
+
+
+/** MemoryManagerBank: BEGIN **/
+MemoryManagerBank::MemoryManagerBank(
+    size_t tenants_count, size_t memory_size, size_t max_segments)
+  : tenants_count_(tenants_count)
+  , max_segments_(max_segments)
+  , lefts_(std::vector<int32_t>(tenants_count * max_segments, 0))
+  , rights_(std::vector<int32_t>(tenants_count * max_segments, 0))
+  , free_masks_(std::vector<int32_t>(tenants_count * max_segments, 0))
+  , segments_counts_(std::vector<int32_t>(tenants_count, 1))
+  , found_slots_(std::vector<int32_t>(tenants_count))
+  , found_sizes_(std::vector<int32_t>(tenants_count))
+  , block_lefts_(std::vector<int32_t>(tenants_count))
+  , block_rights_(std::vector<int32_t>(tenants_count))
+{
+  for (size_t tenant = 0; tenant < tenants_count; ++tenant) {
+    rights_[Lane(0, tenant)] = memory_size;
+    free_masks_[Lane(0, tenant)] = -1;
+  }
+}
+
+
+void MemoryManagerBank::Execute(
+    const std::vector<MemoryManagerBankOperation>& operations,
+    std::vector<int64_t>* results) {
+  using Kind = MemoryManagerBankOperation::Kind;
+  FindLargestFreeSegments();
+  FindBlocks(operations);
+  results->resize(tenants_count_);
+  for (size_t tenant = 0; tenant < tenants_count_; ++tenant) {
+    const auto& operation = operations[tenant];
+    (*results)[tenant] = kFailedAllocation;
+    if (operation.kind == Kind::kAllocate) {
+      (*results)[tenant] = AllocateInTenant(tenant, operation.size);
+    } else if (operation.kind == Kind::kFree) {
+      FreeInTenant(tenant);
+    }
+  }
+}
+
+
+size_t MemoryManagerBank::TenantsCount() const {
+  return tenants_count_;
+}
+
+
+size_t MemoryManagerBank::Lane(size_t slot, size_t tenant) const {
+  return slot * tenants_count_ + tenant;
+}
+
+
+/*
+ * Для каждого арендатора — слот самого левого из наидлиннейших свободных
+ * сегментов. Размер занятого или пустого слота за счёт маски равен -1,
+ * строгое сравнение оставляет самый левый из равных.
+ */
+void MemoryManagerBank::FindLargestFreeSegments() {
+  std::fill(found_slots_.begin(), found_slots_.end(), -1);
+  std::fill(found_sizes_.begin(), found_sizes_.end(), -1);
+  int32_t* found_slots = found_slots_.data();
+  int32_t* found_sizes = found_sizes_.data();
+  for (size_t slot = 0; slot < max_segments_; ++slot) {
+    const int32_t* lefts = lefts_.data() + Lane(slot, 0);
+    const int32_t* rights = rights_.data() + Lane(slot, 0);
+    const int32_t* free_masks = free_masks_.data() + Lane(slot, 0);
+    const int32_t slot_number = slot;
+    for (size_t tenant = 0; tenant < tenants_count_; ++tenant) {
+      const int32_t size =
+          (rights[tenant] - lefts[tenant]) | ~free_masks[tenant];
+      const bool larger = size > found_sizes[tenant];
+      found_sizes[tenant] = larger ? size : found_sizes[tenant];
+      found_slots[tenant] = larger ? slot_number : found_slots[tenant];
+    }
+  }
+}
+
+
+/*
+ * Для арендаторов с операцией освобождения ищет слот занятого блока
+ * с заданными смещением и размером; он записывается поверх found_slots_.
+ * Одинаковые занятые блоки неразличимы, так что подходит любой из них.
+ */
+void MemoryManagerBank::FindBlocks(
+    const std::vector<MemoryManagerBankOperation>& operations) {
+  using Kind = MemoryManagerBankOperation::Kind;
+  for (size_t tenant = 0; tenant < tenants_count_; ++tenant) {
+    const auto& operation = operations[tenant];
+    block_lefts_[tenant] = -1;
+    block_rights_[tenant] = -1;
+    if (operation.kind == Kind::kFree) {
+      block_lefts_[tenant] = operation.offset;
+      block_rights_[tenant] = operation.offset + operation.size;
+      found_slots_[tenant] = -1;
+    }
+  }
+  int32_t* found_slots = found_slots_.data();
+  const int32_t* block_lefts = block_lefts_.data();
+  const int32_t* block_rights = block_rights_.data();
+  const int32_t* segments_counts = segments_counts_.data();
+  for (size_t slot = 0; slot < max_segments_; ++slot) {
+    const int32_t* lefts = lefts_.data() + Lane(slot, 0);
+    const int32_t* rights = rights_.data() + Lane(slot, 0);
+    const int32_t* free_masks = free_masks_.data() + Lane(slot, 0);
+    const int32_t slot_number = slot;
+    for (size_t tenant = 0; tenant < tenants_count_; ++tenant) {
+      const bool match = lefts[tenant] == block_lefts[tenant] &&
+                         rights[tenant] == block_rights[tenant] &&
+                         free_masks[tenant] == 0 &&
+                         segments_counts[tenant] > slot_number;
+      found_slots[tenant] = match ? slot_number : found_slots[tenant];
+    }
+  }
+}
+
+
+int64_t MemoryManagerBank::AllocateInTenant(size_t tenant, size_t size) {
+  const int32_t slot = found_slots_[tenant];
+  if (slot < 0 || static_cast<int64_t>(size) > found_sizes_[tenant]) {
+    return kFailedAllocation;
+  }
+  const size_t free_lane = Lane(slot, tenant);
+  if (static_cast<int64_t>(size) == found_sizes_[tenant]) {
+    free_masks_[free_lane] = 0;
+    return lefts_[free_lane];
+  }
+  InsertSlot(tenant, slot);
+  const size_t allocated_lane = Lane(slot, tenant);
+  const size_t remaining_lane = Lane(slot + 1, tenant);
+  rights_[allocated_lane] = lefts_[allocated_lane] + size;
+  free_masks_[allocated_lane] = 0;
+  lefts_[remaining_lane] = rights_[allocated_lane];
+  return lefts_[allocated_lane];
+}
+
+
+void MemoryManagerBank::FreeInTenant(size_t tenant) {
+  if (found_slots_[tenant] < 0) {
+    throw std::invalid_argument("Freeing a block that is not allocated");
+  }
+  const size_t slot = found_slots_[tenant];
+  free_masks_[Lane(slot, tenant)] = -1;
+  const size_t segments_count = segments_counts_[tenant];
+  if (slot + 1 < segments_count && free_masks_[Lane(slot + 1, tenant)]) {
+    rights_[Lane(slot, tenant)] = rights_[Lane(slot + 1, tenant)];
+    EraseSlot(tenant, slot + 1);
+  }
+  if (slot > 0 && free_masks_[Lane(slot - 1, tenant)]) {
+    rights_[Lane(slot - 1, tenant)] = rights_[Lane(slot, tenant)];
+    EraseSlot(tenant, slot);
+  }
+}
+
+
+/*
+ * Сдвигает слоты начиная со slot на один вправо; новый слот — копия
+ * прежнего slot.
+ */
+void MemoryManagerBank::InsertSlot(size_t tenant, size_t slot) {
+  const size_t segments_count = segments_counts_[tenant];
+  if (segments_count == max_segments_) {
+    throw std::length_error("Memory manager bank tenant is out of segments");
+  }
+  for (size_t moved_slot = segments_count; moved_slot > slot; --moved_slot) {
+    lefts_[Lane(moved_slot, tenant)] = lefts_[Lane(moved_slot - 1, tenant)];
+    rights_[Lane(moved_slot, tenant)] = rights_[Lane(moved_slot - 1, tenant)];
+    free_masks_[Lane(moved_slot, tenant)] =
+        free_masks_[Lane(moved_slot - 1, tenant)];
+  }
+  ++segments_counts_[tenant];
+}
+
 
-  const AllocationQuery* AsAllocationQuery() const;
-  const FreeQuery* AsFreeQuery() const;
+void MemoryManagerBank::EraseSlot(size_t tenant, size_t slot) {
+  const size_t segments_count = segments_counts_[tenant];
+  for (size_t moved_slot = slot; moved_slot + 1 < segments_count;
+       ++moved_slot) {
+    lefts_[Lane(moved_slot, tenant)] = lefts_[Lane(moved_slot + 1, tenant)];
+    rights_[Lane(moved_slot, tenant)] = rights_[Lane(moved_slot + 1, tenant)];
+    free_masks_[Lane(moved_slot, tenant)] =
+        free_masks_[Lane(moved_slot + 1, tenant)];
+  }
+  const size_t last_lane = Lane(segments_count - 1, tenant);
+  lefts_[last_lane] = 0;
+  rights_[last_lane] = 0;
+  free_masks_[last_lane] = 0;
+  --segments_counts_[tenant];
+}
 
- private:
-  class AbstractQuery {
-   public:
-    virtual ~AbstractQuery() {
-    }
 
-   protected:
-    AbstractQuery() {
-    }
-  };
+/** MemoryManagerBank: END **/
 
-  template <typename T>
-  struct ConcreteQuery : public AbstractQuery {
-    T body;
 
-    explicit ConcreteQuery(T _body)
-        : body(std::move(_body)) {
-    }
-  };
+/** MemorySegmentHeapIndex: BEGIN **/
+MemorySegmentHeapIndex::MemorySegmentHeapIndex(size_t heap_arity)
+  : heap_(MemorySegmentHeap(MemorySegmentSizeCompare(),
+                            MemorySegmentsHeapObserver(), heap_arity))
+{ }
 
-  std::unique_ptr<AbstractQuery> query_;
-};
 
-std::vector<MemoryManagerQuery> ReadMemoryManagerQueries(
-    std::istream& stream = std::cin);
+void MemorySegmentHeapIndex::reserve(size_t capacity) {
+  heap_.reserve(capacity);
+}
 
-struct MemoryManagerAllocationResponse {
-  bool success;
-  size_t position;
-};
 
-/*
-Мы предоставляем два builder'а - MakeSuccessfulAllocation и
-MakeFailedAllocation. Они позволяют создавать корректные объекты
-MemoryManagerAllocationResponse и в коде надо пользоваться ими. Но если
-захочется как-то по-особенному инициализировать поля структуры (например, для
-тестирования), то можно создать структуру с конкретными значениями полей.
-*/
-MemoryManagerAllocationResponse MakeSuccessfulAllocation(size_t position);
+void MemorySegmentHeapIndex::push(MemorySegmentIterator segment) {
+  heap_.push(segment);
+}
 
-MemoryManagerAllocationResponse MakeFailedAllocation();
 
-std::vector<MemoryManagerAllocationResponse> RunMemoryManager(
-    size_t memory_size,
-    const std::vector<MemoryManagerQuery>& queries);
+void MemorySegmentHeapIndex::erase(MemorySegmentIterator segment) {
+  heap_.erase(segment->heap_index);
+}
 
-void OutputMemoryManagerResponses(
-    const std::vector<MemoryManagerAllocationResponse>& responses,
-    std::ostream& ostream = std::cout);
 
-int main() {
-  std::ios_base::sync_with_stdio(false);
-  std::cin.tie(nullptr);
+MemorySegmentIterator MemorySegmentHeapIndex::top() const {
+  return heap_.top();
+}
 
-  std::istream& input_stream = std::cin;
-  std::ostream& output_stream = std::cout;
 
-  const size_t memory_size = ReadMemorySize(input_stream);
-  const std::vector<MemoryManagerQuery> queries =
-      ReadMemoryManagerQueries(input_stream);
+MemorySegmentIterator MemorySegmentHeapIndex::second() const {
+  return heap_.second();
+}
 
-  const std::vector<MemoryManagerAllocationResponse> responses =
-      RunMemoryManager(memory_size, queries);
 
-  OutputMemoryManagerResponses(responses, output_stream);
+size_t MemorySegmentHeapIndex::size() const {
+  return heap_.size();
+}
 
-  return 0;
+
+bool MemorySegmentHeapIndex::empty() const {
+  return heap_.empty();
 }
 
 
+HeapStatistics MemorySegmentHeapIndex::Statistics() const {
+  return heap_.Statistics();
+}
+
 
+/** MemorySegmentHeapIndex: END **/
 
 
+/** MemorySegmentHandleIndex: BEGIN **/
+MemorySegmentHandleIndex::MemorySegmentHandleIndex(size_t heap_arity)
+  : heap_(MemorySegmentHeap::WithStableHandles(MemorySegmentSizeCompare(),
+                                               heap_arity))
+{ }
 
 
+void MemorySegmentHandleIndex::reserve(size_t capacity) {
+  heap_.reserve(capacity);
+}
 
 
+void MemorySegmentHandleIndex::push(MemorySegmentIterator segment) {
+  segment->heap_index = heap_.push(segment);
+}
 
-// REALIZATION /////////////////////////////////////////////////////////
 
-size_t ReadMemorySize(std::istream& stream) {
-  size_t memory_size;
-  stream >> memory_size;
-  return memory_size;
+void MemorySegmentHandleIndex::erase(MemorySegmentIterator segment) {
+  heap_.erase(segment->heap_index);
+  segment->heap_index = MemorySegmentHeap::kNullIndex;
 }
 
 
-std::vector<MemoryManagerQuery> ReadMemoryManagerQueries(
-    std::istream& stream) {
-  unsigned queries_number;
-  stream >> queries_number;
-  std::vector<MemoryManagerQuery> queries;
-  for (auto query_n = 0U; query_n < queries_number; ++query_n) {
-    int query_numeric;
-    stream >> query_numeric;
-    if (query_numeric >= 0) {
-      AllocationQuery allocation_query = {static_cast<size_t>(query_numeric)};
-      queries.push_back(MemoryManagerQuery(allocation_query));
-    } else {
-      FreeQuery free_query = {-query_numeric - 1};
-      queries.push_back(MemoryManagerQuery(free_query));
-    }
-  }
-  return queries;
+MemorySegmentIterator MemorySegmentHandleIndex::top() const {
+  return heap_.top();
 }
 
 
-/** MemoryManagerQuery: BEGIN **/
-MemoryManagerQuery::MemoryManagerQuery(AllocationQuery allocation_query)
-  : query_(new ConcreteQuery<AllocationQuery>(allocation_query))
-{ }
+MemorySegmentIterator MemorySegmentHandleIndex::second() const {
+  return heap_.second();
+}
 
 
-MemoryManagerQuery::MemoryManagerQuery(FreeQuery free_query)
-  : query_(new ConcreteQuery<FreeQuery>(free_query))
-{ }
+size_t MemorySegmentHandleIndex::size() const {
+  return heap_.size();
+}
 
 
-const AllocationQuery* MemoryManagerQuery::AsAllocationQuery() const {
-  auto query = dynamic_cast<ConcreteQuery<AllocationQuery>*>(query_.get());
-  if (query) {
-    return &query->body;
-  }
-  return nullptr;
+bool MemorySegmentHandleIndex::empty() const {
+  return heap_.empty();
 }
 
 
-const FreeQuery* MemoryManagerQuery::AsFreeQuery() const {
-  auto query = dynamic_cast<ConcreteQuery<FreeQuery>*>(query_.get());
-  if (query) {
-    return &query->body;
-  }
-  return nullptr;
+HeapStatistics MemorySegmentHandleIndex::Statistics() const {
+  return heap_.Statistics();
 }
 
 
-/** MemoryManagerQuery: END **/
+/** MemorySegmentHandleIndex: END **/
 
 
-std::vector<MemoryManagerAllocationResponse> RunMemoryManager(
-    size_t memory_size,
-    const std::vector<MemoryManagerQuery>& queries) {
-  MemoryManager memory_manager(memory_size);
-  std::vector<MemoryManager::Iterator> results(queries.size());
-  std::vector<MemoryManagerAllocationResponse> responses;
-  for (auto query_n = 0U; query_n < queries.size(); ++query_n) {
-    const auto& query = queries[query_n];
-    if (auto query_pointer = query.AsAllocationQuery()) {
-      auto result = memory_manager.Allocate(query_pointer->allocation_size);
-      results[query_n] = result;
-      if (result != memory_manager.end()) {
-        responses.push_back(MakeSuccessfulAllocation(result->left));
-      } else {
-        responses.push_back(MakeFailedAllocation());
-      }
-    } else if (auto query_pointer = query.AsFreeQuery()) {
-      results[query_n] = memory_manager.end();
-      auto query_index = query_pointer->allocation_query_index;
-      if (results[query_index] != memory_manager.end()) {
-        memory_manager.Free(results[query_index]);
-      }
-    } else {
-      throw std::logic_error("Unknown Memory Manager query!");
-    }
+/** BucketedMemorySegmentHeap: BEGIN **/
+BucketedMemorySegmentHeap::BucketedMemorySegmentHeap(size_t heap_arity)
+  : buckets_heap_(Heap<Bucket*, BucketSizeCompare>(
+        BucketSizeCompare(), BucketHeapObserver(), heap_arity))
+  , buckets_(std::unordered_map<size_t, Bucket>())
+  , segments_count_(0)
+  , buckets_statistics_(HeapStatistics())
+{ }
+
+
+void BucketedMemorySegmentHeap::reserve(size_t capacity) {
+  buckets_.reserve(capacity);
+  buckets_heap_.reserve(capacity);
+}
+
+
+void BucketedMemorySegmentHeap::push(MemorySegmentIterator segment) {
+  auto inserted = buckets_.try_emplace(segment->Size(), segment->Size());
+  Bucket& bucket = inserted.first->second;
+  const HeapStatistics before = bucket.segments.Statistics();
+  bucket.segments.push(segment);
+  AccountBucketWork(before, bucket);
+  if (inserted.second) {
+    buckets_heap_.push(&bucket);
   }
-  return responses;
+  ++segments_count_;
 }
 
 
-MemoryManagerAllocationResponse MakeSuccessfulAllocation(size_t position) {
-  MemoryManagerAllocationResponse response = {true, position};
-  return response;
+void BucketedMemorySegmentHeap::erase(MemorySegmentIterator segment) {
+  auto bucket_iterator = buckets_.find(segment->Size());
+  Bucket& bucket = bucket_iterator->second;
+  const HeapStatistics before = bucket.segments.Statistics();
+  bucket.segments.erase(segment->heap_index);
+  AccountBucketWork(before, bucket);
+  if (bucket.segments.empty()) {
+    buckets_heap_.erase(bucket.heap_index);
+    buckets_.erase(bucket_iterator);
+  }
+  --segments_count_;
 }
 
 
-MemoryManagerAllocationResponse MakeFailedAllocation() {
-  MemoryManagerAllocationResponse response = {false, 0};
-  return response;
+MemorySegmentIterator BucketedMemorySegmentHeap::top() const {
+  return buckets_heap_.top()->segments.top();
 }
 
 
-void OutputMemoryManagerResponses(
-    const std::vector<MemoryManagerAllocationResponse>& responses,
-    std::ostream& ostream) {
-  for (auto& response : responses) {
-    if (response.success) {
-      ostream << response.position + 1 << endl;
-    } else {
-      ostream << -1 << endl;
-    }
+/*
+ * Следующий сегмент того же размера, если он есть, иначе самый левый
+ * в следующей по размеру корзине.
+ */
+MemorySegmentIterator BucketedMemorySegmentHeap::second() const {
+  const Bucket* top_bucket = buckets_heap_.top();
+  if (top_bucket->segments.size() > 1) {
+    return top_bucket->segments.second();
   }
+  return buckets_heap_.second()->segments.top();
 }
 
 
-/** MemoryManager: BEGIN **/
-MemoryManager::MemoryManager(size_t memory_size)
-  : free_memory_segments_(MemorySegmentHeap(MemorySegmentSizeCompare(),
-                                            MemorySegmentsHeapObserver()))
-  , memory_segments_(std::list<MemorySegment>())
-{
-  MemorySegment initial_memory(0, memory_size);
-  auto memory_segment_iterator =
-      memory_segments_.insert(memory_segments_.end(), initial_memory);
-  free_memory_segments_.push(memory_segment_iterator);
+size_t BucketedMemorySegmentHeap::size() const {
+  return segments_count_;
 }
 
 
-MemoryManager::Iterator MemoryManager::Allocate(size_t size) {
-  if (free_memory_segments_.empty()) {
-    return end();
-  }
-  auto max_free_memory_segment_iterator = free_memory_segments_.top();
-  if (size > max_free_memory_segment_iterator->Size()) {
-    return end();
-  }
-  if (size == max_free_memory_segment_iterator->Size()) {
-    free_memory_segments_.erase(max_free_memory_segment_iterator->heap_index);
-    return max_free_memory_segment_iterator;
-  }
-  auto allocated_memory_iterator =
-      memory_segments_.insert(
-        max_free_memory_segment_iterator,
-        MemorySegment(max_free_memory_segment_iterator->left,
-                      max_free_memory_segment_iterator->left + size));
-  max_free_memory_segment_iterator->left = allocated_memory_iterator->right;
-  free_memory_segments_.erase(max_free_memory_segment_iterator->heap_index);
-  free_memory_segments_.push(max_free_memory_segment_iterator);
-  return allocated_memory_iterator;
+bool BucketedMemorySegmentHeap::empty() const {
+  return segments_count_ == 0;
 }
 
 
-void MemoryManager::Free(Iterator position) {
-  auto left_iterator = std::prev(position);
-  auto right_iterator = std::next(position);
-  if (position != memory_segments_.begin()) {
-    AppendIfFree(position, left_iterator);
-  }
-  if (right_iterator != memory_segments_.end()) {
-    AppendIfFree(position, right_iterator);
-  }
-  free_memory_segments_.push(position);
+HeapStatistics BucketedMemorySegmentHeap::Statistics() const {
+  HeapStatistics statistics = buckets_heap_.Statistics();
+  statistics.operations += buckets_statistics_.operations;
+  statistics.sift_steps += buckets_statistics_.sift_steps;
+  return statistics;
 }
 
 
-MemoryManager::Iterator MemoryManager::end() {
-  return memory_segments_.end();
+/*
+ * Корзины создаются и удаляются, поэтому их счётчики копятся отдельно.
+ */
+void BucketedMemorySegmentHeap::AccountBucketWork(
+    const HeapStatistics& before, const Bucket& bucket) {
+  const HeapStatistics& after = bucket.segments.Statistics();
+  buckets_statistics_.operations += after.operations - before.operations;
+  buckets_statistics_.sift_steps += after.sift_steps - before.sift_steps;
 }
 
 
-MemoryManager::ConstIterator MemoryManager::end() const {
-  return memory_segments_.cend();
+BucketedMemorySegmentHeap::Bucket::Bucket(size_t size)
+  : size(size)
+  , heap_index(MemorySegmentHeap::kNullIndex)
+  , segments(MemorySegmentLeftHeap(MemorySegmentLeftCompare(),
+                                   MemorySegmentsHeapObserver()))
+{ }
+
+
+bool BucketedMemorySegmentHeap::BucketSizeCompare::operator() (
+    const Bucket* first, const Bucket* second) const {
+  return first->size > second->size;
 }
 
 
-void MemoryManager::AppendIfFree(Iterator remaining, Iterator appending) {
-  if (appending->heap_index != MemorySegmentHeap::kNullIndex) {
-    *remaining = remaining->Unite(*appending);
-    free_memory_segments_.erase(appending->heap_index);
-    memory_segments_.erase(appending);
-  }
+void BucketedMemorySegmentHeap::BucketHeapObserver::operator() (
+    Bucket* bucket, size_t new_index) const {
+  bucket->heap_index = new_index;
 }
 
 
-/** MemoryManager: END **/
+/** BucketedMemorySegmentHeap: END **/
 
 
 void MemorySegmentsHeapObserver::operator() (
@@ -423,6 +8626,12 @@ bool MemorySegmentSizeCompare::operator() (
 }
 
 
+bool MemorySegmentLeftCompare::operator() (
+    MemorySegmentIterator first, MemorySegmentIterator second) const {
+  return first->left < second->left;
+}
+
+
 /** MemorySegment: BEGIN **/
 MemorySegment::MemorySegment(int left, int right)
   : left(left), right(right), heap_index(MemorySegmentHeap::kNullIndex)
@@ -451,28 +8660,100 @@ MemorySegment MemorySegment::Unite(const MemorySegment& other) const {
 /** Heap: BEGIN **/
 template <class T, class Compare>
 Heap<T, Compare>::Heap(
-    Compare compare, IndexChangeObserver index_change_observer)
+    Compare compare, IndexChangeObserver index_change_observer, size_t arity)
   : index_change_observer_(index_change_observer)
   , compare_(compare)
   , elements_(std::vector<T>())
-{ }
+  , statistics_(HeapStatistics())
+  , arity_(arity)
+  , arity_shift_(0)
+  , stable_handles_(false)
+  , element_handles_(std::vector<size_t>())
+  , handle_positions_(std::vector<size_t>())
+  , free_handles_(std::vector<size_t>())
+{
+  if (arity < 2 || (arity & (arity - 1)) != 0) {
+    throw std::invalid_argument("Heap arity must be a power of two");
+  }
+  while ((size_t(1) << arity_shift_) < arity) {
+    ++arity_shift_;
+  }
+}
+
+
+template <class T, class Compare>
+Heap<T, Compare> Heap<T, Compare>::WithStableHandles(
+    Compare compare, size_t arity) {
+  Heap heap(compare, IndexChangeObserver(), arity);
+  heap.stable_handles_ = true;
+  return heap;
+}
 
 
 template <class T, class Compare>
 size_t Heap<T, Compare>::push(const T& value) {
+  ++statistics_.operations;
   elements_.push_back(value);
   NotifyIndexChange(value, this->size() - 1);
-  return SiftUp(this->size() - 1);
+  if (!stable_handles_) {
+    return SiftUp(this->size() - 1);
+  }
+  size_t handle = handle_positions_.size();
+  if (free_handles_.empty()) {
+    handle_positions_.push_back(this->size() - 1);
+  } else {
+    handle = free_handles_.back();
+    free_handles_.pop_back();
+    handle_positions_[handle] = this->size() - 1;
+  }
+  element_handles_.push_back(handle);
+  SiftUp(this->size() - 1);
+  return handle;
 }
 
 
 template <class T, class Compare>
 void Heap<T, Compare>::erase(size_t index) {
+  ++statistics_.operations;
+  ErasePosition(Position(index));
+}
+
+
+/*
+ * Удаление по позиции в массиве; erase переводит в неё индекс или ручку,
+ * а pop удаляет вершину, у которой позиция 0 в любом режиме.
+ */
+template <class T, class Compare>
+void Heap<T, Compare>::ErasePosition(size_t index) {
   SwapElements(index, this->size() - 1);
   NotifyIndexChange(elements_.back(), kNullIndex);
   elements_.pop_back();
-  SiftUp(index);
-  SiftDown(index);
+  if (stable_handles_) {
+    handle_positions_[element_handles_.back()] = kNullIndex;
+    free_handles_.push_back(element_handles_.back());
+    element_handles_.pop_back();
+  }
+  if (index < this->size()) {
+    SiftUp(index);
+    SiftDown(index);
+  }
+}
+
+
+/*
+ * Восстанавливает порядок после того, как ключ элемента поменяли снаружи.
+ */
+template <class T, class Compare>
+void Heap<T, Compare>::update(size_t index) {
+  ++statistics_.operations;
+  index = Position(index);
+  SiftDown(SiftUp(index));
+}
+
+
+template <class T, class Compare>
+const T& Heap<T, Compare>::get(size_t index) const {
+  return elements_[Position(index)];
 }
 
 
@@ -482,9 +8763,34 @@ const T& Heap<T, Compare>::top() const {
 }
 
 
+template <class T, class Compare>
+const T& Heap<T, Compare>::second() const {
+  size_t best_son_index = 1;
+  const size_t last_son_index = std::min(1 + arity_, this->size());
+  for (size_t son_index = 2; son_index < last_son_index; ++son_index) {
+    if (CompareElements(son_index, best_son_index)) {
+      best_son_index = son_index;
+    }
+  }
+  return elements_[best_son_index];
+}
+
+
 template <class T, class Compare>
 void Heap<T, Compare>::pop() {
-  erase(0);
+  ++statistics_.operations;
+  ErasePosition(0);
+}
+
+
+template <class T, class Compare>
+void Heap<T, Compare>::reserve(size_t capacity) {
+  elements_.reserve(capacity);
+  if (stable_handles_) {
+    element_handles_.reserve(capacity);
+    handle_positions_.reserve(capacity);
+    free_handles_.reserve(capacity);
+  }
 }
 
 
@@ -501,24 +8807,27 @@ bool Heap<T, Compare>::empty() const {
 
 
 template <class T, class Compare>
-size_t Heap<T, Compare>::Parent(size_t index) const {
-  return index ? (index - 1) / 2 : kNullIndex;
+const HeapStatistics& Heap<T, Compare>::Statistics() const {
+  return statistics_;
+}
+
+
+template <class T, class Compare>
+size_t Heap<T, Compare>::Position(size_t index) const {
+  return stable_handles_ ? handle_positions_[index] : index;
 }
 
 
 template <class T, class Compare>
-size_t Heap<T, Compare>::LeftSon(size_t index) const {
-  return index < this->size() / 2 ?
-        2 * index + 1 :
-        kNullIndex;
+size_t Heap<T, Compare>::Parent(size_t index) const {
+  return index ? (index - 1) >> arity_shift_ : kNullIndex;
 }
 
 
 template <class T, class Compare>
-size_t Heap<T, Compare>::RightSon(size_t index) const {
-  return this->size() > 2 && index < (this->size() - 1) / 2 ?
-        2 * index + 2 :
-        kNullIndex;
+size_t Heap<T, Compare>::FirstSon(size_t index) const {
+  const size_t first_son_index = (index << arity_shift_) + 1;
+  return first_son_index < this->size() ? first_son_index : kNullIndex;
 }
 
 
@@ -540,38 +8849,145 @@ void Heap<T, Compare>::NotifyIndexChange(
 
 template <class T, class Compare>
 void Heap<T, Compare>::SwapElements(size_t first_index, size_t second_index) {
+  ++statistics_.sift_steps;
   NotifyIndexChange(elements_[first_index], second_index);
   NotifyIndexChange(elements_[second_index], first_index);
   std::swap(elements_[first_index], elements_[second_index]);
+  if (stable_handles_) {
+    std::swap(element_handles_[first_index], element_handles_[second_index]);
+    handle_positions_[element_handles_[first_index]] = first_index;
+    handle_positions_[element_handles_[second_index]] = second_index;
+  }
 }
 
 
 template <class T, class Compare>
 size_t Heap<T, Compare>::SiftUp(size_t index) {
+  const size_t start_index = index;
+  size_t depth = 0;
   while (Parent(index) != kNullIndex && CompareElements(index, Parent(index))) {
     SwapElements(index, Parent(index));
     index = Parent(index);
+    ++depth;
   }
+  MEMORY_MANAGER_PROBE3(heap_sift_up, start_index, index, depth);
   return index;
 }
 
 
 template <class T, class Compare>
 void Heap<T, Compare>::SiftDown(size_t index) {
-  while (LeftSon(index) != kNullIndex) {
-    auto best_son_index = LeftSon(index);
-    if (RightSon(index) != kNullIndex &&
-        CompareElements(RightSon(index), LeftSon(index))) {
-      best_son_index = RightSon(index);
+  const size_t start_index = index;
+  size_t final_index = index;
+  size_t depth = 0;
+  while (FirstSon(index) != kNullIndex) {
+    auto best_son_index = FirstSon(index);
+    const auto last_son_index =
+        std::min(best_son_index + arity_, this->size());
+    for (auto son_index = best_son_index + 1; son_index < last_son_index;
+         ++son_index) {
+      if (CompareElements(son_index, best_son_index)) {
+        best_son_index = son_index;
+      }
     }
     if (CompareElements(best_son_index, index)) {
       SwapElements(best_son_index, index);
       index = best_son_index;
+      final_index = index;
+      ++depth;
     } else {
       index = kNullIndex;
     }
   }
+  MEMORY_MANAGER_PROBE3(heap_sift_down, start_index, final_index, depth);
 }
 
 
 /** Heap: END **/
+
+
+/** Heap self-check: BEGIN **/
+bool CheckHeapPopOrder(std::ostream& report) {
+  const size_t kOperationsCount = 20000;
+  bool consistent = true;
+  uint64_t random_state = 88172645463325252ULL;
+  for (bool stable_handles : {false, true}) {
+    for (size_t arity : {2, 4, 8}) {
+      Heap<uint64_t> heap =
+          stable_handles ?
+          Heap<uint64_t>::WithStableHandles(std::less<uint64_t>(), arity) :
+          Heap<uint64_t>(std::less<uint64_t>(),
+                         Heap<uint64_t>::IndexChangeObserver(), arity);
+      // Живые элементы (все различны) и их ручки.
+      std::map<uint64_t, size_t> live;
+      bool ordered = true;
+      auto check_top = [&]() {
+        if (!live.empty() && heap.top() != live.begin()->first) {
+          ordered = false;
+        }
+      };
+      for (size_t operation_n = 0; operation_n < kOperationsCount;
+           ++operation_n) {
+        const uint64_t choice = NextRandom(&random_state) % 10;
+        if (choice < 5 || live.empty()) {
+          const uint64_t value = NextRandom(&random_state);
+          if (live.count(value) == 0) {
+            live.emplace(value, heap.push(value));
+          }
+        } else if (choice < 8 || !stable_handles) {
+          live.erase(live.begin());
+          heap.pop();
+        } else {
+          auto victim = live.begin();
+          std::advance(victim, NextRandom(&random_state) % live.size());
+          if (heap.get(victim->second) != victim->first) {
+            ordered = false;
+          }
+          heap.erase(victim->second);
+          live.erase(victim);
+        }
+        check_top();
+      }
+      uint64_t previous = 0;
+      while (!heap.empty()) {
+        if (heap.top() < previous) {
+          ordered = false;
+        }
+        previous = heap.top();
+        heap.pop();
+      }
+      report << "heap pop order ("
+             << (stable_handles ? "stable handles" : "positions")
+             << ", arity " << arity << "): "
+             << (ordered ? "ok" : "FAILED") << endl;
+      consistent = consistent && ordered;
+    }
+  }
+  return consistent;
+}
+
+
+/** Heap self-check: END **/
+
+
+/** Autotune self-check: BEGIN **/
+bool CheckAutotunePrefix(std::ostream& report) {
+  // Префикс из двух запросов кончается посреди пачки b.
+  std::istringstream trace("MMTRACE 2\n100 4\na 10\nb 3 5 5 5\n");
+  const int trace_version = ReadMemoryManagerTraceVersion(trace);
+  const size_t memory_size = ReadMemorySize(trace);
+  const std::vector<MemoryManagerQuery> queries =
+      ReadMemoryManagerQueries(trace, trace_version, memory_size);
+  const size_t kPrefixSize = 2;
+  const bool consistent = AutotunePrefixSize(queries, kPrefixSize) == 4;
+  // Под санитайзером прогон ловит выход за таблицу результатов.
+  std::ostringstream table;
+  AutotuneEngineConfiguration(memory_size, queries, kPrefixSize,
+                              EngineConfiguration(), table);
+  report << "autotune prefix cut inside a batch: "
+         << (consistent ? "ok" : "FAILED") << endl;
+  return consistent;
+}
+
+
+/** Autotune self-check: END **/